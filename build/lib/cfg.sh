@@ -126,6 +126,7 @@ X_CFGFS="${CUR_DIR}/../cfgfs-${CFGNAME}.img"
 
 X_UBOOT_KERNROOTIMG=${X_UBOOT_KERNROOTIMG:="NO"}
 TPLINK_SKIP_ROOTFS=${TPLINK_SKIP_ROOTFS:="NO"}
+TPLINK_V2_IMAGE=${TPLINK_V2_IMAGE:="NO"}
 X_UBOOT_AIRSTATION_PREAMBLE=${X_UBOOT_AIRSTATION_PREAMBLE:="NO"}
 
 # Defaults!
@@ -134,6 +135,16 @@ X_FSIMAGE_ARGS=${X_FSIMAGE_ARGS:="-s 16384"}
 X_FSIMAGE_SUFFIX=${X_FSIMAGE_SUFFIX:=".uzip"}
 X_ROOTFS_DEV=${X_ROOTFS_DEV:="/dev/da0"}
 
+# X_KERNEL_KZIP - gzip the kernel with programs/kzip, the optimal-parse
+# deflate encoder, instead of gzip -9; X_KERNEL_KZIP_LEVEL is its effort,
+# 1 (fastest) to 9 (smallest).  X_KERNEL_GZIP is the resulting command.
+X_KERNEL_KZIP=${X_KERNEL_KZIP:="NO"}
+X_KERNEL_KZIP_LEVEL=${X_KERNEL_KZIP_LEVEL:="6"}
+X_KERNEL_GZIP="gzip -9"
+if [ "x${X_KERNEL_KZIP}" = "xYES" ]; then
+	X_KERNEL_GZIP="${SCRIPT_DIR}/../../programs/kzip/kzip -${X_KERNEL_KZIP_LEVEL}"
+fi
+
 # Configuration file template defaults
 X_CFG_DEFAULT_ETHER=${X_CFG_DEFAULT_ETHER:="arge0"}
 X_CFG_DEFAULT_HOSTNAME=${X_CFG_DEFAULT_HOSTNAME:="freebsd-wifi"}
@@ -0,0 +1,311 @@
+/*
+ * kzip.c
+ *
+ * gzip for kernel payloads: the deflate stream comes from zdeflate.c, an
+ * optimal-parse encoder that spends seconds where gzip -9 spends
+ * milliseconds, for a stream any inflater reads, the loaders' tinfl.c
+ * included.  The header is the plain 10 bytes (no name, no time), which is
+ * all tinfl's TINFL_FLAG_PARSE_GZIP_HEADER skips, and the trailer carries
+ * the CRC32 and ISIZE the loader checks.  zlib deflates the input at gzip -9
+ * settings too, and where its stream is the smaller one it is kept, so the
+ * output is never larger than gzip -9's.
+ *
+ * With -r, each file is compressed with zlib at gzip -9 settings and by
+ * kzip, the result is checked to inflate back to the file, and the sizes
+ * and times are reported instead of writing anything out.
+ *
+ * usage: kzip [-1..-9] [file] > file.gz
+ *        kzip [-1..-9] -r file ...
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "zdeflate.h"
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec + tv.tv_usec / 1e6);
+}
+
+static uint8_t *
+read_all(FILE *f, size_t *len)
+{
+	uint8_t *buf = NULL, *p;
+	size_t size = 0, n;
+
+	*len = 0;
+	do {
+		if (*len == size) {
+			size = size ? size * 2 : 0x100000;
+			if ((p = realloc(buf, size)) == NULL) {
+				free(buf);
+				return (NULL);
+			}
+			buf = p;
+		}
+		*len += n = fread(buf + *len, 1, size - *len, f);
+	} while (n != 0);
+	if (ferror(f)) {
+		free(buf);
+		return (NULL);
+	}
+	return (buf);
+}
+
+static void
+put_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/* Raw deflate of in at gzip -9 settings, malloc'ed. */
+static int
+zlib9(const uint8_t *in, size_t len, uint8_t **out, size_t *outlen)
+{
+	z_stream zs;
+	size_t bound;
+	int ret;
+
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+	    Z_DEFAULT_STRATEGY) != Z_OK) {
+		errno = ENOMEM;
+		return (-1);
+	}
+	bound = deflateBound(&zs, len);
+	if ((*out = malloc(bound)) == NULL) {
+		deflateEnd(&zs);
+		return (-1);
+	}
+	zs.next_in = (uint8_t *)in;
+	zs.avail_in = len;
+	zs.next_out = *out;
+	zs.avail_out = bound;
+	ret = deflate(&zs, Z_FINISH);
+	*outlen = zs.total_out;
+	deflateEnd(&zs);
+	if (ret != Z_STREAM_END) {
+		free(*out);
+		errno = ENOMEM;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * The gzip stream of in, malloc'ed, from zdeflate or from zlib, whichever
+ * is smaller; *byzlib says which.
+ */
+static uint8_t *
+kzip(const struct zd_opts *opts, const uint8_t *in, size_t len,
+    size_t *gzlen, int *byzlib)
+{
+	static const uint8_t hdr[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 2, 3 };
+	uint8_t *def, *zdef, *gz;
+	size_t deflen, zdeflen;
+
+	if (zd_deflate(opts, in, len, &def, &deflen) != 0)
+		return (NULL);
+	if (zlib9(in, len, &zdef, &zdeflen) != 0) {
+		free(def);
+		return (NULL);
+	}
+	if ((*byzlib = zdeflen < deflen)) {
+		free(def);
+		def = zdef;
+		deflen = zdeflen;
+	} else
+		free(zdef);
+	if ((gz = malloc(sizeof(hdr) + deflen + 8)) == NULL) {
+		free(def);
+		return (NULL);
+	}
+	memcpy(gz, hdr, sizeof(hdr));
+	memcpy(gz + sizeof(hdr), def, deflen);
+	put_le32(gz + sizeof(hdr) + deflen, crc32(0, in, len));
+	put_le32(gz + sizeof(hdr) + deflen + 4, len);
+	*gzlen = sizeof(hdr) + deflen + 8;
+	free(def);
+	return (gz);
+}
+
+/* gzip -9n of in, into a buffer of *outlen bytes. */
+static int
+gzip9(uint8_t *out, size_t *outlen, const uint8_t *in, size_t len)
+{
+	z_stream zs;
+	int ret;
+
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8,
+	    Z_DEFAULT_STRATEGY) != Z_OK)
+		return (-1);
+	zs.next_in = (uint8_t *)in;
+	zs.avail_in = len;
+	zs.next_out = out;
+	zs.avail_out = *outlen;
+	ret = deflate(&zs, Z_FINISH);
+	*outlen = zs.total_out;
+	deflateEnd(&zs);
+	return (ret == Z_STREAM_END ? 0 : -1);
+}
+
+/* Whether gz inflates, trailer and all, to the len bytes at ref. */
+static int
+gunzip_check(const uint8_t *gz, size_t gzlen, const uint8_t *ref, size_t len)
+{
+	z_stream zs;
+	uint8_t *out;
+	int ret;
+
+	if ((out = malloc(len + 1)) == NULL)
+		return (-1);
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) {
+		free(out);
+		return (-1);
+	}
+	zs.next_in = (uint8_t *)gz;
+	zs.avail_in = gzlen;
+	zs.next_out = out;
+	zs.avail_out = len + 1;
+	ret = inflate(&zs, Z_FINISH);
+	ret = ret == Z_STREAM_END && zs.total_out == len && zs.avail_in == 0 &&
+	    memcmp(out, ref, len) == 0 ? 0 : -1;
+	inflateEnd(&zs);
+	free(out);
+	return (ret);
+}
+
+static int
+report(const struct zd_opts *opts, int level, const char *name)
+{
+	uint8_t *in, *gz = NULL, *kz = NULL;
+	size_t len, gzlen, kzlen;
+	double t, tk;
+	FILE *f;
+	int byzlib, ret = -1;
+
+	if ((f = fopen(name, "rb")) == NULL || (in = read_all(f, &len)) == NULL) {
+		perror(name);
+		if (f != NULL)
+			fclose(f);
+		return (-1);
+	}
+	fclose(f);
+	gzlen = len + len / 1000 + 1024;
+	if ((gz = malloc(gzlen)) == NULL) {
+		perror("malloc");
+		goto done;
+	}
+	t = now();
+	if (gzip9(gz, &gzlen, in, len) != 0) {
+		printf("%s: deflate failed\n", name);
+		goto done;
+	}
+	t = now() - t;
+	tk = now();
+	if ((kz = kzip(opts, in, len, &kzlen, &byzlib)) == NULL) {
+		perror("kzip");
+		goto done;
+	}
+	tk = now() - tk;
+	if (gunzip_check(kz, kzlen, in, len) != 0) {
+		printf("%s: FAILED, the kzip stream does not inflate to the "
+		    "input\n", name);
+		goto done;
+	}
+	printf("%s: %zu bytes\n", name, len);
+	printf("  gzip -9    %9zu bytes %8.2f s\n", gzlen, t);
+	printf("  kzip -%d    %9zu bytes %8.2f s, %zd saved (%.2f%%)%s\n", level,
+	    kzlen, tk, (ssize_t)(gzlen - kzlen),
+	    100.0 * ((double)gzlen - kzlen) / gzlen,
+	    byzlib ? ", zlib's stream kept" : "");
+	ret = 0;
+done:
+	free(in);
+	free(gz);
+	free(kz);
+	return (ret);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: kzip [-1..-9] [file] > file.gz\n"
+	    "       kzip [-1..-9] -r file ...\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct zd_opts opts;
+	uint8_t *in, *gz;
+	size_t len, gzlen;
+	int ch, level = 6, rep = 0, byzlib, ret = 0;
+	FILE *f = stdin;
+
+	while ((ch = getopt(argc, argv, "123456789r")) != -1) {
+		switch (ch) {
+		case '1': case '2': case '3': case '4': case '5':
+		case '6': case '7': case '8': case '9':
+			level = ch - '0';
+			break;
+		case 'r':
+			rep = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	zd_level(&opts, level);
+
+	if (rep) {
+		if (argc == 0)
+			usage();
+		for (; argc > 0; argc--, argv++)
+			if (report(&opts, level, argv[0]) != 0)
+				ret = 1;
+		return (ret);
+	}
+
+	if (argc > 1)
+		usage();
+	if (argc == 1 && (f = fopen(argv[0], "rb")) == NULL) {
+		perror(argv[0]);
+		return (1);
+	}
+	if ((in = read_all(f, &len)) == NULL) {
+		perror(argc == 1 ? argv[0] : "stdin");
+		return (1);
+	}
+	if ((gz = kzip(&opts, in, len, &gzlen, &byzlib)) == NULL) {
+		perror("kzip");
+		return (1);
+	}
+	if (fwrite(gz, 1, gzlen, stdout) != gzlen || fflush(stdout) != 0) {
+		perror("stdout");
+		return (1);
+	}
+	free(in);
+	free(gz);
+	return (0);
+}
@@ -0,0 +1,1089 @@
+/*
+ * zdeflate.c
+ *
+ * Optimal-parse deflate encoder.  The input is handled in 1 MB slices,
+ * each with the 32 KB before it as the window; a tail of less than half a
+ * slice goes with the slice before it rather than pay for code tables of
+ * its own:
+ *
+ * 1. Every match worth knowing at each position is found once, with hash
+ *    chains, and cached as a short list of (length, distance) steps: the
+ *    nearest distance for each range of lengths.
+ * 2. A lazy parse of the slice is split into blocks where the estimated
+ *    compressed size drops most, as zopfli does.
+ * 3. Each block is parsed again as a shortest path over its bytes, with
+ *    the bit costs of the symbols the previous pass produced, for a
+ *    number of iterations; the smallest result is kept.  A parse for the
+ *    fixed Huffman codes is tried too.
+ * 4. The optimized symbols are split once more, and whichever split is
+ *    smaller is written, each block as stored, fixed or dynamic, whatever
+ *    is smallest.  Code lengths are limited to 15 (7 for the code length
+ *    code) by moving leaves up the tree, as JPEG does.
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zdeflate.h"
+
+#define	ZD_WSIZE	32768
+#define	ZD_MIN_MATCH	3
+#define	ZD_MAX_MATCH	258
+#define	ZD_HASH_BITS	16
+#define	ZD_CACHE	8		/* match steps kept per position */
+#define	ZD_SLICE	(1 << 20)
+#define	ZD_SLICE_MAX	(ZD_SLICE + ZD_SLICE / 2)
+#define	ZD_NUM_LL	288
+#define	ZD_NUM_D	30
+#define	ZD_NUM_CL	19
+#define	ZD_SPLIT_SAMPLES 9
+#define	ZD_MAX_BLOCKS	32		/* per slice, whatever max_blocks says */
+#define	ZD_INF		1e30f
+
+struct zd_sym {
+	uint16_t	len;	/* literal byte if dist is 0 */
+	uint16_t	dist;
+};
+
+struct zd_store {
+	struct zd_sym	*sym;
+	size_t		n, size;
+};
+
+struct zd_step {
+	uint16_t	len;	/* lengths above the previous step's, up to len */
+	uint16_t	dist;	/* are found at dist */
+};
+
+struct zd_hist {
+	uint32_t	ll[ZD_NUM_LL];
+	uint32_t	d[ZD_NUM_D];
+	size_t		bytes;
+};
+
+struct zd_cost {
+	float		lit[256];
+	float		len[ZD_MAX_MATCH + 1];
+	float		d[ZD_NUM_D];
+};
+
+/* A block to write: symbols [start, end) of a store, and its bytes. */
+struct zd_block {
+	size_t		start, end, pos, bytes;
+	int		type;
+};
+
+struct zd_out {
+	uint8_t		*buf;
+	size_t		len, size;
+	uint32_t	bits;
+	int		nbits;
+	int		error;
+};
+
+struct zd_state {
+	const struct zd_opts *opts;
+	const uint8_t	*in;
+	size_t		inlen;
+	size_t		ms, me;		/* slice */
+	struct zd_step	*cache;		/* ZD_CACHE per slice position */
+	uint8_t		*ncache;
+	uint32_t	*same;		/* run of equal bytes at each position */
+	float		*cost;
+	struct zd_sym	*path;
+	struct zd_out	out;
+};
+
+static const uint16_t len_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15,
+    17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227,
+    258 };
+static const uint8_t len_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1,
+    2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t dist_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33,
+    49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097,
+    6145, 8193, 12289, 16385, 24577 };
+static const uint8_t dist_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4,
+    5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const uint8_t cl_order[ZD_NUM_CL] = { 16, 17, 18, 0, 8, 7, 9, 6, 10,
+    5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+static uint8_t len_sym[ZD_MAX_MATCH + 1];	/* minus 257 */
+
+void
+zd_level(struct zd_opts *opts, int level)
+{
+	static const int iterations[9] = { 1, 2, 3, 5, 8, 10, 15, 20, 30 };
+	static const int chain[9] = { 32, 64, 128, 256, 512, 1024, 2048, 4096,
+	    8192 };
+
+	if (level < 1)
+		level = 1;
+	if (level > 9)
+		level = 9;
+	opts->iterations = iterations[level - 1];
+	opts->max_chain = chain[level - 1];
+	opts->max_blocks = 15;
+}
+
+static int
+dist_sym(unsigned d)
+{
+	int l;
+
+	if (d <= 4)
+		return (d - 1);
+	l = 31 - __builtin_clz(d - 1);
+	return (2 * l + (((d - 1) >> (l - 1)) & 1));
+}
+
+/* Output */
+
+static void
+out_grow(struct zd_out *o, size_t n)
+{
+	uint8_t *p;
+	size_t size;
+
+	if (o->len + n <= o->size || o->error)
+		return;
+	size = o->size ? o->size : 0x10000;
+	while (size < o->len + n)
+		size *= 2;
+	if ((p = realloc(o->buf, size)) == NULL) {
+		o->error = 1;
+		return;
+	}
+	o->buf = p;
+	o->size = size;
+}
+
+static void
+put_bits(struct zd_out *o, uint32_t v, int n)
+{
+	o->bits |= v << o->nbits;
+	o->nbits += n;
+	while (o->nbits >= 8) {
+		out_grow(o, 1);
+		if (!o->error)
+			o->buf[o->len++] = o->bits;
+		o->bits >>= 8;
+		o->nbits -= 8;
+	}
+}
+
+/* Huffman codes go out from their most significant bit. */
+static void
+put_code(struct zd_out *o, uint32_t code, int n)
+{
+	uint32_t r = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		r |= ((code >> i) & 1) << (n - 1 - i);
+	put_bits(o, r, n);
+}
+
+static void
+put_align(struct zd_out *o)
+{
+	if (o->nbits > 0)
+		put_bits(o, 0, 8 - o->nbits);
+}
+
+/* Huffman codes */
+
+/*
+ * Code lengths for n symbols of the given frequencies, at most limit bits
+ * long.  Lengths come from a Huffman tree; leaves deeper than limit are
+ * moved up, pairing each with a leaf from a shallower level (JPEG K.3).
+ */
+static void
+huff_lengths(const uint32_t *freq, int n, int limit, uint8_t *len)
+{
+	uint32_t w[2 * ZD_NUM_LL];
+	int sym[ZD_NUM_LL], parent[2 * ZD_NUM_LL], depth[2 * ZD_NUM_LL];
+	int bl[2 * ZD_NUM_LL];
+	int i, j, k, nn = 0, q1, q2, node, maxd = 0;
+
+	for (i = 0; i < n; i++) {
+		len[i] = 0;
+		if (freq[i] != 0)
+			sym[nn++] = i;
+	}
+	if (nn == 0)
+		return;
+	if (nn == 1) {
+		len[sym[0]] = 1;
+		return;
+	}
+	/* ascending frequency, stable */
+	for (i = 1; i < nn; i++) {
+		k = sym[i];
+		for (j = i; j > 0 && freq[sym[j - 1]] > freq[k]; j--)
+			sym[j] = sym[j - 1];
+		sym[j] = k;
+	}
+	for (i = 0; i < nn; i++)
+		w[i] = freq[sym[i]];
+
+	/* two queues: the sorted leaves, and internal nodes as made */
+	q1 = 0;
+	q2 = nn;
+	for (node = nn; node < 2 * nn - 1; node++) {
+		w[node] = 0;
+		for (k = 0; k < 2; k++) {
+			if (q1 < nn && (q2 >= node || w[q1] <= w[q2]))
+				i = q1++;
+			else
+				i = q2++;
+			w[node] += w[i];
+			parent[i] = node;
+		}
+	}
+	depth[2 * nn - 2] = 0;
+	for (i = 2 * nn - 3; i >= 0; i--)
+		depth[i] = depth[parent[i]] + 1;
+
+	memset(bl, 0, sizeof(bl));
+	for (i = 0; i < nn; i++) {
+		bl[depth[i]]++;
+		if (depth[i] > maxd)
+			maxd = depth[i];
+	}
+	for (i = maxd; i > limit; i--) {
+		while (bl[i] > 0) {
+			for (j = i - 2; bl[j] == 0; j--)
+				;
+			bl[i] -= 2;
+			bl[i - 1]++;
+			bl[j + 1] += 2;
+			bl[j]--;
+		}
+	}
+	/* the rarest symbols get the longest codes */
+	for (i = 0, k = limit < maxd ? limit : maxd; k > 0; k--)
+		for (j = 0; j < bl[k]; j++)
+			len[sym[i++]] = k;
+}
+
+static void
+huff_codes(const uint8_t *len, int n, uint32_t *code)
+{
+	int count[16], i;
+	uint32_t next[16], c = 0;
+
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < n; i++)
+		count[len[i]]++;
+	count[0] = 0;
+	for (i = 1; i < 16; i++) {
+		c = (c + count[i - 1]) << 1;
+		next[i] = c;
+	}
+	for (i = 0; i < n; i++)
+		code[i] = len[i] ? next[len[i]]++ : 0;
+}
+
+/* Symbols and costs */
+
+static void
+hist_add(struct zd_hist *h, const struct zd_sym *s, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (s[i].dist == 0) {
+			h->ll[s[i].len]++;
+			h->bytes++;
+		} else {
+			h->ll[257 + len_sym[s[i].len]]++;
+			h->d[dist_sym(s[i].dist)]++;
+			h->bytes += s[i].len;
+		}
+	}
+}
+
+static void
+hist_init(struct zd_hist *h, const struct zd_sym *s, size_t n)
+{
+	memset(h, 0, sizeof(*h));
+	h->ll[256] = 1;
+	hist_add(h, s, n);
+}
+
+static void
+fixed_lengths(uint8_t *ll, uint8_t *d)
+{
+	int i;
+
+	for (i = 0; i < ZD_NUM_LL; i++)
+		ll[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+	for (i = 0; i < ZD_NUM_D; i++)
+		d[i] = 5;
+}
+
+/*
+ * Dynamic code lengths for a histogram.  Old inflaters want at least two
+ * distance codes even when there are no matches, so two are always there.
+ */
+static void
+dyn_lengths(const struct zd_hist *h, uint8_t *ll, uint8_t *d)
+{
+	int i, used = 0;
+
+	huff_lengths(h->ll, ZD_NUM_LL, 15, ll);
+	huff_lengths(h->d, ZD_NUM_D, 15, d);
+	for (i = 0; i < ZD_NUM_D; i++)
+		used += d[i] != 0;
+	if (used == 0)
+		d[0] = d[1] = 1;
+	else if (used == 1)
+		d[d[0] ? 1 : 0] = 1;
+}
+
+/*
+ * The run-length coded code lengths of a dynamic header, as code length
+ * symbols with their extra bits in the upper byte.  Returns their number.
+ */
+static int
+cl_encode(const uint8_t *ll, int hlit, const uint8_t *d, int hdist,
+    uint16_t *out)
+{
+	uint8_t lens[ZD_NUM_LL + ZD_NUM_D];
+	int i, n = hlit + hdist, run, r, k = 0;
+
+	memcpy(lens, ll, hlit);
+	memcpy(lens + hlit, d, hdist);
+	for (i = 0; i < n; i += run) {
+		for (run = 1; i + run < n && lens[i + run] == lens[i]; run++)
+			;
+		r = run;
+		if (lens[i] == 0) {
+			for (; r >= 11; r -= r < 138 ? r : 138)
+				out[k++] = 18 | ((r < 138 ? r : 138) - 11) << 8;
+			if (r >= 3) {
+				out[k++] = 17 | (r - 3) << 8;
+				r = 0;
+			}
+		} else {
+			out[k++] = lens[i];
+			r--;
+			for (; r >= 3; r -= r < 6 ? r : 6)
+				out[k++] = 16 | ((r < 6 ? r : 6) - 3) << 8;
+		}
+		while (r-- > 0)
+			out[k++] = lens[i];
+	}
+	return (k);
+}
+
+static void
+dyn_header_counts(const uint8_t *ll, const uint8_t *d, int *hlit, int *hdist)
+{
+	for (*hlit = ZD_NUM_LL - 2; *hlit > 257 && ll[*hlit - 1] == 0; (*hlit)--)
+		;
+	for (*hdist = ZD_NUM_D; *hdist > 1 && d[*hdist - 1] == 0; (*hdist)--)
+		;
+}
+
+/* Bits of a dynamic block header, writing it out if o is set. */
+static size_t
+dyn_header(const uint8_t *ll, const uint8_t *d, struct zd_out *o)
+{
+	static const uint8_t cl_extra[3] = { 2, 3, 7 };
+	uint16_t rle[ZD_NUM_LL + ZD_NUM_D];
+	uint32_t freq[ZD_NUM_CL], code[ZD_NUM_CL];
+	uint8_t cl[ZD_NUM_CL];
+	int hlit, hdist, hclen, n, i, s;
+	size_t bits;
+
+	dyn_header_counts(ll, d, &hlit, &hdist);
+	n = cl_encode(ll, hlit, d, hdist, rle);
+	memset(freq, 0, sizeof(freq));
+	for (i = 0; i < n; i++)
+		freq[rle[i] & 0xff]++;
+	huff_lengths(freq, ZD_NUM_CL, 7, cl);
+	for (hclen = ZD_NUM_CL; hclen > 4 && cl[cl_order[hclen - 1]] == 0;
+	    hclen--)
+		;
+	bits = 5 + 5 + 4 + 3 * hclen;
+	for (i = 0; i < n; i++) {
+		s = rle[i] & 0xff;
+		bits += cl[s] + (s >= 16 ? cl_extra[s - 16] : 0);
+	}
+	if (o == NULL)
+		return (bits);
+
+	huff_codes(cl, ZD_NUM_CL, code);
+	put_bits(o, hlit - 257, 5);
+	put_bits(o, hdist - 1, 5);
+	put_bits(o, hclen - 4, 4);
+	for (i = 0; i < hclen; i++)
+		put_bits(o, cl[cl_order[i]], 3);
+	for (i = 0; i < n; i++) {
+		s = rle[i] & 0xff;
+		put_code(o, code[s], cl[s]);
+		if (s >= 16)
+			put_bits(o, rle[i] >> 8, cl_extra[s - 16]);
+	}
+	return (bits);
+}
+
+static size_t
+data_bits(const struct zd_hist *h, const uint8_t *ll, const uint8_t *d)
+{
+	size_t bits = 0;
+	int i;
+
+	for (i = 0; i < ZD_NUM_LL; i++)
+		bits += (size_t)h->ll[i] * (ll[i] +
+		    (i >= 257 && i < 286 ? len_extra[i - 257] : 0));
+	for (i = 0; i < ZD_NUM_D; i++)
+		bits += (size_t)h->d[i] * (d[i] + dist_extra[i]);
+	return (bits);
+}
+
+/* Bits for a block of the symbols in h, as stored (0), fixed or dynamic. */
+static size_t
+block_bits(const struct zd_hist *h, int type)
+{
+	uint8_t ll[ZD_NUM_LL], d[ZD_NUM_D];
+	size_t chunks;
+
+	switch (type) {
+	case 0:
+		/* 3 bits and up to 7 to the byte, then 8 bits once aligned */
+		chunks = h->bytes ? (h->bytes + 65534) / 65535 : 1;
+		return (2 + chunks * (8 + 32) + h->bytes * 8);
+	case 1:
+		fixed_lengths(ll, d);
+		return (3 + data_bits(h, ll, d));
+	default:
+		dyn_lengths(h, ll, d);
+		return (3 + dyn_header(ll, d, NULL) + data_bits(h, ll, d));
+	}
+}
+
+static size_t
+best_bits(const struct zd_hist *h, int *type)
+{
+	size_t bits, best = block_bits(h, 2);
+	int t;
+
+	*type = 2;
+	for (t = 0; t < 2; t++)
+		if ((bits = block_bits(h, t)) < best) {
+			best = bits;
+			*type = t;
+		}
+	return (best);
+}
+
+static size_t
+range_bits(const struct zd_sym *s, size_t start, size_t end)
+{
+	struct zd_hist h;
+	int type;
+
+	hist_init(&h, s + start, end - start);
+	return (best_bits(&h, &type));
+}
+
+/* Bit costs the optimal parse minimizes: the entropy of each symbol in h. */
+static void
+stat_costs(const struct zd_hist *h, struct zd_cost *c)
+{
+	float ll[ZD_NUM_LL], d[ZD_NUM_D], log2sum;
+	uint32_t sum = 0;
+	int i;
+
+	for (i = 0; i < ZD_NUM_LL; i++)
+		sum += h->ll[i];
+	log2sum = log2f(sum);
+	for (i = 0; i < ZD_NUM_LL; i++)
+		ll[i] = h->ll[i] ? fmaxf(log2sum - log2f(h->ll[i]), 0) : log2sum;
+	for (sum = 0, i = 0; i < ZD_NUM_D; i++)
+		sum += h->d[i];
+	log2sum = log2f(sum ? sum : 1);
+	for (i = 0; i < ZD_NUM_D; i++)
+		d[i] = h->d[i] ? fmaxf(log2sum - log2f(h->d[i]), 0) : log2sum;
+
+	for (i = 0; i < 256; i++)
+		c->lit[i] = ll[i];
+	for (i = ZD_MIN_MATCH; i <= ZD_MAX_MATCH; i++)
+		c->len[i] = ll[257 + len_sym[i]] + len_extra[len_sym[i]];
+	for (i = 0; i < ZD_NUM_D; i++)
+		c->d[i] = d[i] + dist_extra[i];
+}
+
+static void
+fixed_costs(struct zd_cost *c)
+{
+	uint8_t ll[ZD_NUM_LL], d[ZD_NUM_D];
+	int i;
+
+	fixed_lengths(ll, d);
+	for (i = 0; i < 256; i++)
+		c->lit[i] = ll[i];
+	for (i = ZD_MIN_MATCH; i <= ZD_MAX_MATCH; i++)
+		c->len[i] = ll[257 + len_sym[i]] + len_extra[len_sym[i]];
+	for (i = 0; i < ZD_NUM_D; i++)
+		c->d[i] = d[i] + dist_extra[i];
+}
+
+/* Store */
+
+static int
+store_add(struct zd_store *st, unsigned len, unsigned dist)
+{
+	struct zd_sym *p;
+
+	if (st->n == st->size) {
+		st->size = st->size ? st->size * 2 : 0x10000;
+		if ((p = realloc(st->sym, st->size * sizeof(*p))) == NULL)
+			return (-1);
+		st->sym = p;
+	}
+	st->sym[st->n].len = len;
+	st->sym[st->n].dist = dist;
+	st->n++;
+	return (0);
+}
+
+/* Matches */
+
+static uint32_t
+hash3(const uint8_t *p)
+{
+	return (((uint32_t)p[0] << 16 | p[1] << 8 | p[2]) * 2654435761U >>
+	    (32 - ZD_HASH_BITS));
+}
+
+/*
+ * Fills the cache for the slice [ms, me): for each position, the steps of
+ * lengths that the nearest matches reach.  Matches stop at the end of the
+ * slice.  With more steps than fit, the last slot keeps being replaced by
+ * the longest match, whose distance then serves the dropped lengths too.
+ */
+static int
+find_matches(struct zd_state *z)
+{
+	const uint8_t *in = z->in;
+	size_t ws = z->ms > ZD_WSIZE ? z->ms - ZD_WSIZE : 0, p, c;
+	int32_t *head, *prev;
+	struct zd_step *st;
+	unsigned best, limit, l, hits;
+	uint8_t *n;
+
+	head = malloc(sizeof(*head) << ZD_HASH_BITS);
+	prev = malloc(sizeof(*prev) * (z->me - ws));
+	if (head == NULL || prev == NULL) {
+		free(head);
+		free(prev);
+		return (-1);
+	}
+	memset(head, 0xff, sizeof(*head) << ZD_HASH_BITS);
+
+	for (p = ws; p < z->me; p++) {
+		int32_t h = p + ZD_MIN_MATCH <= z->inlen ? (int32_t)hash3(in + p) :
+		    -1;
+
+		if (p >= z->ms) {
+			st = z->cache + (p - z->ms) * ZD_CACHE;
+			n = z->ncache + (p - z->ms);
+			*n = 0;
+			best = ZD_MIN_MATCH - 1;
+			limit = z->me - p < ZD_MAX_MATCH ? z->me - p :
+			    ZD_MAX_MATCH;
+			hits = 0;
+			for (c = h >= 0 ? (size_t)head[h] : (size_t)-1;
+			    limit >= ZD_MIN_MATCH && c != (size_t)-1 && c >= ws &&
+			    p - c <= ZD_WSIZE && hits < (unsigned)z->opts->max_chain;
+			    c = prev[c - ws] < 0 ? (size_t)-1 : (size_t)prev[c - ws]) {
+				hits++;
+				if (in[c + best] != in[p + best])
+					continue;
+				for (l = 0; l < limit && in[c + l] == in[p + l]; l++)
+					;
+				if (l <= best)
+					continue;
+				if (*n == ZD_CACHE)
+					(*n)--;
+				st[*n].len = l;
+				st[*n].dist = p - c;
+				(*n)++;
+				if ((best = l) == limit)
+					break;
+			}
+		}
+		if (h >= 0) {
+			prev[p - ws] = head[h];
+			head[h] = p;
+		}
+	}
+	free(head);
+	free(prev);
+	return (0);
+}
+
+/* Lazy parse of [bs, be) from the cache, for the first statistics. */
+static int
+lazy_parse(struct zd_state *z, size_t bs, size_t be, struct zd_store *st)
+{
+	size_t p = bs;
+	unsigned l, nl;
+	const struct zd_step *s;
+
+	while (p < be) {
+		l = z->ncache[p - z->ms] ? z->cache[(p - z->ms) * ZD_CACHE +
+		    z->ncache[p - z->ms] - 1].len : 0;
+		if (l > be - p)
+			l = be - p;
+		if (l >= ZD_MIN_MATCH && p + 1 < be) {
+			nl = z->ncache[p + 1 - z->ms] ? z->cache[(p + 1 - z->ms) *
+			    ZD_CACHE + z->ncache[p + 1 - z->ms] - 1].len : 0;
+			if (nl > l + 1)
+				l = 0;
+		}
+		if (l < ZD_MIN_MATCH) {
+			if (store_add(st, z->in[p], 0) < 0)
+				return (-1);
+			p++;
+			continue;
+		}
+		s = z->cache + (p - z->ms) * ZD_CACHE;
+		while (s->len < l)
+			s++;
+		if (store_add(st, l, s->dist) < 0)
+			return (-1);
+		p += l;
+	}
+	return (0);
+}
+
+/*
+ * Shortest path over the bytes [bs, be) with the costs in c, leaving in
+ * z->path[i] the last symbol of the cheapest way to reach bs + i.  Inside
+ * long runs of one byte the path just takes maximal matches at distance 1,
+ * as zopfli does, from each of the next ZD_MAX_MATCH positions, so the
+ * path may go on from wherever it entered the run.
+ */
+static void
+optimal_parse(struct zd_state *z, size_t bs, size_t be,
+    const struct zd_cost *c)
+{
+	size_t n = be - bs, i, k, p;
+	const struct zd_step *s;
+	unsigned l, prevl, maxl;
+	float *cost = z->cost, base, dc, v;
+	struct zd_sym *path = z->path;
+	const float run_cost = c->len[ZD_MAX_MATCH] + c->d[0];
+
+	for (i = 1; i <= n; i++)
+		cost[i] = ZD_INF;
+	cost[0] = 0;
+	for (i = 0; i < n; i++) {
+		p = bs + i;
+		base = cost[i];
+		if (i > ZD_MAX_MATCH && i + 2 * ZD_MAX_MATCH <= n &&
+		    z->same[p - z->ms] > 2 * ZD_MAX_MATCH &&
+		    z->same[p - z->ms - ZD_MAX_MATCH] > ZD_MAX_MATCH) {
+			for (k = i; k < i + ZD_MAX_MATCH; k++) {
+				v = cost[k] + run_cost;
+				if (v < cost[k + ZD_MAX_MATCH]) {
+					cost[k + ZD_MAX_MATCH] = v;
+					path[k + ZD_MAX_MATCH].len = ZD_MAX_MATCH;
+					path[k + ZD_MAX_MATCH].dist = 1;
+				}
+			}
+			i += ZD_MAX_MATCH - 1;
+			continue;
+		}
+		v = base + c->lit[z->in[p]];
+		if (v < cost[i + 1]) {
+			cost[i + 1] = v;
+			path[i + 1].len = 1;
+			path[i + 1].dist = 0;
+		}
+		s = z->cache + (p - z->ms) * ZD_CACHE;
+		maxl = n - i;
+		prevl = ZD_MIN_MATCH - 1;
+		for (k = 0; k < z->ncache[p - z->ms] && prevl < maxl; k++) {
+			dc = c->d[dist_sym(s[k].dist)];
+			for (l = prevl + 1; l <= s[k].len && l <= maxl; l++) {
+				v = base + c->len[l] + dc;
+				if (v < cost[i + l]) {
+					cost[i + l] = v;
+					path[i + l].len = l;
+					path[i + l].dist = s[k].dist;
+				}
+			}
+			prevl = s[k].len;
+		}
+	}
+}
+
+/* The symbols of the optimal parse of [bs, be), appended to st. */
+static int
+parse_block(struct zd_state *z, size_t bs, size_t be, const struct zd_cost *c,
+    struct zd_store *st)
+{
+	size_t i, k, start = st->n;
+	struct zd_sym t;
+
+	optimal_parse(z, bs, be, c);
+	for (i = be - bs; i > 0; i -= z->path[i].len) {
+		if (z->path[i].dist == 0) {
+			if (store_add(st, z->in[bs + i - 1], 0) < 0)
+				return (-1);
+		} else if (store_add(st, z->path[i].len, z->path[i].dist) < 0)
+			return (-1);
+	}
+	for (i = start, k = st->n; i + 1 < k; i++, k--) {
+		t = st->sym[i];
+		st->sym[i] = st->sym[k - 1];
+		st->sym[k - 1] = t;
+	}
+	return (0);
+}
+
+/*
+ * Iterated optimal parse of the bytes [bs, be), starting from the
+ * statistics of the symbols in init.  The smallest dynamic block is kept,
+ * unless the parse for the fixed codes comes out smaller still.
+ */
+static int
+optimize_block(struct zd_state *z, size_t bs, size_t be,
+    const struct zd_sym *init, size_t ninit, struct zd_store *out)
+{
+	struct zd_store cur = { NULL, 0, 0 }, best = { NULL, 0, 0 }, t;
+	struct zd_hist h;
+	struct zd_cost c;
+	size_t i, bits, bestbits = SIZE_MAX, lastbits = 0;
+	int it, ret = -1;
+
+	hist_init(&h, init, ninit);
+	for (it = 0; it < z->opts->iterations; it++) {
+		stat_costs(&h, &c);
+		cur.n = 0;
+		if (parse_block(z, bs, be, &c, &cur) < 0)
+			goto out;
+		hist_init(&h, cur.sym, cur.n);
+		bits = block_bits(&h, 2);
+		if (bits < bestbits) {
+			bestbits = bits;
+			t = best;
+			best = cur;
+			cur = t;
+		}
+		if (bits == lastbits)
+			break;
+		lastbits = bits;
+	}
+	fixed_costs(&c);
+	cur.n = 0;
+	if (parse_block(z, bs, be, &c, &cur) < 0)
+		goto out;
+	hist_init(&h, cur.sym, cur.n);
+	if (block_bits(&h, 1) < bestbits) {
+		t = best;
+		best = cur;
+		cur = t;
+	}
+
+	for (i = 0; i < best.n; i++)
+		if (store_add(out, best.sym[i].len, best.sym[i].dist) < 0)
+			goto out;
+	ret = 0;
+out:
+	free(best.sym);
+	free(cur.sym);
+	return (ret);
+}
+
+/* Block splitting */
+
+/*
+ * Symbol index in (start, end) where splitting costs least, and that cost:
+ * the bits of both halves.  Long ranges are sampled, narrowing the window
+ * [lo, hi) around the best sample each time.
+ */
+static size_t
+find_split(const struct zd_sym *s, size_t start, size_t end, size_t *cost)
+{
+	size_t p[ZD_SPLIT_SAMPLES], v[ZD_SPLIT_SAMPLES], best, last = SIZE_MAX;
+	size_t pos = start + 1, lo = start, hi = end, i, b;
+
+	if (end - start < 1024) {
+		for (best = SIZE_MAX, i = start + 1; i < end; i++) {
+			v[0] = range_bits(s, start, i) + range_bits(s, i, end);
+			if (v[0] < best) {
+				best = v[0];
+				pos = i;
+			}
+		}
+		*cost = best;
+		return (pos);
+	}
+	for (;;) {
+		if (hi - lo <= ZD_SPLIT_SAMPLES)
+			break;
+		for (i = 0; i < ZD_SPLIT_SAMPLES; i++) {
+			p[i] = lo + (i + 1) * ((hi - lo) / (ZD_SPLIT_SAMPLES + 1));
+			v[i] = range_bits(s, start, p[i]) + range_bits(s, p[i],
+			    end);
+		}
+		for (b = 0, i = 1; i < ZD_SPLIT_SAMPLES; i++)
+			if (v[i] < v[b])
+				b = i;
+		if (v[b] > last)
+			break;
+		lo = b == 0 ? lo : p[b - 1];
+		hi = b == ZD_SPLIT_SAMPLES - 1 ? hi : p[b + 1];
+		pos = p[b];
+		last = v[b];
+	}
+	*cost = last;
+	return (pos);
+}
+
+/*
+ * Splits the symbols [0, n) into at most max_blocks blocks: the largest
+ * block not yet tried is split where that saves most, until no split
+ * saves anything.  The split points, ascending, go into split.
+ */
+static int
+split_store(const struct zd_state *z, const struct zd_sym *s, size_t n,
+    size_t *split, int *nsplit)
+{
+	uint8_t *done;
+	size_t start = 0, end = n, pos, cost, b0, b1, size;
+	int i;
+
+	*nsplit = 0;
+	if (n < 10)
+		return (0);
+	if ((done = calloc(n + 1, 1)) == NULL)
+		return (-1);
+	for (;;) {
+		if (*nsplit + 1 >= z->opts->max_blocks ||
+		    *nsplit + 1 >= ZD_MAX_BLOCKS)
+			break;
+		pos = find_split(s, start, end, &cost);
+		if (cost >= range_bits(s, start, end) || pos <= start ||
+		    pos >= end)
+			done[start] = 1;
+		else {
+			for (i = *nsplit; i > 0 && split[i - 1] > pos; i--)
+				split[i] = split[i - 1];
+			split[i] = pos;
+			(*nsplit)++;
+		}
+		/* the largest block left to try */
+		for (size = 0, i = 0; i <= *nsplit; i++) {
+			b0 = i == 0 ? 0 : split[i - 1];
+			b1 = i == *nsplit ? n : split[i];
+			if (!done[b0] && b1 - b0 > size && b1 - b0 >= 10) {
+				size = b1 - b0;
+				start = b0;
+				end = b1;
+			}
+		}
+		if (size == 0)
+			break;
+	}
+	free(done);
+	return (0);
+}
+
+/* Bits of a split store, with each block's best type filled in. */
+static size_t
+split_bits(const struct zd_sym *s, size_t n, const size_t *split, int nsplit,
+    struct zd_block *blk)
+{
+	struct zd_hist h;
+	size_t bits = 0;
+	int i;
+
+	for (i = 0; i <= nsplit; i++) {
+		blk[i].start = i == 0 ? 0 : split[i - 1];
+		blk[i].end = i == nsplit ? n : split[i];
+		hist_init(&h, s + blk[i].start, blk[i].end - blk[i].start);
+		blk[i].bytes = h.bytes;
+		bits += best_bits(&h, &blk[i].type);
+	}
+	return (bits);
+}
+
+/* Writing */
+
+static void
+write_block(struct zd_state *z, const struct zd_sym *s, const struct zd_block *b,
+    int final)
+{
+	struct zd_out *o = &z->out;
+	uint8_t ll[ZD_NUM_LL], d[ZD_NUM_D];
+	uint32_t llc[ZD_NUM_LL], dc[ZD_NUM_D];
+	struct zd_hist h;
+	size_t i, pos, n;
+	int ls, ds;
+
+	if (b->type == 0) {
+		for (pos = b->pos; ; pos += n) {
+			n = b->pos + b->bytes - pos;
+			if (n > 65535)
+				n = 65535;
+			put_bits(o, final && pos + n == b->pos + b->bytes, 1);
+			put_bits(o, 0, 2);
+			put_align(o);
+			put_bits(o, n, 16);
+			put_bits(o, n ^ 0xffff, 16);
+			out_grow(o, n);
+			if (!o->error)
+				memcpy(o->buf + o->len, z->in + pos, n);
+			o->len += o->error ? 0 : n;
+			if (pos + n == b->pos + b->bytes)
+				return;
+		}
+	}
+
+	put_bits(o, final, 1);
+	put_bits(o, b->type, 2);
+	if (b->type == 1)
+		fixed_lengths(ll, d);
+	else {
+		hist_init(&h, s + b->start, b->end - b->start);
+		dyn_lengths(&h, ll, d);
+		dyn_header(ll, d, o);
+	}
+	huff_codes(ll, ZD_NUM_LL, llc);
+	huff_codes(d, ZD_NUM_D, dc);
+	for (i = b->start; i < b->end; i++) {
+		if (s[i].dist == 0) {
+			put_code(o, llc[s[i].len], ll[s[i].len]);
+			continue;
+		}
+		ls = len_sym[s[i].len];
+		put_code(o, llc[257 + ls], ll[257 + ls]);
+		put_bits(o, s[i].len - len_base[ls], len_extra[ls]);
+		ds = dist_sym(s[i].dist);
+		put_code(o, dc[ds], d[ds]);
+		put_bits(o, s[i].dist - dist_base[ds], dist_extra[ds]);
+	}
+	put_code(o, llc[256], ll[256]);
+}
+
+/* Slices */
+
+static int
+deflate_slice(struct zd_state *z, int final)
+{
+	struct zd_store lazy = { NULL, 0, 0 }, opt = { NULL, 0, 0 };
+	struct zd_block blk[2][ZD_MAX_BLOCKS], *b;
+	size_t split[2][ZD_MAX_BLOCKS], bits[2], pos, i, bs, be, s0, s1;
+	int nsplit[2], k, j, use, ret = -1;
+
+	if (find_matches(z) < 0)
+		return (-1);
+	for (pos = z->me; pos-- > z->ms; )
+		z->same[pos - z->ms] = pos + 1 < z->me &&
+		    z->in[pos] == z->in[pos + 1] ? z->same[pos + 1 - z->ms] + 1 : 1;
+
+	/* split the lazy parse, then optimize each block on its own */
+	if (lazy_parse(z, z->ms, z->me, &lazy) < 0 ||
+	    split_store(z, lazy.sym, lazy.n, split[0], &nsplit[0]) < 0)
+		goto out;
+	bs = z->ms;
+	for (s0 = 0, k = 0; k <= nsplit[0]; k++, s0 = s1) {
+		s1 = k == nsplit[0] ? lazy.n : split[0][k];
+		for (be = bs, i = s0; i < s1; i++)
+			be += lazy.sym[i].dist ? lazy.sym[i].len : 1;
+		if (optimize_block(z, bs, be, lazy.sym + s0, s1 - s0, &opt) < 0)
+			goto out;
+		/* the split points move to where the optimized blocks end */
+		if (k < nsplit[0])
+			split[0][k] = opt.n;
+		bs = be;
+	}
+	bits[0] = split_bits(opt.sym, opt.n, split[0], nsplit[0], blk[0]);
+
+	/* and splitting the optimized symbols again may do better */
+	if (split_store(z, opt.sym, opt.n, split[1], &nsplit[1]) < 0)
+		goto out;
+	bits[1] = split_bits(opt.sym, opt.n, split[1], nsplit[1], blk[1]);
+	use = bits[1] < bits[0];
+
+	for (pos = z->ms, j = 0; j <= nsplit[use]; j++) {
+		b = &blk[use][j];
+		b->pos = pos;
+		write_block(z, opt.sym, b, final && j == nsplit[use]);
+		pos += b->bytes;
+	}
+	ret = z->out.error ? -1 : 0;
+out:
+	free(lazy.sym);
+	free(opt.sym);
+	return (ret);
+}
+
+int
+zd_deflate(const struct zd_opts *opts, const uint8_t *in, size_t len,
+    uint8_t **out, size_t *outlen)
+{
+	struct zd_state z;
+	size_t slice = len < ZD_SLICE_MAX ? len : ZD_SLICE_MAX;
+	int i, ret = -1;
+
+	for (i = 0; i < 29; i++) {
+		int l;
+
+		for (l = len_base[i]; l < len_base[i] + (1 << len_extra[i]) &&
+		    l <= ZD_MAX_MATCH; l++)
+			len_sym[l] = i;
+	}
+	memset(&z, 0, sizeof(z));
+	z.opts = opts;
+	z.in = in;
+	z.inlen = len;
+	z.cache = malloc(sizeof(*z.cache) * ZD_CACHE * (slice + 1));
+	z.ncache = malloc(slice + 1);
+	z.same = malloc(sizeof(*z.same) * (slice + 1));
+	z.cost = malloc(sizeof(*z.cost) * (slice + 1));
+	z.path = malloc(sizeof(*z.path) * (slice + 1));
+	if (z.cache == NULL || z.ncache == NULL || z.same == NULL ||
+	    z.cost == NULL || z.path == NULL)
+		goto out;
+
+	if (len == 0) {
+		/* a final fixed block with just the end of block code */
+		put_bits(&z.out, 1, 1);
+		put_bits(&z.out, 1, 2);
+		put_bits(&z.out, 0, 7);
+	}
+	for (z.ms = 0; z.ms < len; z.ms = z.me) {
+		z.me = len - z.ms >= ZD_SLICE_MAX ? z.ms + ZD_SLICE : len;
+		if (deflate_slice(&z, z.me == len) < 0)
+			goto out;
+	}
+	put_align(&z.out);
+	if (z.out.error)
+		goto out;
+	*out = z.out.buf;
+	*outlen = z.out.len;
+	z.out.buf = NULL;
+	ret = 0;
+out:
+	free(z.cache);
+	free(z.ncache);
+	free(z.same);
+	free(z.cost);
+	free(z.path);
+	free(z.out.buf);
+	if (ret < 0)
+		errno = ENOMEM;
+	return (ret);
+}
@@ -0,0 +1,31 @@
+/*
+ * zdeflate.h
+ *
+ * Raw deflate (RFC 1951) with iterated optimal parsing and block splitting,
+ * in the manner of zopfli: slow, but the output is as small as deflate
+ * gets, and any inflater (zlib, tinfl, the boot loaders) reads it.
+ */
+
+#ifndef ZDEFLATE_H_
+#define ZDEFLATE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct zd_opts {
+	int	iterations;	/* optimal parse passes per block */
+	int	max_chain;	/* hash chain entries tried per position */
+	int	max_blocks;	/* blocks a 1 MB slice may be split into */
+};
+
+/* The options for an effort level from 1 (fastest) to 9 (smallest). */
+void	zd_level(struct zd_opts *opts, int level);
+
+/*
+ * Compresses len bytes at in into a malloc'ed buffer returned in *out,
+ * *outlen bytes long.  Returns 0, or -1 with errno set if out of memory.
+ */
+int	zd_deflate(const struct zd_opts *opts, const uint8_t *in, size_t len,
+	    uint8_t **out, size_t *outlen);
+
+#endif /* ZDEFLATE_H_ */
@@ -0,0 +1,277 @@
+/*
+ * md5mb.c
+ *
+ * Multi-buffer MD5 (RFC 1321) for mktplinkfw's batch mode, where every
+ * image of a flash layout is the same bytes behind a different header:
+ * one pass over the data feeds all their digests, a vector lane each.
+ * The block function is md5mb_kernel.h, built for 1, 4, 8 and 16 lanes;
+ * the 8 and 16 lane builds are AVX2 and AVX-512 and are only used where
+ * the CPU has them.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "md5mb.h"
+
+#define	F(x, y, z)	((((y) ^ (z)) & (x)) ^ (z))
+#define	G(x, y, z)	((((x) ^ (y)) & (z)) ^ (y))
+#define	H(x, y, z)	((x) ^ (y) ^ (z))
+#define	I(x, y, z)	((y) ^ ((x) | ~(z)))
+#define	ROTL(x, n)	(((x) << (n)) | ((x) >> (32 - (n))))
+
+#define	STEP(f, a, b, c, d, x, t, s) do {				\
+	(a) += f((b), (c), (d)) + (x) + (uint32_t)(t);			\
+	(a) = ROTL((a), (s)) + (b);					\
+} while (0)
+
+static inline uint32_t
+md5mb_le32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+	    (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+}
+
+#define	MD5MB_FN	md5mb_blocks_1
+#define	MD5MB_WIDTH	1
+#define	MD5MB_TARGET
+#include "md5mb_kernel.h"
+#undef	MD5MB_FN
+#undef	MD5MB_WIDTH
+#undef	MD5MB_TARGET
+
+/* SSE2 on amd64, NEON on arm64, or whatever the compiler makes of it */
+#define	MD5MB_FN	md5mb_blocks_4
+#define	MD5MB_WIDTH	4
+#define	MD5MB_TARGET
+#include "md5mb_kernel.h"
+#undef	MD5MB_FN
+#undef	MD5MB_WIDTH
+#undef	MD5MB_TARGET
+
+#if defined(__x86_64__)
+#define	MD5MB_FN	md5mb_blocks_avx2
+#define	MD5MB_WIDTH	8
+#define	MD5MB_TARGET	__attribute__((target("avx2")))
+#include "md5mb_kernel.h"
+#undef	MD5MB_FN
+#undef	MD5MB_WIDTH
+#undef	MD5MB_TARGET
+
+#define	MD5MB_FN	md5mb_blocks_avx512
+#define	MD5MB_WIDTH	16
+#define	MD5MB_TARGET	__attribute__((target("avx512f")))
+#include "md5mb_kernel.h"
+#undef	MD5MB_FN
+#undef	MD5MB_WIDTH
+#undef	MD5MB_TARGET
+
+/* __builtin_cpu_supports() also checks that the OS saves the registers. */
+static int
+md5mb_probe_avx2(void)
+{
+	return (__builtin_cpu_supports("avx2"));
+}
+
+static int
+md5mb_probe_avx512(void)
+{
+	return (__builtin_cpu_supports("avx512f"));
+}
+#endif /* __x86_64__ */
+
+struct md5mb_impl {
+	const char	*name;
+	int		width;
+	void		(*blocks)(struct md5mb_ctx *, int, const uint8_t *const *,
+			    size_t);
+	int		(*probe)(void);
+};
+
+/* Ordered by width. */
+static const struct md5mb_impl md5mb_impls[] = {
+	{ "scalar",	1,	md5mb_blocks_1,		NULL },
+	{ "vec4",	4,	md5mb_blocks_4,		NULL },
+#if defined(__x86_64__)
+	{ "avx2",	8,	md5mb_blocks_avx2,	md5mb_probe_avx2 },
+	{ "avx512",	16,	md5mb_blocks_avx512,	md5mb_probe_avx512 },
+#endif
+	{ NULL,		0,	NULL,			NULL }
+};
+
+#define	MD5MB_NIMPLS	(sizeof(md5mb_impls) / sizeof(md5mb_impls[0]) - 1)
+
+static const struct md5mb_impl *md5mb_fixed;
+static int md5mb_env_done;
+
+static int
+md5mb_usable(const struct md5mb_impl *im)
+{
+	return (im->probe == NULL || im->probe());
+}
+
+const char *
+md5mb_impl_name(int idx)
+{
+	if (idx < 0 || (size_t)idx >= MD5MB_NIMPLS)
+		return (NULL);
+	return (md5mb_impls[idx].name);
+}
+
+int
+md5mb_impl_width(int idx)
+{
+	if (idx < 0 || (size_t)idx >= MD5MB_NIMPLS)
+		return (0);
+	return (md5mb_impls[idx].width);
+}
+
+int
+md5mb_select(int idx)
+{
+	const struct md5mb_impl *im;
+	const char *env;
+
+	md5mb_env_done = 1;
+	md5mb_fixed = NULL;
+	if (idx == MD5MB_IMPL_AUTO) {
+		if ((env = getenv("MD5MB_IMPL")) != NULL)
+			for (im = md5mb_impls; im->name != NULL; im++)
+				if (strcmp(im->name, env) == 0 &&
+				    md5mb_usable(im))
+					md5mb_fixed = im;
+		return (0);
+	}
+	if (idx < 0 || (size_t)idx >= MD5MB_NIMPLS ||
+	    !md5mb_usable(&md5mb_impls[idx]))
+		return (-1);
+	md5mb_fixed = &md5mb_impls[idx];
+	return (0);
+}
+
+/* The narrowest usable kernel at least n lanes wide, else the widest. */
+static const struct md5mb_impl *
+md5mb_pick(int n)
+{
+	const struct md5mb_impl *im, *best = &md5mb_impls[0];
+
+	if (!md5mb_env_done)
+		md5mb_select(MD5MB_IMPL_AUTO);
+	if (md5mb_fixed != NULL)
+		return (md5mb_fixed);
+	for (im = md5mb_impls; im->name != NULL; im++) {
+		if (!md5mb_usable(im))
+			continue;
+		best = im;
+		if (im->width >= n)
+			break;
+	}
+	return (best);
+}
+
+void
+md5mb_init(struct md5mb_ctx *ctx, int n)
+{
+	int i;
+
+	if (n > MD5MB_MAX_STREAMS)
+		abort();
+	for (i = 0; i < MD5MB_MAX_STREAMS; i++) {
+		ctx->h[0][i] = 0x67452301;
+		ctx->h[1][i] = 0xefcdab89;
+		ctx->h[2][i] = 0x98badcfe;
+		ctx->h[3][i] = 0x10325476;
+	}
+	ctx->len = 0;
+	ctx->n = n;
+	ctx->impl = md5mb_pick(n);
+}
+
+void
+md5mb_state(const struct md5mb_ctx *ctx, int i, uint32_t state[4])
+{
+	int j;
+
+	for (j = 0; j < 4; j++)
+		state[j] = ctx->h[j][i];
+}
+
+void
+md5mb_resume(struct md5mb_ctx *ctx, int n, uint64_t len,
+    const uint32_t (*state)[4])
+{
+	int i, j;
+
+	if ((len & 63) != 0)
+		abort();
+	md5mb_init(ctx, n);
+	for (i = 0; i < n; i++)
+		for (j = 0; j < 4; j++)
+			ctx->h[j][i] = state[i][j];
+	ctx->len = len;
+}
+
+static void
+md5mb_run(struct md5mb_ctx *ctx, const uint8_t *const *p, size_t nblocks)
+{
+	int s;
+
+	for (s = 0; s < ctx->n; s += ctx->impl->width)
+		ctx->impl->blocks(ctx, s, p, nblocks);
+}
+
+void
+md5mb_update(struct md5mb_ctx *ctx, const void *const *data, size_t len)
+{
+	const uint8_t *p[MD5MB_MAX_STREAMS];
+	size_t fill = ctx->len & 63, off = 0, n;
+	int i;
+
+	ctx->len += len;
+	if (fill != 0) {
+		n = 64 - fill < len ? 64 - fill : len;
+		for (i = 0; i < ctx->n; i++)
+			memcpy(ctx->buf[i] + fill, data[i], n);
+		off = n;
+		if (fill + n < 64)
+			return;
+		for (i = 0; i < ctx->n; i++)
+			p[i] = ctx->buf[i];
+		md5mb_run(ctx, p, 1);
+	}
+	if ((n = (len - off) / 64) != 0) {
+		for (i = 0; i < ctx->n; i++)
+			p[i] = (const uint8_t *)data[i] + off;
+		md5mb_run(ctx, p, n);
+		off += n * 64;
+	}
+	if (off < len)
+		for (i = 0; i < ctx->n; i++)
+			memcpy(ctx->buf[i], (const uint8_t *)data[i] + off,
+			    len - off);
+}
+
+void
+md5mb_final(struct md5mb_ctx *ctx, uint8_t (*digest)[16])
+{
+	static const uint8_t pad[64] = { 0x80 };
+	const void *p[MD5MB_MAX_STREAMS];
+	uint8_t lenbuf[8];
+	uint64_t bits = ctx->len << 3;
+	int i, j;
+
+	for (i = 0; i < 8; i++)
+		lenbuf[i] = bits >> (8 * i);
+	for (i = 0; i < ctx->n; i++)
+		p[i] = pad;
+	md5mb_update(ctx, p, 1 + ((55 - ctx->len) & 63));
+	for (i = 0; i < ctx->n; i++)
+		p[i] = lenbuf;
+	md5mb_update(ctx, p, 8);
+
+	for (i = 0; i < ctx->n; i++)
+		for (j = 0; j < 16; j++)
+			digest[i][j] = ctx->h[j / 4][i] >> (8 * (j % 4));
+}
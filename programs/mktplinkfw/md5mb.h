@@ -0,0 +1,60 @@
+/*
+ * md5mb.h
+ *
+ * Multi-buffer MD5: up to MD5MB_MAX_STREAMS independent MD5 streams that
+ * are always fed the same number of bytes, hashed side by side, one
+ * stream per vector lane.  MD5 is serial within a stream, so this is how
+ * SIMD helps it: 4 lanes with SSE2, 8 with AVX2, 16 with AVX-512.
+ */
+
+#ifndef MD5MB_H_
+#define MD5MB_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define	MD5MB_MAX_STREAMS	64	/* a multiple of the widest kernel */
+#define	MD5MB_IMPL_AUTO		(-1)
+
+struct md5mb_impl;
+
+struct md5mb_ctx {
+	uint32_t	h[4][MD5MB_MAX_STREAMS];	/* state, word by stream */
+	uint8_t		buf[MD5MB_MAX_STREAMS][64];	/* partial block */
+	uint64_t	len;		/* bytes so far, in every stream */
+	int		n;		/* streams */
+	const struct md5mb_impl *impl;
+};
+
+/* Starts n streams, with the implementation chosen by md5mb_select(). */
+void	md5mb_init(struct md5mb_ctx *ctx, int n);
+
+/* Adds len bytes at data[i] to stream i, for every stream. */
+void	md5mb_update(struct md5mb_ctx *ctx, const void *const *data,
+	    size_t len);
+
+/* The digest of each stream. */
+void	md5mb_final(struct md5mb_ctx *ctx, uint8_t (*digest)[16]);
+
+/*
+ * The chaining state of stream i, which with the length is all there is
+ * to a stream on a 64-byte boundary; md5mb_resume() picks streams up
+ * again from such states, len bytes in.  len must be a multiple of 64.
+ */
+void	md5mb_state(const struct md5mb_ctx *ctx, int i, uint32_t state[4]);
+void	md5mb_resume(struct md5mb_ctx *ctx, int n, uint64_t len,
+	    const uint32_t (*state)[4]);
+
+/*
+ * Fixes the implementation by index, or for MD5MB_IMPL_AUTO (the default)
+ * lets each context take the narrowest one this CPU has that covers its
+ * streams.  The MD5MB_IMPL environment variable may name one instead.
+ * Returns -1 if the index is out of range or the CPU lacks it.
+ */
+int	md5mb_select(int idx);
+
+/* Name and width of implementation idx, or NULL / 0 past the last one. */
+const char *md5mb_impl_name(int idx);
+int	md5mb_impl_width(int idx);
+
+#endif /* MD5MB_H_ */
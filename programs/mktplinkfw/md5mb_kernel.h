@@ -0,0 +1,134 @@
+/*
+ * md5mb_kernel.h
+ *
+ * A multi-buffer MD5 block function, MD5MB_WIDTH streams wide, written
+ * with GCC vector extensions so that the compiler turns each operation
+ * into one instruction on the whole vector.  md5mb.c includes this once
+ * per width, with MD5MB_FN naming the function and MD5MB_TARGET giving
+ * its target attribute.
+ *
+ * The function runs nblocks 64-byte blocks of the streams from s on, the
+ * block data of stream s + l at p[s + l].  Lanes past the last stream
+ * hash a copy of stream s and are thrown away.
+ */
+
+MD5MB_TARGET
+static void
+MD5MB_FN(struct md5mb_ctx *c, int s, const uint8_t *const *p, size_t nblocks)
+{
+	typedef uint32_t v_t __attribute__((vector_size(4 * MD5MB_WIDTH)));
+	uint32_t w[16][MD5MB_WIDTH] __attribute__((aligned(64)));
+	const uint8_t *q[MD5MB_WIDTH];
+	v_t a, b, cc, d, a0, b0, c0, d0, m[16];
+	int i, l, n;
+	size_t k;
+
+	n = c->n - s < MD5MB_WIDTH ? c->n - s : MD5MB_WIDTH;
+	for (l = 0; l < MD5MB_WIDTH; l++)
+		q[l] = p[s + (l < n ? l : 0)];
+	/* rows are MD5MB_MAX_STREAMS long, so whole vectors always fit */
+	memcpy(&a, &c->h[0][s], sizeof(a));
+	memcpy(&b, &c->h[1][s], sizeof(b));
+	memcpy(&cc, &c->h[2][s], sizeof(cc));
+	memcpy(&d, &c->h[3][s], sizeof(d));
+
+	for (k = 0; k < nblocks; k++) {
+		/* transpose: word i of every lane's block into m[i] */
+		for (l = 0; l < MD5MB_WIDTH; l++)
+			for (i = 0; i < 16; i++)
+				w[i][l] = md5mb_le32(q[l] + 64 * k + 4 * i);
+		for (i = 0; i < 16; i++)
+			memcpy(&m[i], w[i], sizeof(m[i]));
+		a0 = a;
+		b0 = b;
+		c0 = cc;
+		d0 = d;
+
+		STEP(F, a, b, cc, d, m[0], 0xd76aa478, 7);
+		STEP(F, d, a, b, cc, m[1], 0xe8c7b756, 12);
+		STEP(F, cc, d, a, b, m[2], 0x242070db, 17);
+		STEP(F, b, cc, d, a, m[3], 0xc1bdceee, 22);
+		STEP(F, a, b, cc, d, m[4], 0xf57c0faf, 7);
+		STEP(F, d, a, b, cc, m[5], 0x4787c62a, 12);
+		STEP(F, cc, d, a, b, m[6], 0xa8304613, 17);
+		STEP(F, b, cc, d, a, m[7], 0xfd469501, 22);
+		STEP(F, a, b, cc, d, m[8], 0x698098d8, 7);
+		STEP(F, d, a, b, cc, m[9], 0x8b44f7af, 12);
+		STEP(F, cc, d, a, b, m[10], 0xffff5bb1, 17);
+		STEP(F, b, cc, d, a, m[11], 0x895cd7be, 22);
+		STEP(F, a, b, cc, d, m[12], 0x6b901122, 7);
+		STEP(F, d, a, b, cc, m[13], 0xfd987193, 12);
+		STEP(F, cc, d, a, b, m[14], 0xa679438e, 17);
+		STEP(F, b, cc, d, a, m[15], 0x49b40821, 22);
+
+		STEP(G, a, b, cc, d, m[1], 0xf61e2562, 5);
+		STEP(G, d, a, b, cc, m[6], 0xc040b340, 9);
+		STEP(G, cc, d, a, b, m[11], 0x265e5a51, 14);
+		STEP(G, b, cc, d, a, m[0], 0xe9b6c7aa, 20);
+		STEP(G, a, b, cc, d, m[5], 0xd62f105d, 5);
+		STEP(G, d, a, b, cc, m[10], 0x02441453, 9);
+		STEP(G, cc, d, a, b, m[15], 0xd8a1e681, 14);
+		STEP(G, b, cc, d, a, m[4], 0xe7d3fbc8, 20);
+		STEP(G, a, b, cc, d, m[9], 0x21e1cde6, 5);
+		STEP(G, d, a, b, cc, m[14], 0xc33707d6, 9);
+		STEP(G, cc, d, a, b, m[3], 0xf4d50d87, 14);
+		STEP(G, b, cc, d, a, m[8], 0x455a14ed, 20);
+		STEP(G, a, b, cc, d, m[13], 0xa9e3e905, 5);
+		STEP(G, d, a, b, cc, m[2], 0xfcefa3f8, 9);
+		STEP(G, cc, d, a, b, m[7], 0x676f02d9, 14);
+		STEP(G, b, cc, d, a, m[12], 0x8d2a4c8a, 20);
+
+		STEP(H, a, b, cc, d, m[5], 0xfffa3942, 4);
+		STEP(H, d, a, b, cc, m[8], 0x8771f681, 11);
+		STEP(H, cc, d, a, b, m[11], 0x6d9d6122, 16);
+		STEP(H, b, cc, d, a, m[14], 0xfde5380c, 23);
+		STEP(H, a, b, cc, d, m[1], 0xa4beea44, 4);
+		STEP(H, d, a, b, cc, m[4], 0x4bdecfa9, 11);
+		STEP(H, cc, d, a, b, m[7], 0xf6bb4b60, 16);
+		STEP(H, b, cc, d, a, m[10], 0xbebfbc70, 23);
+		STEP(H, a, b, cc, d, m[13], 0x289b7ec6, 4);
+		STEP(H, d, a, b, cc, m[0], 0xeaa127fa, 11);
+		STEP(H, cc, d, a, b, m[3], 0xd4ef3085, 16);
+		STEP(H, b, cc, d, a, m[6], 0x04881d05, 23);
+		STEP(H, a, b, cc, d, m[9], 0xd9d4d039, 4);
+		STEP(H, d, a, b, cc, m[12], 0xe6db99e5, 11);
+		STEP(H, cc, d, a, b, m[15], 0x1fa27cf8, 16);
+		STEP(H, b, cc, d, a, m[2], 0xc4ac5665, 23);
+
+		STEP(I, a, b, cc, d, m[0], 0xf4292244, 6);
+		STEP(I, d, a, b, cc, m[7], 0x432aff97, 10);
+		STEP(I, cc, d, a, b, m[14], 0xab9423a7, 15);
+		STEP(I, b, cc, d, a, m[5], 0xfc93a039, 21);
+		STEP(I, a, b, cc, d, m[12], 0x655b59c3, 6);
+		STEP(I, d, a, b, cc, m[3], 0x8f0ccc92, 10);
+		STEP(I, cc, d, a, b, m[10], 0xffeff47d, 15);
+		STEP(I, b, cc, d, a, m[1], 0x85845dd1, 21);
+		STEP(I, a, b, cc, d, m[8], 0x6fa87e4f, 6);
+		STEP(I, d, a, b, cc, m[15], 0xfe2ce6e0, 10);
+		STEP(I, cc, d, a, b, m[6], 0xa3014314, 15);
+		STEP(I, b, cc, d, a, m[13], 0x4e0811a1, 21);
+		STEP(I, a, b, cc, d, m[4], 0xf7537e82, 6);
+		STEP(I, d, a, b, cc, m[11], 0xbd3af235, 10);
+		STEP(I, cc, d, a, b, m[2], 0x2ad7d2bb, 15);
+		STEP(I, b, cc, d, a, m[9], 0xeb86d391, 21);
+
+		a += a0;
+		b += b0;
+		cc += c0;
+		d += d0;
+	}
+
+	if (n == MD5MB_WIDTH) {
+		memcpy(&c->h[0][s], &a, sizeof(a));
+		memcpy(&c->h[1][s], &b, sizeof(b));
+		memcpy(&c->h[2][s], &cc, sizeof(cc));
+		memcpy(&c->h[3][s], &d, sizeof(d));
+	} else {
+		for (l = 0; l < n; l++) {
+			c->h[0][s + l] = a[l];
+			c->h[1][s + l] = b[l];
+			c->h[2][s + l] = cc[l];
+			c->h[3][s + l] = d[l];
+		}
+	}
+}
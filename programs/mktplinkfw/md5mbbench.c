@@ -0,0 +1,296 @@
+/*
+ * md5mbbench.c
+ *
+ * Checks every multi-buffer MD5 kernel this CPU has against OpenSSL's MD5
+ * and reports the aggregate throughput of each over as many streams as it
+ * is wide, next to OpenSSL hashing the same streams one after another.
+ *
+ * With -m, it then times what the release job does: mktplinkfw run once
+ * per board, against one mktplinkfw -b run for all of them, and checks
+ * that both produce the same images.
+ *
+ * usage: md5mbbench [-n rounds] [-s size_mb]
+ *            [-m mktplinkfw -k kernel -r rootfs -d tmpdir board ...]
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/md5.h>
+
+#include "md5mb.h"
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec + tv.tv_usec / 1e6);
+}
+
+/* Streams of odd lengths fed in odd pieces, against MD5() of each. */
+static int
+check_impl(int idx, const uint8_t *buf)
+{
+	static const size_t lens[] = { 0, 1, 55, 56, 63, 64, 65, 127, 128,
+	    1000, 4096, 65537 };
+	static const size_t pieces[] = { 1, 7, 64, 100, 4096 };
+	struct md5mb_ctx ctx;
+	uint8_t dig[MD5MB_MAX_STREAMS][16], ref[16];
+	const void *p[MD5MB_MAX_STREAMS];
+	size_t li, pi, off, n;
+	int ns, i, fails = 0;
+
+	md5mb_select(idx);
+	for (ns = 1; ns <= MD5MB_MAX_STREAMS; ns += ns < 20 ? 1 : 21) {
+		for (li = 0; li < sizeof(lens) / sizeof(lens[0]); li++) {
+			pi = (ns + li) % (sizeof(pieces) / sizeof(pieces[0]));
+			md5mb_init(&ctx, ns);
+			for (off = 0; off < lens[li]; off += n) {
+				n = lens[li] - off < pieces[pi] ?
+				    lens[li] - off : pieces[pi];
+				for (i = 0; i < ns; i++)
+					p[i] = buf + 977 * i + off;
+				md5mb_update(&ctx, p, n);
+			}
+			md5mb_final(&ctx, dig);
+			for (i = 0; i < ns; i++) {
+				MD5(buf + 977 * i, lens[li], ref);
+				if (memcmp(ref, dig[i], 16) != 0)
+					fails++;
+			}
+		}
+	}
+	return (fails);
+}
+
+static void
+bench_impls(const uint8_t *buf, size_t size, int rounds)
+{
+	struct md5mb_ctx ctx;
+	uint8_t dig[MD5MB_MAX_STREAMS][16];
+	const void *p[MD5MB_MAX_STREAMS];
+	MD5_CTX mctx;
+	double t, best;
+	int idx, w, r, i;
+
+	for (idx = 0; md5mb_impl_name(idx) != NULL; idx++) {
+		if (md5mb_select(idx) != 0) {
+			printf("%-8s  not supported by this CPU\n",
+			    md5mb_impl_name(idx));
+			continue;
+		}
+		w = md5mb_impl_width(idx);
+		printf("%-8s  %2d lanes  %s", md5mb_impl_name(idx), w,
+		    check_impl(idx, buf) ? "FAILED" : "ok    ");
+		for (i = 0; i < w; i++)
+			p[i] = buf;
+		for (best = 1e9, r = 0; r < rounds; r++) {
+			t = now();
+			md5mb_init(&ctx, w);
+			md5mb_update(&ctx, p, size);
+			md5mb_final(&ctx, dig);
+			if ((t = now() - t) < best)
+				best = t;
+		}
+		printf("  %8.1f MB/s\n", (double)size * w / best / 1e6);
+	}
+	for (best = 1e9, r = 0; r < rounds; r++) {
+		t = now();
+		MD5_Init(&mctx);
+		MD5_Update(&mctx, buf, size);
+		MD5_Final(dig[0], &mctx);
+		if ((t = now() - t) < best)
+			best = t;
+	}
+	printf("%-8s   1 lane          %8.1f MB/s\n", "openssl",
+	    (double)size / best / 1e6);
+	md5mb_select(MD5MB_IMPL_AUTO);
+}
+
+static int
+run(char *const *argv)
+{
+	pid_t pid;
+	int status;
+
+	if ((pid = fork()) < 0)
+		return (-1);
+	if (pid == 0) {
+		if (freopen("/dev/null", "w", stderr) == NULL)
+			_exit(127);
+		execv(argv[0], argv);
+		_exit(127);
+	}
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0)
+		return (-1);
+	return (0);
+}
+
+static int
+same_file(const char *a, const char *b)
+{
+	FILE *fa, *fb;
+	int ca, cb;
+
+	if ((fa = fopen(a, "rb")) == NULL)
+		return (0);
+	if ((fb = fopen(b, "rb")) == NULL) {
+		fclose(fa);
+		return (0);
+	}
+	do {
+		ca = getc(fa);
+		cb = getc(fb);
+	} while (ca == cb && ca != EOF);
+	fclose(fa);
+	fclose(fb);
+	return (ca == cb);
+}
+
+/* Per-board processes against one batch process, nboards boards. */
+static int
+bench_batch(char *tool, char *kernel, char *rootfs, char *dir,
+    char **boards, int nboards, int rounds)
+{
+	char one[1024], many[1024], list[4096], *argv[16];
+	double t, tloop = 1e9, tbatch = 1e9;
+	int i, r, ret = 0;
+
+	list[0] = '\0';
+	for (i = 0; i < nboards; i++) {
+		if (strlen(list) + strlen(boards[i]) + 2 > sizeof(list))
+			return (-1);
+		if (i > 0)
+			strcat(list, ",");
+		strcat(list, boards[i]);
+	}
+	for (r = 0; r < rounds; r++) {
+		t = now();
+		for (i = 0; i < nboards; i++) {
+			snprintf(one, sizeof(one), "%s/%s.loop.bin", dir,
+			    boards[i]);
+			argv[0] = tool;
+			argv[1] = "-B";
+			argv[2] = boards[i];
+			argv[3] = "-k";
+			argv[4] = kernel;
+			argv[5] = "-r";
+			argv[6] = rootfs;
+			argv[7] = "-o";
+			argv[8] = one;
+			argv[9] = NULL;
+			if (run(argv) != 0) {
+				printf("%s -B %s failed\n", tool, boards[i]);
+				return (-1);
+			}
+		}
+		if ((t = now() - t) < tloop)
+			tloop = t;
+
+		snprintf(many, sizeof(many), "%s/%%s.batch.bin", dir);
+		t = now();
+		argv[0] = tool;
+		argv[1] = "-b";
+		argv[2] = list;
+		argv[3] = "-k";
+		argv[4] = kernel;
+		argv[5] = "-r";
+		argv[6] = rootfs;
+		argv[7] = "-o";
+		argv[8] = many;
+		argv[9] = NULL;
+		if (run(argv) != 0) {
+			printf("%s -b failed\n", tool);
+			return (-1);
+		}
+		if ((t = now() - t) < tbatch)
+			tbatch = t;
+	}
+
+	for (i = 0; i < nboards; i++) {
+		snprintf(one, sizeof(one), "%s/%s.loop.bin", dir, boards[i]);
+		snprintf(many, sizeof(many), "%s/%s.batch.bin", dir,
+		    boards[i]);
+		if (!same_file(one, many)) {
+			printf("%s: batch image differs\n", boards[i]);
+			ret = -1;
+		}
+		unlink(one);
+		unlink(many);
+	}
+	printf("%d boards: one process each %.3f s, batch %.3f s (%.1fx)%s\n",
+	    nboards, tloop, tbatch, tloop / tbatch, ret ? ", FAILED" : "");
+	return (ret);
+}
+
+int
+main(int argc, char **argv)
+{
+	char *tool = NULL, *kernel = NULL, *rootfs = NULL, *dir = "/tmp";
+	size_t size = 16 << 20, i;
+	int ch, rounds = 3;
+	uint8_t *buf;
+
+	while ((ch = getopt(argc, argv, "d:k:m:n:r:s:")) != -1) {
+		switch (ch) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 'k':
+			kernel = optarg;
+			break;
+		case 'm':
+			tool = optarg;
+			break;
+		case 'n':
+			rounds = atoi(optarg);
+			break;
+		case 'r':
+			rootfs = optarg;
+			break;
+		case 's':
+			size = (size_t)atoi(optarg) << 20;
+			break;
+		default:
+			fprintf(stderr, "usage: md5mbbench [-n rounds] "
+			    "[-s size_mb]\n\t[-m mktplinkfw -k kernel -r rootfs "
+			    "-d tmpdir board ...]\n");
+			return (1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (rounds < 1)
+		rounds = 1;
+	/* the check streams start 977 bytes apart and run to 65537 bytes */
+	if (size < 977 * MD5MB_MAX_STREAMS + 65537)
+		size = 977 * MD5MB_MAX_STREAMS + 65537;
+
+	if ((buf = malloc(size)) == NULL) {
+		perror("malloc");
+		return (1);
+	}
+	srandom(1);
+	for (i = 0; i < size; i++)
+		buf[i] = random();
+	bench_impls(buf, size, rounds);
+	free(buf);
+
+	if (tool == NULL)
+		return (0);
+	if (kernel == NULL || rootfs == NULL || argc == 0) {
+		fprintf(stderr, "md5mbbench: -m needs -k, -r and boards\n");
+		return (1);
+	}
+	return (bench_batch(tool, kernel, rootfs, dir, argv, argc, rounds) ?
+	    1 : 0);
+}
@@ -12,6 +12,7 @@
  */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
@@ -20,15 +21,19 @@
 #include <getopt.h>     /* for getopt() */
 #include <stdarg.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 
 #include <openssl/md5.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
+#include "md5mb.h"
+
 #define ALIGN(x,a) ({ typeof(a) __a = (a); (((x) + __a - 1) & ~(__a - 1)); })
 
 #define HEADER_VERSION_V1	0x01000000
+#define HEADER_VERSION_V2	0x02000000
 #define HWID_GL_INET_V1		0x08000001
 #define HWID_GS_OOLITE_V1	0x3C000101
 #define HWID_TL_MR10U_V1	0x00100101
@@ -69,18 +74,26 @@
 #define HWID_TL_WR1043ND_V2	0x10430002
 #define HWID_TL_WR1041N_V2	0x10410002
 #define HWID_TL_WR2543N_V1	0x25430001
+#define HWID_TD_W8970_V1	0x89700001
+
+/* Header version of -o when no board says otherwise (2 for mktplinkfw2) */
+#ifndef FW_HEADER_VER_DEFAULT
+#define FW_HEADER_VER_DEFAULT	1
+#endif
 
 #define MD5SUM_LEN	16
+#define FW_BLOCK_LEN	(64 * 1024)	/* I/O block of the image writer */
+#define FW_MAX_OUTPUTS	MD5MB_MAX_STREAMS	/* images per writer pass */
+#define FW_CKPT_INTERVAL	FW_BLOCK_LEN	/* MD5 midstate spacing */
+#define FW_CKPT_MAGIC	"TPLMD5CK"
 
 struct file_info {
 	char		*file_name;	/* name of the file */
 	uint32_t	file_size;	/* length of the file */
 };
 
-struct fw_header {
-	uint32_t	version;	/* header version */
-	char		vendor_name[24];
-	char		fw_version[36];
+/* The part of the header that is laid out alike in v1 and v2. */
+struct fw_header_common {
 	uint32_t	hw_id;		/* hardware id */
 	uint32_t	hw_rev;		/* hardware revision */
 	uint32_t	unk1;
@@ -97,12 +110,49 @@ struct fw_header {
 	uint32_t	rootfs_len;	/* rootfs data length */
 	uint32_t	boot_ofs;	/* bootloader data offset */
 	uint32_t	boot_len;	/* bootloader data length */
+} __attribute__ ((packed));
+
+struct fw_header {
+	uint32_t	version;	/* header version */
+	char		vendor_name[24];
+	char		fw_version[36];
+	struct fw_header_common c;
 	uint16_t	ver_hi;
 	uint16_t	ver_mid;
 	uint16_t	ver_lo;
 	uint8_t		pad[354];
 } __attribute__ ((packed));
 
+/* v2 header, as used by the Lantiq boards; the same size as v1. */
+struct fw_header_v2 {
+	uint32_t	version;	/* 0x00: header version */
+	char		fw_version[48]; /* 0x04: fw version string */
+	struct fw_header_common c;	/* 0x34 */
+	uint16_t	unk4;		/* 0x8c: 0x55aa */
+	uint8_t		sver_hi;	/* 0x8e */
+	uint8_t		sver_lo;	/* 0x8f */
+	uint8_t		unk5;		/* 0x90: magic: 0xa5 */
+	uint8_t		ver_hi;         /* 0x91 */
+	uint8_t		ver_mid;        /* 0x92 */
+	uint8_t		ver_lo;         /* 0x93 */
+	uint8_t		pad[364];
+} __attribute__ ((packed));
+
+/*
+ * What differs between the header versions.  The image behind the header
+ * is the same for both, so one pass over the inputs can write an image
+ * of each version.
+ */
+struct fw_header_desc {
+	int		ver;		/* 1 or 2 */
+	uint32_t	version;	/* value of the version field */
+	size_t		common_ofs;	/* offset of struct fw_header_common */
+	uint32_t	unk3;		/* expected value of unk3 */
+	char		*md5salt_normal;
+	char		*md5salt_boot;
+	void		(*fill)(char *buf, struct fw_header_desc *desc);
+};
+
 struct flash_layout {
 	char		*id;
 	uint32_t	fw_max_len;
@@ -116,16 +166,23 @@ struct board_info {
 	uint32_t	hw_id;
 	uint32_t	hw_rev;
 	char		*layout_id;
+	int		hdr_ver;	/* header version, v1 if 0 */
 };
 
 /*
  * Globals
  */
 static char *ofname;
+static char *ofname_ver[3];	/* output file for each header version */
+static char *batch_list;
+static char *ckpt_name;
+static char *restamp_name;
+static char *patch_arg;
 static char *progname;
 static char *vendor = "TP-LINK Technologies";
 static char *version = "ver. 1.0";
 static char *fw_ver = "0.0.0";
+static char *sver = "1.0";
 
 static char *board_id;
 static struct board_info *board;
@@ -138,6 +195,8 @@ static uint32_t hw_rev;
 static int fw_ver_lo;
 static int fw_ver_mid;
 static int fw_ver_hi;
+static int sver_lo;
+static int sver_hi;
 static struct file_info kernel_info;
 static uint32_t kernel_la = 0;
 static uint32_t kernel_ep = 0;
@@ -166,6 +225,11 @@ char md5salt_boot[MD5SUM_LEN] = {
 	0xa7, 0x9c, 0x28, 0xda, 0xb2, 0xe9, 0x0f, 0x42,
 };
 
+char md5salt_normal_v2[MD5SUM_LEN] = {
+	0xdc, 0xd7, 0x3a, 0xa5, 0xc3, 0x95, 0x98, 0xfb,
+	0xdc, 0xf9, 0xe7, 0xf4, 0x0e, 0xae, 0x47, 0x37,
+};
+
 static struct flash_layout layouts[] = {
 	{
 		.id		= "4M",
@@ -209,6 +273,12 @@ static struct flash_layout layouts[] = {
 		.kernel_la	= 0x00000000,
 		.kernel_ep	= 0xc0000000,
 		.rootfs_ofs	= 0x2a0000,
+	}, {
+		.id		= "8Mltq",
+		.fw_max_len	= 0x7a0000,
+		.kernel_la	= 0x80002000,
+		.kernel_ep	= 0x80002000,
+		.rootfs_ofs	= 0x140000,
 	}, {
 		/* terminating entry */
 	}
@@ -415,6 +485,12 @@ static struct board_info boards[] = {
 		.hw_id		= HWID_GS_OOLITE_V1,
 		.hw_rev		= 1,
 		.layout_id	= "16Mlzma",
+	}, {
+		.id		= "TD-W8970v1",
+		.hw_id		= HWID_TD_W8970_V1,
+		.hw_rev		= 1,
+		.layout_id	= "8Mltq",
+		.hdr_ver	= 2,
 	}, {
 		/* terminating entry */
 	}
@@ -432,7 +508,7 @@ static struct board_info boards[] = {
 #define ERRS(fmt, ...) do { \
 	int save = errno; \
 	fflush(0); \
-	fprintf(stderr, "[%s] *** error: " fmt "\n", \
+	fprintf(stderr, "[%s] *** error: " fmt ": %s\n", \
 			progname, ## __VA_ARGS__, strerror(save)); \
 } while (0)
 
@@ -494,6 +570,9 @@ static void usage(int status)
 "\n"
 "Options:\n"
 "  -B <board>      create image for the board specified with <board>\n"
+"  -b <list>       create images for the comma-separated boards or\n"
+"                  <hwid>:<layout>[:<hwrev>] in <list>, or \"all\", in one run;\n"
+"                  -o is then a template, its %%s replaced by each board's name\n"
 "  -c              use combined kernel image\n"
 "  -E <ep>         overwrite kernel entry point with <ep> (hexval prefixed with 0x)\n"
 "  -L <la>         overwrite kernel load address with <la> (hexval prefixed with 0x)\n"
@@ -504,16 +583,25 @@ static void usage(int status)
 "  -r <file>       read rootfs image from the file <file>\n"
 "  -a <align>      align the rootfs start on an <align> bytes boundary\n"
 "  -R <offset>     overwrite rootfs offset with <offset> (hexval prefixed with 0x)\n"
-"  -o <file>       write output to the file <file>\n"
+"  -o <file>       write output to the file <file>, with the board's header\n"
+"                  version (v%d unless the board says otherwise)\n"
+"  -1 <file>       write an image with a v1 header to the file <file>\n"
+"  -2 <file>       write an image with a v2 header to the file <file>\n"
 "  -s              strip padding from the end of the image\n"
 "  -j              add jffs2 end-of-filesystem markers\n"
 "  -N <vendor>     set image vendor to <vendor>\n"
 "  -V <version>    set image version to <version>\n"
 "  -v <version>    set firmware version to <version>\n"
+"  -y <version>    set secondary version to <version> (v2 header)\n"
 "  -i <file>       inspect given firmware file <file>\n"
 "  -x              extract kernel and rootfs while inspecting (requires -i)\n"
 "  -X <size>       reserve <size> bytes in the firmware image (hexval prefixed with 0x)\n"
-"  -h              show this screen\n"
+"  -C <file>       write the image's MD5 checkpoints to the file <file>, or with\n"
+"                  -T, read them from it (and update it)\n"
+"  -T <file>       restamp the firmware file <file> in place, made with -C\n"
+"  -P <ofs>:<file> with -T, write the file <file> into the image at offset <ofs>\n"
+"  -h              show this screen\n",
+		FW_HEADER_VER_DEFAULT
 	);
 
 	exit(status);
@@ -690,21 +778,71 @@ static int check_options(void)
 		}
 	}
 
-	if (ofname == NULL) {
+	/* batch mode names its own outputs from the -o template */
+	if (ofname && !batch_list) {
+		int ver = (board && board->hdr_ver) ? board->hdr_ver :
+			  FW_HEADER_VER_DEFAULT;
+
+		if (ofname_ver[ver]) {
+			ERR("two output files for the v%d header", ver);
+			return -1;
+		}
+		ofname_ver[ver] = ofname;
+	}
+
+	if (!batch_list && ofname_ver[1] == NULL && ofname_ver[2] == NULL) {
 		ERR("no output file specified");
 		return -1;
 	}
 
+	if (ckpt_name && (batch_list || (ofname_ver[1] && ofname_ver[2]))) {
+		ERR("MD5 checkpoints can only be written for one image");
+		return -1;
+	}
+
 	ret = sscanf(fw_ver, "%d.%d.%d", &fw_ver_hi, &fw_ver_mid, &fw_ver_lo);
 	if (ret != 3) {
 		ERR("invalid firmware version '%s'", fw_ver);
 		return -1;
 	}
 
+	ret = sscanf(sver, "%d.%d", &sver_hi, &sver_lo);
+	if (ret != 2) {
+		ERR("invalid secondary version '%s'", sver);
+		return -1;
+	}
+
 	return 0;
 }
 
-static void fill_header(char *buf, int len)
+/*
+ * The fields common to both header versions, with the MD5 salt in md5sum1;
+ * the digest of the whole image replaces the salt once the image has been
+ * written.
+ */
+static void fill_header_common(struct fw_header_common *c,
+			       struct fw_header_desc *desc)
+{
+	c->hw_id = htonl(hw_id);
+	c->hw_rev = htonl(hw_rev);
+
+	if (boot_info.file_size == 0)
+		memcpy(c->md5sum1, desc->md5salt_normal, sizeof(c->md5sum1));
+	else
+		memcpy(c->md5sum1, desc->md5salt_boot, sizeof(c->md5sum1));
+
+	c->kernel_la = htonl(kernel_la);
+	c->kernel_ep = htonl(kernel_ep);
+	c->fw_length = htonl(layout->fw_max_len);
+	c->kernel_ofs = htonl(sizeof(struct fw_header));
+	c->kernel_len = htonl(kernel_len);
+	if (!combined) {
+		c->rootfs_ofs = htonl(rootfs_ofs);
+		c->rootfs_len = htonl(rootfs_info.file_size);
+	}
+}
+
+static void fill_header_v1(char *buf, struct fw_header_desc *desc)
 {
 	struct fw_header *hdr = (struct fw_header *)buf;
 
@@ -713,32 +851,427 @@ static void fill_header(char *buf, int len)
 	hdr->version = htonl(HEADER_VERSION_V1);
 	strncpy(hdr->vendor_name, vendor, sizeof(hdr->vendor_name));
 	strncpy(hdr->fw_version, version, sizeof(hdr->fw_version));
-	hdr->hw_id = htonl(hw_id);
-	hdr->hw_rev = htonl(hw_rev);
-
-	if (boot_info.file_size == 0)
-		memcpy(hdr->md5sum1, md5salt_normal, sizeof(hdr->md5sum1));
-	else
-		memcpy(hdr->md5sum1, md5salt_boot, sizeof(hdr->md5sum1));
-
-	hdr->kernel_la = htonl(kernel_la);
-	hdr->kernel_ep = htonl(kernel_ep);
-	hdr->fw_length = htonl(layout->fw_max_len);
-	hdr->kernel_ofs = htonl(sizeof(struct fw_header));
-	hdr->kernel_len = htonl(kernel_len);
-	if (!combined) {
-		hdr->rootfs_ofs = htonl(rootfs_ofs);
-		hdr->rootfs_len = htonl(rootfs_info.file_size);
-	}
+	fill_header_common(&hdr->c, desc);
 
 	hdr->ver_hi = htons(fw_ver_hi);
 	hdr->ver_mid = htons(fw_ver_mid);
 	hdr->ver_lo = htons(fw_ver_lo);
+}
+
+static void fill_header_v2(char *buf, struct fw_header_desc *desc)
+{
+	struct fw_header_v2 *hdr = (struct fw_header_v2 *)buf;
+	unsigned ver_len;
+
+	memset(hdr, '\xff', sizeof(struct fw_header_v2));
+
+	hdr->version = htonl(HEADER_VERSION_V2);
+	ver_len = strlen(version);
+	if (ver_len > (sizeof(hdr->fw_version) - 1))
+		ver_len = sizeof(hdr->fw_version) - 1;
+
+	memcpy(hdr->fw_version, version, ver_len);
+	hdr->fw_version[ver_len] = 0;
+	fill_header_common(&hdr->c, desc);
+
+	hdr->c.boot_ofs = htonl(0);
+	hdr->c.boot_len = htonl(boot_info.file_size);
+
+	hdr->c.unk1 = htonl(0);
+	hdr->c.unk2 = htonl(0);
+	hdr->c.unk3 = htonl(0xffffffff);
+	hdr->unk4 = htons(0x55aa);
+	hdr->unk5 = 0xa5;
+
+	hdr->sver_hi = sver_hi;
+	hdr->sver_lo = sver_lo;
+
+	hdr->ver_hi = fw_ver_hi;
+	hdr->ver_mid = fw_ver_mid;
+	hdr->ver_lo = fw_ver_lo;
+}
+
+static struct fw_header_desc header_descs[] = {
+	{
+		.ver		= 1,
+		.version	= HEADER_VERSION_V1,
+		.common_ofs	= offsetof(struct fw_header, c),
+		.unk3		= 0,
+		.md5salt_normal	= md5salt_normal,
+		.md5salt_boot	= md5salt_boot,
+		.fill		= fill_header_v1,
+	}, {
+		.ver		= 2,
+		.version	= HEADER_VERSION_V2,
+		.common_ofs	= offsetof(struct fw_header_v2, c),
+		.unk3		= 0xffffffff,
+		.md5salt_normal	= md5salt_normal_v2,
+		.md5salt_boot	= md5salt_boot,
+		.fill		= fill_header_v2,
+	}, {
+		/* terminating entry */
+	}
+};
+
+static struct fw_header_desc *find_header_desc(uint32_t version)
+{
+	struct fw_header_desc *desc;
+
+	for (desc = header_descs; desc->ver != 0; desc++)
+		if (desc->version == version)
+			return desc;
+
+	return NULL;
+}
+
+/*
+ * The image is streamed to the output files through MD5 rather than built
+ * in a buffer of the flash size: file data goes through one I/O block,
+ * and 0xff padding comes from another that never changes.  Each output
+ * has its own header; everything after the header is the same for all of
+ * them and is written from the same blocks.  Their digests are one
+ * multi-buffer MD5 context, a stream per output, so the shared bytes are
+ * hashed for all outputs in one pass.  Bytes past limit are dropped, as
+ * they would have fallen outside that buffer.
+ */
+struct fw_output {
+	struct fw_header_desc *desc;
+	char		*file_name;
+	FILE		*f;
+	uint32_t	hw_id;
+	uint32_t	hw_rev;
+	uint8_t		md5sum[MD5SUM_LEN];
+};
+
+/*
+ * MD5 midstate checkpoints (-C).  MD5 only carries four words from one
+ * 64-byte block to the next, so the state after the header and after
+ * every interval bytes of the image is enough to hash the image again
+ * from any of those offsets on.  A restamp (-T) that changes the image
+ * from some offset on resumes from the last checkpoint before it, and
+ * costs what the changed tail costs instead of the whole image.  On disk,
+ * all fields are big-endian.
+ */
+struct fw_ckpt_header {
+	char		magic[8];	/* FW_CKPT_MAGIC */
+	uint32_t	interval;	/* checkpoint spacing */
+	uint32_t	image_len;	/* length of the image */
+	uint32_t	count;		/* checkpoints that follow */
+	uint8_t		md5sum[MD5SUM_LEN];	/* digest of the image */
+} __attribute__ ((packed));
+
+struct fw_ckpt_entry {
+	uint32_t	ofs;		/* image offset, a multiple of 64 */
+	uint32_t	state[4];	/* MD5 state after ofs bytes */
+};
+
+struct fw_ckpt {
+	uint32_t	interval;
+	uint32_t	count;
+	uint32_t	size;
+	struct fw_ckpt_entry *e;
+};
+
+struct fw_writer {
+	struct fw_output out[FW_MAX_OUTPUTS];
+	int		nout;
+	uint32_t	pos;
+	uint32_t	limit;
+	struct md5mb_ctx ctx;
+	struct fw_ckpt	*ckpt;		/* checkpoints of out[0], or NULL */
+	uint32_t	ckpt_next;	/* offset of the next checkpoint */
+};
+
+static char fw_ff_block[FW_BLOCK_LEN];
+static char fw_io_block[FW_BLOCK_LEN];
+static char fw_hdr_block[FW_MAX_OUTPUTS][sizeof(struct fw_header)];
+
+static int fw_output_write(struct fw_output *o, const void *data,
+			   uint32_t len)
+{
+	if (fwrite(data, 1, len, o->f) != len) {
+		ERRS("unable to write output file \"%s\"", o->file_name);
+		return -1;
+	}
+	return 0;
+}
+
+static int fw_ckpt_add(struct fw_writer *w, uint32_t ofs)
+{
+	struct fw_ckpt *ck = w->ckpt;
+	struct fw_ckpt_entry *e;
+
+	if (ck->count == ck->size) {
+		ck->size = ck->size ? ck->size * 2 : 64;
+		e = realloc(ck->e, ck->size * sizeof(*e));
+		if (e == NULL) {
+			ERR("no memory for the MD5 checkpoints");
+			return -1;
+		}
+		ck->e = e;
+	}
+	e = &ck->e[ck->count++];
+	e->ofs = ofs;
+	md5mb_state(&w->ctx, 0, e->state);
+	w->ckpt_next = (ofs / ck->interval + 1) * ck->interval;
+	return 0;
+}
+
+/* Hashes len bytes at w->pos, taking the checkpoints that fall in them. */
+static int fw_hash(struct fw_writer *w, const void **p, uint32_t len)
+{
+	uint32_t pos = w->pos;
+	uint32_t n;
+	int i;
+
+	while (len) {
+		n = len;
+		if (w->ckpt && w->ckpt_next - pos < n)
+			n = w->ckpt_next - pos;
+		md5mb_update(&w->ctx, p, n);
+		for (i = 0; i < w->nout; i++)
+			p[i] = (const char *)p[i] + n;
+		pos += n;
+		len -= n;
+		if (w->ckpt && pos == w->ckpt_next && fw_ckpt_add(w, pos))
+			return -1;
+	}
+	return 0;
+}
+
+static int fw_write(struct fw_writer *w, const void *data, uint32_t len)
+{
+	const void *p[FW_MAX_OUTPUTS];
+	int i;
+
+	if (w->pos >= w->limit)
+		return 0;
+	if (len > w->limit - w->pos)
+		len = w->limit - w->pos;
+
+	for (i = 0; i < w->nout; i++) {
+		if (fw_output_write(&w->out[i], data, len))
+			return -1;
+		p[i] = data;
+	}
+	if (fw_hash(w, p, len))
+		return -1;
+	w->pos += len;
+	return 0;
+}
+
+/*
+ * Each output's own header, with the salt in place of its digest.  The
+ * headers differ by version and hardware id, so each is filled with the
+ * output's hw_id and hw_rev in place of the board's.
+ */
+static int fw_write_headers(struct fw_writer *w)
+{
+	const void *p[FW_MAX_OUTPUTS];
+	struct fw_output *o;
+	int i;
+
+	for (i = 0; i < w->nout; i++) {
+		o = &w->out[i];
+		hw_id = o->hw_id;
+		hw_rev = o->hw_rev;
+		o->desc->fill(fw_hdr_block[i], o->desc);
+		if (fw_output_write(o, fw_hdr_block[i], sizeof(fw_hdr_block[i])))
+			return -1;
+		p[i] = fw_hdr_block[i];
+	}
+	if (fw_hash(w, p, sizeof(fw_hdr_block[0])))
+		return -1;
+	w->pos += sizeof(fw_hdr_block[0]);
+	return 0;
+}
+
+/* Patches each output's digest over its salt. */
+static int fw_finish(struct fw_writer *w)
+{
+	struct fw_output *o;
+	uint8_t md5sum[FW_MAX_OUTPUTS][MD5SUM_LEN];
+	int i;
+
+	md5mb_final(&w->ctx, md5sum);
+	for (i = 0; i < w->nout; i++) {
+		o = &w->out[i];
+		memcpy(o->md5sum, md5sum[i], sizeof(o->md5sum));
+		if (fflush(o->f) ||
+		    pwrite(fileno(o->f), md5sum[i], sizeof(md5sum[i]),
+			   o->desc->common_ofs +
+			   offsetof(struct fw_header_common, md5sum1)) !=
+		    sizeof(md5sum[i])) {
+			ERRS("unable to write output file \"%s\"", o->file_name);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int fw_ckpt_save(struct fw_ckpt *ck, char *name, uint32_t image_len,
+			uint8_t *md5sum)
+{
+	struct fw_ckpt_header hdr;
+	struct fw_ckpt_entry e;
+	FILE *f;
+	uint32_t i;
+	int j;
+	int ret = -1;
+
+	f = fopen(name, "w");
+	if (f == NULL) {
+		ERRS("could not open \"%s\" for writing", name);
+		return -1;
+	}
+
+	memcpy(hdr.magic, FW_CKPT_MAGIC, sizeof(hdr.magic));
+	hdr.interval = htonl(ck->interval);
+	hdr.image_len = htonl(image_len);
+	hdr.count = htonl(ck->count);
+	memcpy(hdr.md5sum, md5sum, sizeof(hdr.md5sum));
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+		goto out_close;
+
+	for (i = 0; i < ck->count; i++) {
+		e.ofs = htonl(ck->e[i].ofs);
+		for (j = 0; j < 4; j++)
+			e.state[j] = htonl(ck->e[i].state[j]);
+		if (fwrite(&e, sizeof(e), 1, f) != 1)
+			goto out_close;
+	}
+
+	ret = 0;
+
+ out_close:
+	if (fclose(f))
+		ret = -1;
+	if (ret) {
+		ERRS("unable to write checkpoint file \"%s\"", name);
+		unlink(name);
+	}
+	return ret;
+}
+
+static int fw_ckpt_load(struct fw_ckpt *ck, char *name, uint32_t *image_len,
+			uint8_t *md5sum)
+{
+	struct fw_ckpt_header hdr;
+	struct fw_ckpt_entry *e;
+	FILE *f;
+	uint32_t i;
+	int j;
+	int ret = -1;
+
+	f = fopen(name, "r");
+	if (f == NULL) {
+		ERRS("could not open \"%s\" for reading", name);
+		return -1;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    memcmp(hdr.magic, FW_CKPT_MAGIC, sizeof(hdr.magic)) != 0) {
+		ERR("\"%s\" is not an MD5 checkpoint file", name);
+		goto out_close;
+	}
+
+	ck->interval = ntohl(hdr.interval);
+	ck->count = ntohl(hdr.count);
+	*image_len = ntohl(hdr.image_len);
+	memcpy(md5sum, hdr.md5sum, sizeof(hdr.md5sum));
+	if (ck->interval == 0 || ck->interval % 64 || ck->count == 0 ||
+	    ck->count > *image_len / 64) {
+		ERR("bad MD5 checkpoint file \"%s\"", name);
+		goto out_close;
+	}
+
+	ck->size = ck->count;
+	ck->e = malloc(ck->size * sizeof(*ck->e));
+	if (ck->e == NULL) {
+		ERR("no memory for the MD5 checkpoints");
+		goto out_close;
+	}
+	if (fread(ck->e, sizeof(*ck->e), ck->count, f) != ck->count) {
+		ERR("truncated MD5 checkpoint file \"%s\"", name);
+		goto out_close;
+	}
+
+	for (i = 0; i < ck->count; i++) {
+		e = &ck->e[i];
+		e->ofs = ntohl(e->ofs);
+		for (j = 0; j < 4; j++)
+			e->state[j] = ntohl(e->state[j]);
+		if (e->ofs % 64 || e->ofs > *image_len ||
+		    (i > 0 && e->ofs <= ck->e[i - 1].ofs)) {
+			ERR("bad MD5 checkpoint file \"%s\"", name);
+			goto out_close;
+		}
+	}
+
+	ret = 0;
+
+ out_close:
+	fclose(f);
+	return ret;
+}
+
+/* Pads with 0xff up to the image offset ofs. */
+static int fw_fill(struct fw_writer *w, uint32_t ofs)
+{
+	uint32_t n;
+
+	if (ofs > w->limit)
+		ofs = w->limit;
+	while (w->pos < ofs) {
+		n = ofs - w->pos;
+		if (n > FW_BLOCK_LEN)
+			n = FW_BLOCK_LEN;
+		if (fw_write(w, fw_ff_block, n))
+			return -1;
+	}
+	return 0;
+}
 
-	get_md5(buf, len, hdr->md5sum1);
+/*
+ * Copies the file_size bytes of a file into the image; should the file
+ * have shrunk since it was stat()ed, the rest is left as 0xff padding.
+ */
+static int fw_copy(struct fw_writer *w, struct file_info *fdata)
+{
+	uint32_t end = w->pos + fdata->file_size;
+	size_t n;
+	FILE *f;
+	int ret = -1;
+
+	f = fopen(fdata->file_name, "r");
+	if (f == NULL) {
+		ERRS("could not open \"%s\" for reading", fdata->file_name);
+		return -1;
+	}
+
+	while (w->pos < end) {
+		n = end - w->pos;
+		if (n > FW_BLOCK_LEN)
+			n = FW_BLOCK_LEN;
+		n = fread(fw_io_block, 1, n, f);
+		if (n == 0)
+			break;
+		if (fw_write(w, fw_io_block, n))
+			goto out_close;
+	}
+	if (ferror(f)) {
+		ERRS("unable to read from file \"%s\"", fdata->file_name);
+		goto out_close;
+	}
+
+	ret = fw_fill(w, end);
+
+ out_close:
+	fclose(f);
+	return ret;
 }
 
-static int pad_jffs2(char *buf, int currlen)
+static int pad_jffs2(struct fw_writer *w, int currlen)
 {
 	int len;
 	uint32_t pad_mask;
@@ -763,8 +1296,9 @@ static int pad_jffs2(char *buf, int currlen)
 				pad_mask &= ~mask;
 		}
 
-		for (i = 0; i < sizeof(jffs2_eof_mark); i++)
-			buf[len + i] = jffs2_eof_mark[i];
+		if (fw_fill(w, len) ||
+		    fw_write(w, jffs2_eof_mark, sizeof(jffs2_eof_mark)))
+			return -1;
 
 		len += sizeof(jffs2_eof_mark);
 	}
@@ -772,94 +1306,457 @@ static int pad_jffs2(char *buf, int currlen)
 	return len;
 }
 
-static int write_fw(char *data, int len)
+/*
+ * Writes the image without holding it: the header goes out with the salt
+ * in md5sum1, kernel and rootfs are copied through MD5, and the digest is
+ * patched over the salt at the end.  Memory use does not depend on the
+ * flash size.  All of the writer's outputs, set up by the caller with
+ * their header version and hardware id, are written in the same pass.
+ */
+static int write_image(struct fw_writer *w)
 {
-	FILE *f;
+	uint32_t buflen;
+	int writelen;
 	int ret = EXIT_FAILURE;
+	int nopen;
+	int i;
 
-	f = fopen(ofname, "w");
-	if (f == NULL) {
-		ERRS("could not open \"%s\" for writing", ofname);
-		goto out;
+	buflen = layout->fw_max_len;
+	memset(fw_ff_block, 0xff, sizeof(fw_ff_block));
+
+	w->pos = 0;
+	w->limit = strip_padding ? UINT32_MAX : buflen;
+	for (nopen = 0; nopen < w->nout; nopen++) {
+		w->out[nopen].f = fopen(w->out[nopen].file_name, "w");
+		if (w->out[nopen].f == NULL) {
+			ERRS("could not open \"%s\" for writing",
+			     w->out[nopen].file_name);
+			goto out_close;
+		}
+	}
+	md5mb_init(&w->ctx, w->nout);
+	if (w->ckpt) {
+		w->ckpt->interval = FW_CKPT_INTERVAL;
+		w->ckpt->count = 0;
+		w->ckpt_next = sizeof(struct fw_header);
 	}
 
-	errno = 0;
-	fwrite(data, len, 1, f);
-	if (errno) {
-		ERRS("unable to write output file");
-		goto out_flush;
+	if (fw_write_headers(w) || fw_copy(w, &kernel_info))
+		goto out_close;
+
+	writelen = sizeof(struct fw_header) + kernel_len;
+
+	if (!combined) {
+		if (rootfs_align) {
+			if (fw_fill(w, writelen))
+				goto out_close;
+		} else if (fw_fill(w, rootfs_ofs))
+			goto out_close;
+
+		if (fw_copy(w, &rootfs_info))
+			goto out_close;
+
+		if (rootfs_align)
+			writelen += rootfs_info.file_size;
+		else
+			writelen = rootfs_ofs + rootfs_info.file_size;
+
+		if (add_jffs2_eof) {
+			writelen = pad_jffs2(w, writelen);
+			if (writelen < 0)
+				goto out_close;
+		}
 	}
 
-	DBG("firmware file \"%s\" completed", ofname);
+	if (!strip_padding)
+		writelen = buflen;
+
+	if (fw_fill(w, writelen) || fw_finish(w))
+		goto out_close;
+
+	if (w->ckpt &&
+	    fw_ckpt_save(w->ckpt, ckpt_name, w->pos, w->out[0].md5sum))
+		goto out_close;
+
+	for (i = 0; i < w->nout; i++)
+		DBG("firmware file \"%s\" completed", w->out[i].file_name);
 
 	ret = EXIT_SUCCESS;
 
- out_flush:
-	fflush(f);
-	fclose(f);
-	if (ret != EXIT_SUCCESS) {
-		unlink(ofname);
+ out_close:
+	for (i = 0; i < nopen; i++) {
+		fclose(w->out[i].f);
+		if (ret != EXIT_SUCCESS)
+			unlink(w->out[i].file_name);
 	}
- out:
 	return ret;
 }
 
+/*
+ * With both -1 and -2, the v1 and v2 images are written in the same pass.
+ * With -C, the MD5 checkpoints of the one image go to the file ckpt_name.
+ */
 static int build_fw(void)
 {
-	int buflen;
-	char *buf;
-	char *p;
+	static struct fw_writer w;
+	static struct fw_ckpt ckpt;
+	struct fw_output *o;
+	int i;
+
+	w.nout = 0;
+	w.ckpt = ckpt_name ? &ckpt : NULL;
+	for (i = 1; i <= 2; i++) {
+		if (ofname_ver[i] == NULL)
+			continue;
+
+		o = &w.out[w.nout++];
+		o->desc = &header_descs[i - 1];
+		o->file_name = ofname_ver[i];
+		o->hw_id = hw_id;
+		o->hw_rev = hw_rev;
+	}
+
+	return write_image(&w);
+}
+
+/*
+ * Batch mode (-b): every image of a release in one process.  The list is
+ * "all" or comma-separated entries, each a board id or hwid:layout[:hwrev],
+ * and -o is a file name template whose %s becomes the board id, or
+ * hwid-layout.  The images of a flash layout differ only in their headers,
+ * so they are written together, up to FW_MAX_OUTPUTS per pass: the kernel
+ * and rootfs are read once and the MD5 of the shared bytes runs a lane per
+ * image.  Each board gets its own header version.
+ */
+struct batch_entry {
+	char			*name;
+	struct board_info	*board;
+	char			*hw_id;
+	char			*hw_rev;
+	struct flash_layout	*layout;
+	int			done;
+};
+
+static char *batch_file_name(char *name)
+{
+	char *pct = strstr(ofname, "%s");
+	size_t pre = pct - ofname;
+	char *ret;
+
+	ret = malloc(strlen(ofname) - 2 + strlen(name) + 1);
+	if (ret == NULL) {
+		ERR("no memory for the file name of \"%s\"", name);
+		return NULL;
+	}
+	memcpy(ret, ofname, pre);
+	strcpy(ret + pre, name);
+	strcat(ret, pct + 2);
+	return ret;
+}
+
+static int batch_parse(char *list, struct batch_entry **entries, int *count)
+{
+	struct batch_entry *e;
+	struct board_info *b;
+	char *copy, *tok, *layout_name, *hw_rev_str;
+	int n;
+
+	n = 1;
+	for (tok = list; *tok; tok++)
+		if (*tok == ',')
+			n++;
+	if (strcasecmp(list, "all") == 0)
+		for (n = 0, b = boards; b->id != NULL; b++)
+			n++;
+
+	*entries = calloc(n, sizeof(struct batch_entry));
+	copy = strdup(list);
+	if (*entries == NULL || copy == NULL) {
+		ERR("no memory for the batch list");
+		return -1;
+	}
+
+	*count = 0;
+	if (strcasecmp(list, "all") == 0) {
+		for (b = boards; b->id != NULL; b++) {
+			e = &(*entries)[(*count)++];
+			e->name = b->id;
+			e->board = b;
+		}
+		free(copy);
+		return 0;
+	}
+
+	for (tok = strtok(copy, ","); tok; tok = strtok(NULL, ",")) {
+		e = &(*entries)[(*count)++];
+		layout_name = strchr(tok, ':');
+		if (layout_name == NULL) {
+			e->board = find_board(tok);
+			if (e->board == NULL) {
+				ERR("unknown/unsupported board id \"%s\"", tok);
+				return -1;
+			}
+			e->name = e->board->id;
+			continue;
+		}
+
+		*layout_name++ = '\0';
+		hw_rev_str = strchr(layout_name, ':');
+		if (hw_rev_str)
+			*hw_rev_str++ = '\0';
+		e->hw_id = tok;
+		e->hw_rev = hw_rev_str;
+		e->name = malloc(strlen(tok) + 1 + strlen(layout_name) + 1);
+		if (e->name == NULL) {
+			ERR("no memory for the batch list");
+			return -1;
+		}
+		sprintf(e->name, "%s-%s", tok, layout_name);
+		e->layout = find_layout(layout_name);
+		if (e->layout == NULL) {
+			ERR("unknown flash layout \"%s\"", layout_name);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int build_batch(void)
+{
+	static struct fw_writer w;
+	struct batch_entry *entries, *e, *first;
+	struct fw_output *o;
+	char *user_layout_id = layout_id;
+	uint32_t user_kernel_la = kernel_la;
+	uint32_t user_kernel_ep = kernel_ep;
+	uint32_t user_rootfs_ofs = rootfs_ofs;
+	int count, i, j, ver;
 	int ret = EXIT_FAILURE;
-	int writelen = 0;
 
-	buflen = layout->fw_max_len;
+	if (ofname == NULL || strstr(ofname, "%s") == NULL) {
+		ERR("batch mode needs an -o template with %%s in it");
+		return ret;
+	}
+	if (ofname_ver[1] || ofname_ver[2] || board_id || opt_hw_id) {
+		ERR("-1, -2, -B and -H can not be used with -b");
+		return ret;
+	}
 
-	buf = malloc(buflen);
-	if (!buf) {
-		ERR("no memory for buffer\n");
-		goto out;
+	if (batch_parse(batch_list, &entries, &count))
+		return ret;
+
+	/* -F puts every image on the one layout */
+	if (user_layout_id) {
+		layout = find_layout(user_layout_id);
+		if (layout == NULL) {
+			ERR("unknown flash layout \"%s\"", user_layout_id);
+			return ret;
+		}
+	}
+	for (i = 0; i < count; i++) {
+		e = &entries[i];
+		if (user_layout_id)
+			e->layout = layout;
+		else if (e->board)
+			e->layout = find_layout(e->board->layout_id);
 	}
 
-	memset(buf, 0xff, buflen);
-	p = buf + sizeof(struct fw_header);
-	ret = read_to_buf(&kernel_info, p);
-	if (ret)
-		goto out_free_buf;
+	for (i = 0; i < count; i++) {
+		first = &entries[i];
+		if (first->done)
+			continue;
+
+		board_id = first->board ? first->board->id : NULL;
+		opt_hw_id = first->hw_id;
+		opt_hw_rev = first->hw_rev;
+		layout_id = first->layout->id;
+		kernel_la = user_kernel_la;
+		kernel_ep = user_kernel_ep;
+		rootfs_ofs = user_rootfs_ofs;
+		board = NULL;
+		if (check_options())
+			return ret;
 
-	writelen = sizeof(struct fw_header) + kernel_len;
+		w.nout = 0;
+		for (j = i; j < count && w.nout < FW_MAX_OUTPUTS; j++) {
+			e = &entries[j];
+			if (e->done || e->layout != first->layout)
+				continue;
+
+			o = &w.out[w.nout++];
+			if (e->board) {
+				o->hw_id = e->board->hw_id;
+				o->hw_rev = e->board->hw_rev;
+				ver = e->board->hdr_ver;
+			} else {
+				o->hw_id = strtoul(e->hw_id, NULL, 0);
+				o->hw_rev = e->hw_rev ?
+					    strtoul(e->hw_rev, NULL, 0) : 1;
+				ver = 0;
+			}
+			if (ver == 0)
+				ver = FW_HEADER_VER_DEFAULT;
+			o->desc = &header_descs[ver - 1];
+			o->file_name = batch_file_name(e->name);
+			if (o->file_name == NULL)
+				return ret;
+			e->done = 1;
+		}
 
-	if (!combined) {
-		if (rootfs_align)
-			p = buf + writelen;
-		else
-			p = buf + rootfs_ofs;
+		if (write_image(&w))
+			return ret;
+		for (j = 0; j < w.nout; j++)
+			free(w.out[j].file_name);
+	}
 
-		ret = read_to_buf(&rootfs_info, p);
-		if (ret)
-			goto out_free_buf;
+	return EXIT_SUCCESS;
+}
 
-		if (rootfs_align)
-			writelen += rootfs_info.file_size;
-		else
-			writelen = rootfs_ofs + rootfs_info.file_size;
+/*
+ * Restamping (-T): writes the -P data into an image built with -C and
+ * patches the image's digest, hashing from the last checkpoint at or
+ * before the data on.  The checkpoint file must be the image's as it is
+ * now, same length and digest, and is updated along with the image, so
+ * the same image can be restamped again.
+ */
+static int restamp_fw(void)
+{
+	static struct fw_writer w;
+	static struct fw_ckpt ckpt;
+	char hdr_buf[sizeof(struct fw_header)];
+	struct fw_header_desc *desc;
+	struct fw_header_common *hdr;
+	struct file_info patch_info;
+	uint8_t ckpt_md5sum[MD5SUM_LEN];
+	uint8_t md5sum[1][MD5SUM_LEN];
+	const void *p[1];
+	uint32_t image_len, ckpt_len, patch_ofs, end, pos, len;
+	struct stat st;
+	char *sep;
+	FILE *f;
+	int fd = -1;
+	int ret = EXIT_FAILURE;
 
-		if (add_jffs2_eof)
-			writelen = pad_jffs2(buf, writelen);
+	patch_ofs = patch_arg ? strtoul(patch_arg, &sep, 0) : 0;
+	if (ckpt_name == NULL || patch_arg == NULL ||
+	    sep == patch_arg || *sep != ':' || sep[1] == '\0') {
+		ERR("restamping needs -C <file> and -P <offset>:<file>");
+		return ret;
 	}
+	patch_info.file_name = sep + 1;
+	if (get_file_stat(&patch_info))
+		return ret;
 
-	if (!strip_padding)
-		writelen = buflen;
+	if (fw_ckpt_load(&ckpt, ckpt_name, &ckpt_len, ckpt_md5sum))
+		goto out;
 
-	fill_header(buf, writelen);
-	ret = write_fw(buf, writelen);
-	if (ret)
-		goto out_free_buf;
+	fd = open(restamp_name, O_RDWR);
+	if (fd < 0) {
+		ERRS("could not open \"%s\" for writing", restamp_name);
+		goto out;
+	}
+	if (fstat(fd, &st) ||
+	    pread(fd, hdr_buf, sizeof(hdr_buf), 0) != sizeof(hdr_buf)) {
+		ERRS("unable to read from file \"%s\"", restamp_name);
+		goto out;
+	}
+	image_len = st.st_size;
+
+	desc = find_header_desc(ntohl(*(uint32_t *)hdr_buf));
+	if (desc == NULL) {
+		ERR("file does not seem to have V1 or V2 header!");
+		goto out;
+	}
+	hdr = (struct fw_header_common *)(hdr_buf + desc->common_ofs);
+
+	if (image_len != ckpt_len ||
+	    memcmp(hdr->md5sum1, ckpt_md5sum, sizeof(ckpt_md5sum)) ||
+	    ckpt.e[0].ofs != sizeof(struct fw_header)) {
+		ERR("\"%s\" is not the checkpoint file of \"%s\"",
+		    ckpt_name, restamp_name);
+		goto out;
+	}
+
+	end = patch_ofs + patch_info.file_size;
+	if (patch_ofs < sizeof(struct fw_header) || patch_ofs > image_len) {
+		ERR("patch offset 0x%x is outside the image data", patch_ofs);
+		goto out;
+	}
+	if (end < patch_ofs || end > ntohl(hdr->fw_length)) {
+		ERR("patch runs past the end of the firmware");
+		goto out;
+	}
 
+	f = fopen(patch_info.file_name, "r");
+	if (f == NULL) {
+		ERRS("could not open \"%s\" for reading",
+		     patch_info.file_name);
+		goto out;
+	}
+	for (pos = patch_ofs; pos < end; pos += len) {
+		len = end - pos;
+		if (len > FW_BLOCK_LEN)
+			len = FW_BLOCK_LEN;
+		len = fread(fw_io_block, 1, len, f);
+		if (len == 0) {
+			ERRS("unable to read from file \"%s\"",
+			     patch_info.file_name);
+			fclose(f);
+			goto out;
+		}
+		if (pwrite(fd, fw_io_block, len, pos) != len) {
+			ERRS("unable to write output file \"%s\"",
+			     restamp_name);
+			fclose(f);
+			goto out;
+		}
+	}
+	fclose(f);
+	if (end > image_len)
+		image_len = end;
+
+	/* drop the checkpoints the data invalidates, resume from the last */
+	while (ckpt.count > 1 && ckpt.e[ckpt.count - 1].ofs > patch_ofs)
+		ckpt.count--;
+
+	w.nout = 1;
+	w.ckpt = &ckpt;
+	w.pos = ckpt.e[ckpt.count - 1].ofs;
+	w.ckpt_next = (w.pos / ckpt.interval + 1) * ckpt.interval;
+	md5mb_resume(&w.ctx, 1, w.pos, &ckpt.e[ckpt.count - 1].state);
+	DBG("resuming MD5 at offset 0x%x", w.pos);
+
+	while (w.pos < image_len) {
+		len = image_len - w.pos;
+		if (len > FW_BLOCK_LEN)
+			len = FW_BLOCK_LEN;
+		if (pread(fd, fw_io_block, len, w.pos) != len) {
+			ERRS("unable to read from file \"%s\"", restamp_name);
+			goto out;
+		}
+		p[0] = fw_io_block;
+		if (fw_hash(&w, p, len))
+			goto out;
+		w.pos += len;
+	}
+	md5mb_final(&w.ctx, md5sum);
+
+	if (pwrite(fd, md5sum[0], MD5SUM_LEN, desc->common_ofs +
+		   offsetof(struct fw_header_common, md5sum1)) != MD5SUM_LEN) {
+		ERRS("unable to write output file \"%s\"", restamp_name);
+		goto out;
+	}
+	if (fw_ckpt_save(&ckpt, ckpt_name, image_len, md5sum[0]))
+		goto out;
+
+	DBG("firmware file \"%s\" restamped", restamp_name);
 	ret = EXIT_SUCCESS;
 
- out_free_buf:
-	free(buf);
  out:
+	if (fd >= 0)
+		close(fd);
+	free(ckpt.e);
 	return ret;
 }
 
@@ -931,7 +1828,8 @@ static inline void inspect_fw_pmd5sum(char *label, uint8_t *val, char *text)
 static int inspect_fw(void)
 {
 	char *buf;
-	struct fw_header *hdr;
+	struct fw_header_desc *desc;
+	struct fw_header_common *hdr;
 	uint8_t md5sum[MD5SUM_LEN];
 	struct board_info *board;
 	int ret = EXIT_FAILURE;
@@ -945,26 +1843,28 @@ static int inspect_fw(void)
 	ret = read_to_buf(&inspect_info, buf);
 	if (ret)
 		goto out_free_buf;
-	hdr = (struct fw_header *)buf;
 
 	inspect_fw_pstr("File name", inspect_info.file_name);
 	inspect_fw_phexdec("File size", inspect_info.file_size);
 
-	if (ntohl(hdr->version) != HEADER_VERSION_V1) {
-		ERR("file does not seem to have V1 header!\n");
+	desc = find_header_desc(ntohl(*(uint32_t *)buf));
+	if (desc == NULL) {
+		ERR("file does not seem to have V1 or V2 header!\n");
 		goto out_free_buf;
 	}
+	hdr = (struct fw_header_common *)(buf + desc->common_ofs);
 
-	inspect_fw_phexdec("Version 1 Header size", sizeof(struct fw_header));
+	inspect_fw_phexdec(desc->ver == 1 ? "Version 1 Header size" :
+	                   "Version 2 Header size", sizeof(struct fw_header));
 
 	if (ntohl(hdr->unk1) != 0)
 		inspect_fw_phexdec("Unknown value 1", hdr->unk1);
 
 	memcpy(md5sum, hdr->md5sum1, sizeof(md5sum));
 	if (ntohl(hdr->boot_len) == 0)
-		memcpy(hdr->md5sum1, md5salt_normal, sizeof(md5sum));
+		memcpy(hdr->md5sum1, desc->md5salt_normal, sizeof(md5sum));
 	else
-		memcpy(hdr->md5sum1, md5salt_boot, sizeof(md5sum));
+		memcpy(hdr->md5sum1, desc->md5salt_boot, sizeof(md5sum));
 	get_md5(buf, inspect_info.file_size, hdr->md5sum1);
 
 	if (memcmp(md5sum, hdr->md5sum1, sizeof(md5sum))) {
@@ -977,13 +1877,29 @@ static int inspect_fw(void)
 		inspect_fw_phexdec("Unknown value 2", hdr->unk2);
 	inspect_fw_pmd5sum("Header MD5Sum2", hdr->md5sum2,
 	                   "(purpose yet unknown, unchecked here)");
-	if (ntohl(hdr->unk3) != 0)
+	if (ntohl(hdr->unk3) != desc->unk3)
 		inspect_fw_phexdec("Unknown value 3", hdr->unk3);
 
-	printf("\n");
+	if (desc->ver == 1) {
+		struct fw_header *hdr1 = (struct fw_header *)buf;
 
-	inspect_fw_pstr("Vendor name", hdr->vendor_name);
-	inspect_fw_pstr("Firmware version", hdr->fw_version);
+		printf("\n");
+
+		inspect_fw_pstr("Vendor name", hdr1->vendor_name);
+		inspect_fw_pstr("Firmware version", hdr1->fw_version);
+	} else {
+		struct fw_header_v2 *hdr2 = (struct fw_header_v2 *)buf;
+
+		if (ntohs(hdr2->unk4) != 0x55aa)
+			inspect_fw_phexdec("Unknown value 4", hdr2->unk4);
+
+		if (hdr2->unk5 != 0xa5)
+			inspect_fw_phexdec("Unknown value 5", hdr2->unk5);
+
+		printf("\n");
+
+		inspect_fw_pstr("Firmware version", hdr2->fw_version);
+	}
 	board = find_board_by_hwid(ntohl(hdr->hw_id));
 	if (board) {
 		layout = find_layout(board->layout_id);
@@ -998,6 +1914,14 @@ static int inspect_fw(void)
 		                ntohl(hdr->hw_rev));
 	}
 
+	if (desc->ver == 2) {
+		struct fw_header_v2 *hdr2 = (struct fw_header_v2 *)buf;
+
+		printf("%-23s: %d.%d.%d-%d.%d\n", "Software version",
+		       hdr2->ver_hi, hdr2->ver_mid, hdr2->ver_lo,
+		       hdr2->sver_hi, hdr2->sver_lo);
+	}
+
 	printf("\n");
 
 	inspect_fw_phexdec("Kernel data offset",
@@ -1086,7 +2010,7 @@ int main(int argc, char *argv[])
 	while ( 1 ) {
 		int c;
 
-		c = getopt(argc, argv, "a:B:H:E:F:L:V:N:W:ci:k:r:R:o:xX:hsjv:");
+		c = getopt(argc, argv, "a:b:B:C:H:E:F:L:V:N:W:ci:k:r:R:o:P:T:xX:hsjv:y:1:2:");
 		if (c == -1)
 			break;
 
@@ -1094,9 +2018,15 @@ int main(int argc, char *argv[])
 		case 'a':
 			sscanf(optarg, "0x%x", &rootfs_align);
 			break;
+		case 'b':
+			batch_list = optarg;
+			break;
 		case 'B':
 			board_id = optarg;
 			break;
+		case 'C':
+			ckpt_name = optarg;
+			break;
 		case 'H':
 			opt_hw_id = optarg;
 			break;
@@ -1136,6 +2066,21 @@ int main(int argc, char *argv[])
 		case 'o':
 			ofname = optarg;
 			break;
+		case 'P':
+			patch_arg = optarg;
+			break;
+		case 'T':
+			restamp_name = optarg;
+			break;
+		case '1':
+			ofname_ver[1] = optarg;
+			break;
+		case '2':
+			ofname_ver[2] = optarg;
+			break;
+		case 'y':
+			sver = optarg;
+			break;
 		case 's':
 			strip_padding = 1;
 			break;
@@ -1160,6 +2105,16 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (restamp_name) {
+		ret = restamp_fw();
+		goto out;
+	}
+
+	if (batch_list && !inspect_info.file_name) {
+		ret = build_batch();
+		goto out;
+	}
+
 	ret = check_options();
 	if (ret)
 		goto out;
@@ -0,0 +1,51 @@
+/*
+ * bcj.c
+ *
+ * Branch converter for little endian MIPS kernels marked TRX_FLAG_BCJ, in
+ * the manner of xz's BCJ filters: calls to the same function should look
+ * the same wherever they are made, so the compressor finds them as
+ * matches.  jal already encodes its target (the word index in the 256 MB
+ * region), so it is left alone; the PC-relative calls, bal and the other
+ * REGIMM branch-and-link forms, are what differ from site to site.  Their
+ * 16-bit offset is turned into the low 16 bits of the target's word
+ * index, counted from the start of the image, and back.  Any word is
+ * converted, code or not; both directions are exact inverses, so data
+ * that happens to look like a call comes back unchanged too.
+ */
+
+#include "trxloader.h"
+
+#define BCJ_CALL_MASK		0xfc1c0000 // opcode, and rt without its low 2 bits
+#define BCJ_CALL		0x04100000 // REGIMM bltzal, bgezal (bal), bltzall, bgezall
+
+static inline uint32_t bcj_le32(uint32_t w){
+#if BYTE_ORDER == BIG_ENDIAN
+	return __builtin_bswap32(w);
+#else
+	return w;
+#endif
+}
+
+// Adds (encode) or subtracts the word index + 1 to the offset of every call; buf is word aligned.
+static size_t mips_bcj(void* buf, size_t len, int encode){
+	uint32_t* p = buf;
+	size_t i, n = 0;
+
+	for(i = 0; i < len / 4; i++){
+		uint32_t w = bcj_le32(p[i]);
+		if((w & BCJ_CALL_MASK) != BCJ_CALL)
+			continue;
+		w = (w & 0xffff0000) | ((encode ? w + (i + 1) : w - (i + 1)) & 0xffff);
+		p[i] = bcj_le32(w);
+		n++;
+	}
+	return n;
+}
+
+size_t mips_bcj_encode(void* buf, size_t len){
+	return mips_bcj(buf, len, 1);
+}
+
+size_t mips_bcj_decode(void* buf, size_t len){
+	return mips_bcj(buf, len, 0);
+}
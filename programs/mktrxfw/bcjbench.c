@@ -0,0 +1,238 @@
+/*
+ * bcjbench.c
+ *
+ * What the MIPS BCJ filter (bcj.c) buys on a kernel image: each little
+ * endian kernel binary given on the command line is compressed with zlib
+ * at gzip -9 settings as is and after mips_bcj_encode(), and the sizes are
+ * compared; every byte saved is a byte less the loader reads from flash
+ * through KSEG1.  The cost is timed on the host as the loader pays it: the
+ * filtered stream is inflated by tinfl.c and converted back in place, and
+ * the result must be the original image.
+ *
+ * With -t the filter is first checked to be its own inverse on random data
+ * salted with call instructions.
+ *
+ * usage: bcjbench [-n rounds] [-t] [kernel.bin ...]
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "trxloader.h"
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec + tv.tv_usec / 1e6);
+}
+
+static uint8_t *
+read_file(const char *name, size_t *len)
+{
+	uint8_t *buf;
+	FILE *f;
+	long n;
+
+	if ((f = fopen(name, "rb")) == NULL || fseek(f, 0, SEEK_END) != 0 ||
+	    (n = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) != 0 ||
+	    (buf = malloc(n + 4)) == NULL ||
+	    fread(buf, 1, n, f) != (size_t)n) {
+		perror(name);
+		return (NULL);
+	}
+	fclose(f);
+	*len = n;
+	return (buf);
+}
+
+/* gzip -9n of in, into a buffer of *outlen bytes. */
+static int
+gzip9(uint8_t *out, size_t *outlen, const uint8_t *in, size_t len)
+{
+	z_stream zs;
+	int ret;
+
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8,
+	    Z_DEFAULT_STRATEGY) != Z_OK)
+		return (-1);
+	zs.next_in = (uint8_t *)in;
+	zs.avail_in = len;
+	zs.next_out = out;
+	zs.avail_out = *outlen;
+	ret = deflate(&zs, Z_FINISH);
+	*outlen = zs.total_out;
+	deflateEnd(&zs);
+	return (ret == Z_STREAM_END ? 0 : -1);
+}
+
+/* Best time of rounds unpacks, with the calls converted back if bcj is set. */
+static double
+time_unpack(uint8_t *out, size_t outlen, const uint8_t *gz, size_t gzlen,
+    int bcj, int rounds)
+{
+	double t, best = 1e9;
+	size_t n;
+	int r;
+
+	for (r = 0; r < rounds; r++) {
+		t = now();
+		n = tinfl_decompress_mem_to_mem(out, outlen, gz, gzlen,
+		    TINFL_FLAG_PARSE_GZIP_HEADER);
+		if (n != outlen)
+			return (-1);
+		if (bcj)
+			mips_bcj_decode(out, n);
+		if ((t = now() - t) < best)
+			best = t;
+	}
+	return (best);
+}
+
+static int
+bench_file(const char *name, int rounds)
+{
+	uint8_t *img, *filt, *gz, *gzf, *out;
+	size_t len, gzlen, gzflen, calls;
+	double t, tf, tb;
+	int r, ret = -1;
+
+	if ((img = read_file(name, &len)) == NULL)
+		return (-1);
+	gzlen = gzflen = len + len / 1000 + 1024;
+	filt = malloc(len + 4);
+	gz = malloc(gzlen);
+	gzf = malloc(gzflen);
+	out = malloc(len + 4);
+	if (filt == NULL || gz == NULL || gzf == NULL || out == NULL) {
+		perror("malloc");
+		goto done;
+	}
+	memcpy(filt, img, len);
+	calls = mips_bcj_encode(filt, len);
+	if (gzip9(gz, &gzlen, img, len) != 0 ||
+	    gzip9(gzf, &gzflen, filt, len) != 0) {
+		printf("%s: deflate failed\n", name);
+		goto done;
+	}
+	printf("%s: %zu bytes, %zu calls converted\n", name, len, calls);
+	printf("  gzip -9    %9zu bytes\n", gzlen);
+	printf("  bcj+gzip   %9zu bytes, %+zd (%+.2f%%)\n", gzflen,
+	    (ssize_t)(gzflen - gzlen), 100.0 * ((double)gzflen - gzlen) / gzlen);
+
+	t = time_unpack(out, len, gz, gzlen, 0, rounds);
+	tf = time_unpack(out, len, gzf, gzflen, 1, rounds);
+	if (t < 0 || tf < 0 || memcmp(out, img, len) != 0) {
+		printf("  FAILED, the filtered kernel does not unpack to the "
+		    "original\n");
+		goto done;
+	}
+	tb = 1e9;
+	for (r = 0; r < rounds; r++) {
+		double t0 = now();
+
+		mips_bcj_decode(filt, len);
+		if ((t0 = now() - t0) < tb)
+			tb = t0;
+		mips_bcj_encode(filt, len);
+	}
+	printf("  inflate    %9.1f MB/s\n", len / t / 1e6);
+	printf("  +bcj       %9.1f MB/s, filter %.1f MB/s (%.1f%% of the "
+	    "unpack)\n", len / tf / 1e6, len / tb / 1e6, 100.0 * tb / tf);
+	ret = 0;
+done:
+	free(img);
+	free(filt);
+	free(gz);
+	free(gzf);
+	free(out);
+	return (ret);
+}
+
+static int
+selftest(void)
+{
+	static const uint32_t calls[] = { 0x04110000, 0x04100000, 0x04120000,
+	    0x04130000, 0x0411ffff };
+	size_t len = 1 << 20, i, n = 0;
+	uint32_t *ref, *buf;
+	int fails = 0;
+
+	ref = malloc(len);
+	buf = malloc(len);
+	if (ref == NULL || buf == NULL) {
+		perror("malloc");
+		return (-1);
+	}
+	srandom(1);
+	for (i = 0; i < len / 4; i++) {
+		ref[i] = random() ^ (uint32_t)random() << 16;
+		if (i % 7 == 0) {
+			ref[i] = calls[i % 5] | (random() & 0xffff) |
+			    (random() & 0x1f) << 21;
+			n++;
+		}
+	}
+	/* and a word that only looks like one: opcode 1 with rt 0x01 */
+	ref[1] = 0x04010000 | 42;
+	memcpy(buf, ref, len);
+	for (i = 0; i < 3; i++) {
+		if (mips_bcj_encode(buf, len - i) < n - 1 ||
+		    buf[1] != ref[1]) {
+			printf("selftest: calls not converted (length %zu)\n",
+			    len - i);
+			fails++;
+		}
+		mips_bcj_decode(buf, len - i);
+		if (memcmp(buf, ref, len) != 0) {
+			printf("selftest: not converted back (length %zu)\n",
+			    len - i);
+			fails++;
+		}
+	}
+	printf("selftest: %zu calls, %d failures\n", n, fails);
+	free(ref);
+	free(buf);
+	return (fails ? -1 : 0);
+}
+
+int
+main(int argc, char **argv)
+{
+	int ch, rounds = 5, test = 0, ret = 0;
+
+	while ((ch = getopt(argc, argv, "n:t")) != -1) {
+		switch (ch) {
+		case 'n':
+			rounds = atoi(optarg);
+			break;
+		case 't':
+			test = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: bcjbench [-n rounds] [-t] "
+			    "[kernel.bin ...]\n");
+			return (1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (rounds < 1)
+		rounds = 1;
+
+	if (test && selftest() != 0)
+		ret = 1;
+	for (; argc > 0; argc--, argv++)
+		if (bench_file(argv[0], rounds) != 0)
+			ret = 1;
+	return (ret);
+}
@@ -0,0 +1,180 @@
+/*
+ * bootcheck.c
+ *
+ * Runs trx_find(), the loader's search for its TRX, against an image
+ * made with mktrxfw -f, in a flash built in memory.  The boot descriptor
+ * is taken from the inflated loader, as CFE leaves it in RAM.  With the
+ * image where the descriptor says, the fast path has to take it; moved to
+ * the next scan slot, with the descriptor unpatched or pointing at another
+ * kernel, the flash scan has to find it instead.  Each time the kernel is
+ * unpacked from flash with the length trx_find() returned and checked
+ * against the descriptor's CRC.
+ *
+ * usage: bootcheck image.trx
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "extern.h"
+#include "trxloader.h"
+
+#define	LOADER_MAX	(1 << 20)
+#define	KERNEL_MAX	(LOADER_RUNADDR - 0x80000000U)
+
+static uint8_t *flash, *kbuf;
+
+static int
+unpack(const struct trx_header *h, size_t klen, uint32_t *crc)
+{
+	const uint8_t *k = (const uint8_t *)h + h->offsets[1];
+	struct crc32_ctx ctx;
+	size_t n;
+
+	if (h->flags & TRX_FLAG_LZ4)
+		n = lz4_decompress_frame(kbuf, KERNEL_MAX, k, klen);
+	else
+		n = tinfl_decompress_mem_to_mem(kbuf, KERNEL_MAX, k, klen,
+		    TINFL_FLAG_PARSE_GZIP_HEADER);
+	if (n == TINFL_DECOMPRESS_MEM_TO_MEM_FAILED)
+		return (-1);
+	crc32_init(&ctx);
+	crc32_ctx_update(&ctx, kbuf, n);
+	*crc = crc32_final(&ctx);
+	return (0);
+}
+
+/*
+ * Puts the image at off in an otherwise erased flash and checks that
+ * trx_find() takes it by the fast path if fast is set, else by the scan.
+ */
+static int
+check(const char *what, const uint8_t *img, size_t len, size_t off,
+    const struct trx_boot_desc *bd, int fast)
+{
+	const struct trx_header *h;
+	size_t klen = 0;
+	uint32_t crc;
+	int by_desc;
+
+	memset(flash, 0xff, FLASHSIZE);
+	memcpy(flash + off, img, len);
+	by_desc = trx_boot_desc_check(bd, (uintptr_t)flash, FLASHSIZE) != NULL;
+	h = trx_find(bd, (uintptr_t)flash, FLASHSIZE, &klen);
+	printf("%-28s TRX at 0x%07zx: ", what, off);
+	if (h != (const struct trx_header *)(flash + off)) {
+		printf("FAILED, %s\n", h == NULL ? "not found" :
+		    "found elsewhere");
+		return (-1);
+	}
+	if (by_desc != fast) {
+		printf("FAILED, %s\n", fast ? "descriptor rejected" :
+		    "stale descriptor accepted");
+		return (-1);
+	}
+	if (unpack(h, klen, &crc) < 0 || crc != bd->kernel_crc) {
+		printf("FAILED, kernel does not unpack from %zu bytes\n", klen);
+		return (-1);
+	}
+	printf("%s, kernel %zu bytes, crc32 ok\n", fast ? "descriptor" :
+	    "scan", klen);
+	return (0);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct trx_boot_desc bd, stale;
+	struct trx_header h;
+	uint8_t *img, *ldr;
+	size_t len, n, i, slot;
+	int errors = 0;
+	FILE *f;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: bootcheck image.trx\n");
+		return (1);
+	}
+	if ((f = fopen(argv[1], "rb")) == NULL ||
+	    (img = malloc(FLASHSIZE)) == NULL ||
+	    (len = fread(img, 1, FLASHSIZE, f)) < sizeof(h)) {
+		perror(argv[1]);
+		return (1);
+	}
+	fclose(f);
+	memcpy(&h, img, sizeof(h));
+	if (h.magic != MAGIC || h.offsets[1] <= h.offsets[0] ||
+	    h.offsets[2] <= h.offsets[1] || h.file_length > len) {
+		fprintf(stderr, "%s: not a TRX image\n", argv[1]);
+		return (1);
+	}
+	len = h.file_length;
+	if ((flash = malloc(FLASHSIZE)) == NULL ||
+	    (kbuf = malloc(KERNEL_MAX)) == NULL ||
+	    (ldr = malloc(LOADER_MAX)) == NULL) {
+		perror("malloc");
+		return (1);
+	}
+
+	/* what _startC() finds in its .data */
+	n = tinfl_decompress_mem_to_mem(ldr, LOADER_MAX, img + h.offsets[0],
+	    h.offsets[1] - h.offsets[0], TINFL_FLAG_PARSE_GZIP_HEADER);
+	if (n == TINFL_DECOMPRESS_MEM_TO_MEM_FAILED) {
+		fprintf(stderr, "%s: loader does not inflate\n", argv[1]);
+		return (1);
+	}
+	for (i = 0; i + sizeof(bd) <= n; i += 4) {
+		memcpy(&bd, ldr + i, sizeof(bd));
+		if (bd.magic == BOOTDESC_MAGIC)
+			break;
+	}
+	if (i + sizeof(bd) > n || bd.kernel_len == 0) {
+		fprintf(stderr, "%s: no boot descriptor, patch it with "
+		    "mktrxfw -c -f\n", argv[1]);
+		return (1);
+	}
+	if (bd.trx_off + len > FLASHSIZE) {
+		fprintf(stderr, "%s: does not fit at 0x%x\n", argv[1],
+		    bd.trx_off);
+		return (1);
+	}
+	printf("boot descriptor: TRX at flash offset 0x%x, kernel 0x%x+%u, "
+	    "crc32 0x%08x\n", bd.trx_off, bd.kernel_off, bd.kernel_len,
+	    bd.kernel_crc);
+
+	errors += check("patched", img, len, bd.trx_off, &bd, 1) < 0;
+
+	/* the scan slot at or below the patched offset, and the next one */
+	slot = bd.trx_off / TRX_SCAN_STEP * TRX_SCAN_STEP;
+	if (slot + TRX_SCAN_STEP + len <= FLASHSIZE &&
+	    slot + TRX_SCAN_STEP < (size_t)TRX_SCAN_STEP * TRX_SCAN_COUNT)
+		errors += check("moved", img, len, slot + TRX_SCAN_STEP, &bd,
+		    0) < 0;
+
+	/* descriptors that no longer match the TRX they point at */
+	stale = bd;
+	stale.trx_off = stale.kernel_off = stale.kernel_len = 0;
+	errors += check("unpatched", img, len, slot, &stale, 0) < 0;
+	stale = bd;
+	stale.trx_off = slot;
+	stale.kernel_off += 4;
+	errors += check("other kernel offset", img, len, slot, &stale, 0) < 0;
+	if (!(h.flags & TRX_FLAG_LZ4)) {
+		/* a gzip kernel is known by its trailer CRC */
+		stale.kernel_off = bd.kernel_off;
+		img[bd.kernel_off + bd.kernel_len - 8] ^= 0xff;
+		errors += check("other gzip trailer", img, len, slot, &stale,
+		    0) < 0;
+		img[bd.kernel_off + bd.kernel_len - 8] ^= 0xff;
+	}
+
+	free(img);
+	free(ldr);
+	free(kbuf);
+	free(flash);
+	printf("%s: %s\n", argv[1], errors ? "FAILED" : "OK");
+	return (errors != 0);
+}
@@ -0,0 +1,169 @@
+/*
+ * bootstamp.c
+ *
+ * Prints the loader's boot stage timestamps (struct trx_boot_stamps) from
+ * a dump of physical RAM, as time spent in each stage.  The dump may start
+ * anywhere below the ring: -a gives the physical address of its first
+ * byte.  Either byte order is accepted, so dumps of big and little endian
+ * targets (qemu-system-mips and -mipsel malta) both decode.  CP0 Count
+ * ticks at half the CPU clock on most cores; -m gives its rate in MHz,
+ * 100 being qemu's.
+ *
+ * With the loader stopped, or before the kernel reuses the memory, the
+ * qemu monitor writes such a dump with
+ *	pmemsave <BOOTSTAMP_ADDR & 0x1fffffff> <size> file
+ *
+ * usage: bootstamp [-a dumpaddr] [-m count_mhz] dump
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trxloader.h"
+
+#define	KSEG_MASK	0x1fffffffU
+
+static const char *stages[] = {
+	[BOOTSTAMP_START] = "start",
+	[BOOTSTAMP_FOUND] = "trx_find",
+	[BOOTSTAMP_HEADERS] = "headers",
+	[BOOTSTAMP_UNPACKED] = "unpack",
+	[BOOTSTAMP_JUMP] = "icache sync",
+	[BOOTSTAMP_FAIL] = "FAILED",
+};
+
+static int swap;
+
+static uint32_t
+get32(uint32_t v)
+{
+	if (swap)
+		v = (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) |
+		    (v << 24);
+	return (v);
+}
+
+static const char *
+stage_name(uint32_t stage)
+{
+	if (stage < sizeof(stages) / sizeof(stages[0]) && stages[stage] != NULL)
+		return (stages[stage]);
+	return ("?");
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: bootstamp [-a dumpaddr] [-m count_mhz] dump\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct trx_boot_stamps bs;
+	uint32_t head, n, i, tag, boot, stage, count, prev, start;
+	double mhz = 100;
+	unsigned long base = 0;
+	uint16_t one = 1;
+	int ch, inboot, first, big;
+	FILE *f;
+
+	while ((ch = getopt(argc, argv, "a:m:")) != -1) {
+		switch (ch) {
+		case 'a':
+			base = strtoul(optarg, NULL, 0) & KSEG_MASK;
+			break;
+		case 'm':
+			if ((mhz = strtod(optarg, NULL)) <= 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		usage();
+
+	if (base > (BOOTSTAMP_ADDR & KSEG_MASK)) {
+		fprintf(stderr, "%s: dump starts above the ring at 0x%08x\n",
+		    argv[0], BOOTSTAMP_ADDR & KSEG_MASK);
+		return (1);
+	}
+	if ((f = fopen(argv[0], "rb")) == NULL ||
+	    fseek(f, (BOOTSTAMP_ADDR & KSEG_MASK) - base, SEEK_SET) != 0) {
+		perror(argv[0]);
+		return (1);
+	}
+	if (fread(&bs, 1, sizeof(bs), f) != sizeof(bs)) {
+		fprintf(stderr, "%s: dump ends before the ring\n", argv[0]);
+		return (1);
+	}
+	fclose(f);
+
+	if (bs.magic != BOOTSTAMP_MAGIC) {
+		swap = 1;
+		if (get32(bs.magic) != BOOTSTAMP_MAGIC) {
+			fprintf(stderr, "%s: no boot stamps at 0x%08x\n",
+			    argv[0], BOOTSTAMP_ADDR & KSEG_MASK);
+			return (1);
+		}
+		bs.version = (bs.version >> 8) | (bs.version << 8);
+		bs.slots = (bs.slots >> 8) | (bs.slots << 8);
+	}
+	if (bs.version != BOOTSTAMP_VERSION || bs.slots != BOOTSTAMP_SLOTS) {
+		fprintf(stderr, "%s: boot stamps version %u with %u slots, "
+		    "expected %u with %u\n", argv[0], bs.version, bs.slots,
+		    BOOTSTAMP_VERSION, BOOTSTAMP_SLOTS);
+		return (1);
+	}
+	big = swap ^ (*(uint8_t *)&one == 0);
+	head = get32(bs.head);
+	n = head < BOOTSTAMP_SLOTS ? head : BOOTSTAMP_SLOTS;
+	printf("boot stamps v%u (%s endian): %u boots, last %u of %u records, "
+	    "Count at %g MHz\n", bs.version, big ? "big" : "little",
+	    get32(bs.boots), n, head, mhz);
+
+	/*
+	 * Oldest record first.  Each stage is charged the Count ticks since
+	 * the previous record of its boot; the oldest boot may have lost its
+	 * first records to the ring wrapping.
+	 */
+	boot = prev = start = 0;
+	inboot = 0;
+	for (i = head - n; i != head; i++) {
+		tag = get32(bs.ring[i % BOOTSTAMP_SLOTS].tag);
+		count = get32(bs.ring[i % BOOTSTAMP_SLOTS].count);
+		stage = BOOTSTAMP_TAG_STAGE(tag);
+		if (!inboot || BOOTSTAMP_TAG_BOOT(tag) != boot) {
+			if (inboot)
+				printf("  %-12s %12.1f us\n", "total",
+				    (uint32_t)(prev - start) / mhz);
+			boot = BOOTSTAMP_TAG_BOOT(tag);
+			printf("boot %u:\n", boot);
+			if (stage != BOOTSTAMP_START)
+				printf("  (earlier stages overwritten)\n");
+			prev = start = count;
+			inboot = first = 1;
+		}
+		/* nothing to charge the first record it has to */
+		if (first)
+			printf("  %-12s   Count 0x%08x\n", stage_name(stage),
+			    count);
+		else
+			printf("  %-12s %12.1f us\n", stage_name(stage),
+			    (uint32_t)(count - prev) / mhz);
+		prev = count;
+		first = 0;
+	}
+	if (inboot)
+		printf("  %-12s %12.1f us\n", "total",
+		    (uint32_t)(prev - start) / mhz);
+	return (0);
+}
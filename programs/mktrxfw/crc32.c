@@ -18,8 +18,21 @@ __FBSDID("$FreeBSD: stable/10/usr.bin/cksum/crc32.c 200462 2009-12-13 03:14:06Z
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__)
+#include <arm_acle.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#endif
+#endif
+
 #include "extern.h"
 
 #define CRC(crc, ch)	 (crc = (crc >> 8) ^ crctab[(crc ^ (ch)) & 0xff])
@@ -95,28 +108,468 @@ static const uint32_t crctab[256] = {
 	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d,
 };
 
-uint32_t crc32_total = 0;
+/*
+ * Slicing-by-8/16 tables: crc_slice[k][i] is the CRC contribution of byte
+ * i followed by k zero bytes.  crc_slice[0] is crctab itself.
+ */
+static uint32_t crc_slice[16][256];
+static int crc_slice_ready;
+
+static void
+crc32_slice_init(void)
+{
+	int i, k;
+
+	if (crc_slice_ready)
+		return;
+	for (i = 0; i < 256; i++)
+		crc_slice[0][i] = crctab[i];
+	for (k = 1; k < 16; k++)
+		for (i = 0; i < 256; i++)
+			crc_slice[k][i] = (crc_slice[k - 1][i] >> 8) ^
+			    crctab[crc_slice[k - 1][i] & 0xff];
+	crc_slice_ready = 1;
+}
+
+static inline uint32_t
+le32dec_p(const uint8_t *p)
+{
+	return ((uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+	    ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+}
+
+static uint32_t
+crc32_update_byte(uint32_t crc, const uint8_t *p, size_t len)
+{
+	while (len--)
+		CRC(crc, *p++);
+	return (crc);
+}
+
+static uint32_t
+crc32_update_slice8(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint32_t w0, w1;
+
+	while (len >= 8) {
+		w0 = le32dec_p(p) ^ crc;
+		w1 = le32dec_p(p + 4);
+		crc = crc_slice[7][w0 & 0xff] ^
+		    crc_slice[6][(w0 >> 8) & 0xff] ^
+		    crc_slice[5][(w0 >> 16) & 0xff] ^
+		    crc_slice[4][w0 >> 24] ^
+		    crc_slice[3][w1 & 0xff] ^
+		    crc_slice[2][(w1 >> 8) & 0xff] ^
+		    crc_slice[1][(w1 >> 16) & 0xff] ^
+		    crc_slice[0][w1 >> 24];
+		p += 8;
+		len -= 8;
+	}
+	return (crc32_update_byte(crc, p, len));
+}
+
+static uint32_t
+crc32_update_slice16(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint32_t w0, w1, w2, w3;
+
+	while (len >= 16) {
+		w0 = le32dec_p(p) ^ crc;
+		w1 = le32dec_p(p + 4);
+		w2 = le32dec_p(p + 8);
+		w3 = le32dec_p(p + 12);
+		crc = crc_slice[15][w0 & 0xff] ^
+		    crc_slice[14][(w0 >> 8) & 0xff] ^
+		    crc_slice[13][(w0 >> 16) & 0xff] ^
+		    crc_slice[12][w0 >> 24] ^
+		    crc_slice[11][w1 & 0xff] ^
+		    crc_slice[10][(w1 >> 8) & 0xff] ^
+		    crc_slice[9][(w1 >> 16) & 0xff] ^
+		    crc_slice[8][w1 >> 24] ^
+		    crc_slice[7][w2 & 0xff] ^
+		    crc_slice[6][(w2 >> 8) & 0xff] ^
+		    crc_slice[5][(w2 >> 16) & 0xff] ^
+		    crc_slice[4][w2 >> 24] ^
+		    crc_slice[3][w3 & 0xff] ^
+		    crc_slice[2][(w3 >> 8) & 0xff] ^
+		    crc_slice[1][(w3 >> 16) & 0xff] ^
+		    crc_slice[0][w3 >> 24];
+		p += 16;
+		len -= 16;
+	}
+	return (crc32_update_slice8(crc, p, len));
+}
+
+#if defined(__x86_64__)
+/*
+ * Carry-less multiply folding, after "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ Instruction" (Intel, 2009).  Constants are
+ * the bit-reflected x^n mod P(x) values for the AUTODIN II polynomial.
+ */
+static int
+crc32_probe_pclmul(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return (0);
+	return ((ecx & bit_PCLMUL) != 0);
+}
+
+__attribute__((target("pclmul,sse2")))
+static uint32_t
+crc32_fold_pclmul(uint32_t crc, const uint8_t *p, size_t len)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+	const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+	const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+	const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+	const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+	__m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+	/* len >= 64 and a multiple of 16 */
+	x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+	p += 64;
+	len -= 64;
+
+	/* Fold four lanes of 128 bits in parallel. */
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+		    _mm_loadu_si128((const __m128i *)(p + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+		    _mm_loadu_si128((const __m128i *)(p + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+		    _mm_loadu_si128((const __m128i *)(p + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+		    _mm_loadu_si128((const __m128i *)(p + 0x30)));
+		p += 64;
+		len -= 64;
+	}
+
+	/* Fold the four lanes into one. */
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	while (len >= 16) {
+		x2 = _mm_loadu_si128((const __m128i *)p);
+		x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+		p += 16;
+		len -= 16;
+	}
+
+	/* 128 -> 64 bits. */
+	x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask32);
+	x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits. */
+	x2 = _mm_and_si128(x1, mask32);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+	x2 = _mm_and_si128(x2, mask32);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return ((uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4)));
+}
+
+static uint32_t
+crc32_update_pclmul(uint32_t crc, const uint8_t *p, size_t len)
+{
+	size_t n;
+
+	if (len >= 64) {
+		n = len & ~(size_t)15;
+		crc = crc32_fold_pclmul(crc, p, n);
+		p += n;
+		len -= n;
+	}
+	return (crc32_update_slice16(crc, p, len));
+}
+#endif /* __x86_64__ */
+
+#if defined(__aarch64__)
+/* ARMv8 CRC32 instructions implement the same (reflected) polynomial. */
+static int
+crc32_probe_armv8(void)
+{
+#if defined(__linux__) && defined(HWCAP_CRC32)
+	return ((getauxval(AT_HWCAP) & HWCAP_CRC32) != 0);
+#elif defined(__FreeBSD__) && defined(HWCAP_CRC32)
+	unsigned long hwcap = 0;
+
+	if (elf_aux_info(AT_HWCAP, &hwcap, sizeof(hwcap)) != 0)
+		return (0);
+	return ((hwcap & HWCAP_CRC32) != 0);
+#else
+	return (0);
+#endif
+}
+
+__attribute__((target("+crc")))
+static uint32_t
+crc32_update_armv8(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t d;
+
+	while (len > 0 && ((uintptr_t)p & 7) != 0) {
+		crc = __crc32b(crc, *p++);
+		len--;
+	}
+	/* Four independent-looking loads per iteration keep the unit busy. */
+	while (len >= 32) {
+		memcpy(&d, p, 8);
+		crc = __crc32d(crc, d);
+		memcpy(&d, p + 8, 8);
+		crc = __crc32d(crc, d);
+		memcpy(&d, p + 16, 8);
+		crc = __crc32d(crc, d);
+		memcpy(&d, p + 24, 8);
+		crc = __crc32d(crc, d);
+		p += 32;
+		len -= 32;
+	}
+	while (len >= 8) {
+		memcpy(&d, p, 8);
+		crc = __crc32d(crc, d);
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = __crc32b(crc, *p++);
+	return (crc);
+}
+#endif /* __aarch64__ */
+
+struct crc32_impl {
+	const char	*name;
+	uint32_t	(*update)(uint32_t, const uint8_t *, size_t);
+	int		(*probe)(void);
+};
+
+/* Ordered from slowest to fastest; the last usable entry wins. */
+static const struct crc32_impl crc32_impls[] = {
+	{ "byte",	crc32_update_byte,	NULL },
+	{ "slice8",	crc32_update_slice8,	NULL },
+	{ "slice16",	crc32_update_slice16,	NULL },
+#if defined(__x86_64__)
+	{ "pclmul",	crc32_update_pclmul,	crc32_probe_pclmul },
+#endif
+#if defined(__aarch64__)
+	{ "armv8",	crc32_update_armv8,	crc32_probe_armv8 },
+#endif
+	{ NULL,		NULL,			NULL }
+};
+
+static const struct crc32_impl *crc32_cur;
 
+const char *
+crc32_impl_name(int idx)
+{
+	if (idx < 0) {
+		if (crc32_cur == NULL)
+			crc32_select(CRC32_IMPL_AUTO);
+		return (crc32_cur->name);
+	}
+	if ((size_t)idx >= sizeof(crc32_impls) / sizeof(crc32_impls[0]))
+		return (NULL);
+	return (crc32_impls[idx].name);
+}
+
+/*
+ * Select the CRC implementation by index, or the fastest one supported by
+ * this CPU for CRC32_IMPL_AUTO.  The CRC32_IMPL environment variable may
+ * name an implementation to override the automatic choice.
+ */
 int
-crc32(int fd, uint32_t *cval, off_t *clen)
+crc32_select(int idx)
+{
+	const struct crc32_impl *im;
+	const char *env;
+
+	crc32_slice_init();
+	if (idx == CRC32_IMPL_AUTO) {
+		if ((env = getenv("CRC32_IMPL")) != NULL)
+			for (im = crc32_impls; im->name != NULL; im++)
+				if (strcmp(im->name, env) == 0 &&
+				    (im->probe == NULL || im->probe())) {
+					crc32_cur = im;
+					return (0);
+				}
+		for (im = crc32_impls; im->name != NULL; im++)
+			if (im->probe == NULL || im->probe())
+				crc32_cur = im;
+		return (0);
+	}
+	if (idx < 0 || crc32_impl_name(idx) == NULL)
+		return (-1);
+	im = &crc32_impls[idx];
+	if (im->probe != NULL && !im->probe())
+		return (-1);
+	crc32_cur = im;
+	return (0);
+}
+
+/*
+ * Feed len bytes into the running (uncomplemented) CRC register.  Callers
+ * preset it to ~0 and complement the result, as with the CRC() macro.
+ */
+uint32_t
+crc32_update(uint32_t crc, const void *buf, size_t len)
 {
-    uint32_t lcrc = ~0;
-    int nr ;
-    off_t len ;
-    char buf[BUFSIZ], *p ;
-	
-    len = 0 ;
-    crc32_total = ~crc32_total ;
-    while ((nr = read(fd, buf, sizeof(buf))) > 0)
-        for (len += nr, p = buf; nr--; ++p) {
-	    CRC(lcrc, *p) ;
-	    CRC(crc32_total, *p) ;
+	if (crc32_cur == NULL)
+		crc32_setup();
+	return (crc32_cur->update(crc, buf, len));
+}
+
+/*
+ * CRC combination: multiply by x^(8 * len2) modulo the polynomial, as in
+ * zlib's crc32_combine().  x2n_table[k] holds x^(2^k) mod P(x).
+ */
+#define	CRC32_POLY	0xedb88320U
+
+static uint32_t x2n_table[32];
+static int x2n_ready;
+
+static uint32_t
+multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m, p;
+
+	m = 1U << 31;
+	p = 0;
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ CRC32_POLY : b >> 1;
+	}
+	return (p);
+}
+
+static void
+crc32_x2n_init(void)
+{
+	uint32_t p;
+	int n;
+
+	if (x2n_ready)
+		return;
+	p = 1U << 30;		/* x^1 */
+	x2n_table[0] = p;
+	for (n = 1; n < 32; n++)
+		x2n_table[n] = p = multmodp(p, p);
+	x2n_ready = 1;
+}
+
+static uint32_t
+x2nmodp(off_t n, unsigned k)
+{
+	uint32_t p;
+
+	p = 1U << 31;		/* x^0 */
+	while (n) {
+		if (n & 1)
+			p = multmodp(x2n_table[k & 31], p);
+		n >>= 1;
+		k++;
 	}
-    if (nr < 0)
-        return 1 ;
+	return (p);
+}
+
+/*
+ * Given crc1 over A and crc2 over B (both finished, i.e. complemented),
+ * return the CRC of A followed by B, where len2 is the length of B.
+ */
+uint32_t
+crc32_combine(uint32_t crc1, uint32_t crc2, off_t len2)
+{
+	return (multmodp(x2nmodp(len2, 3), crc1) ^ crc2);
+}
+
+void
+crc32_init(struct crc32_ctx *ctx)
+{
+	ctx->crc = ~0U;
+	ctx->len = 0;
+}
+
+void
+crc32_ctx_update(struct crc32_ctx *ctx, const void *buf, size_t len)
+{
+	ctx->crc = crc32_update(ctx->crc, buf, len);
+	ctx->len += len;
+}
+
+uint32_t
+crc32_final(const struct crc32_ctx *ctx)
+{
+	return (~ctx->crc);
+}
+
+/*
+ * Append a finished CRC over len bytes to the context, as if those bytes
+ * had been fed through crc32_ctx_update().
+ */
+void
+crc32_ctx_append(struct crc32_ctx *ctx, uint32_t crc, off_t len)
+{
+	ctx->crc = ~crc32_combine(~ctx->crc, crc, len);
+	ctx->len += len;
+}
+
+/*
+ * Make the lazily built tables available before any thread is started;
+ * the hashing paths never modify shared state after this.
+ */
+void
+crc32_setup(void)
+{
+	if (crc32_cur == NULL)
+		crc32_select(CRC32_IMPL_AUTO);
+	crc32_x2n_init();
+}
+
+int
+crc32(int fd, uint32_t *cval, off_t *clen)
+{
+	struct crc32_ctx ctx;
+	char buf[BUFSIZ * 16];
+	ssize_t nr;
+
+	crc32_init(&ctx);
+	while ((nr = read(fd, buf, sizeof(buf))) > 0)
+		crc32_ctx_update(&ctx, buf, nr);
+	if (nr < 0)
+		return 1 ;
 
-    *clen = len ;
-    *cval = ~lcrc ;
-    crc32_total = ~crc32_total ;
-    return 0 ;
+	*clen = ctx.len ;
+	*cval = crc32_final(&ctx) ;
+	return 0 ;
 }
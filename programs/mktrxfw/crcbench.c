@@ -0,0 +1,102 @@
+/*
+ * crcbench.c
+ *
+ * Cross-checks every CRC32 implementation available on this CPU against
+ * the bytewise AUTODIN II table and reports its throughput.
+ *
+ * usage: crcbench [size_mb [rounds]]
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "extern.h"
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec + tv.tv_usec / 1e6);
+}
+
+static int
+check_impl(int idx, const uint8_t *buf, size_t size)
+{
+	static const size_t lens[] = { 0, 1, 3, 15, 16, 17, 63, 64, 65, 127,
+	    128, 255, 1000, 4095, 4096, 65537 };
+	uint32_t ref, got;
+	size_t i, off;
+
+	for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+		for (off = 0; off < 8; off++) {
+			if (lens[i] + off > size)
+				continue;
+			crc32_select(0);
+			ref = crc32_update(~0U, buf + off, lens[i]);
+			crc32_select(idx);
+			got = crc32_update(~0U, buf + off, lens[i]);
+			if (ref != got) {
+				printf("%-8s MISMATCH len=%zu off=%zu "
+				    "0x%08x != 0x%08x\n", crc32_impl_name(idx),
+				    lens[i], off, got, ref);
+				return (-1);
+			}
+		}
+	}
+	return (0);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t size = 64;
+	int rounds = 8;
+	uint8_t *buf;
+	uint32_t crc = 0;
+	double t0, t1;
+	const char *name;
+	int idx, r, ret = 0;
+	size_t i;
+
+	if (argc > 1)
+		size = strtoul(argv[1], NULL, 0);
+	if (argc > 2)
+		rounds = atoi(argv[2]);
+	size <<= 20;
+
+	if ((buf = malloc(size)) == NULL) {
+		perror("malloc");
+		return (1);
+	}
+	srandom(1);
+	for (i = 0; i < size; i++)
+		buf[i] = random();
+
+	for (idx = 0; (name = crc32_impl_name(idx)) != NULL; idx++) {
+		if (crc32_select(idx) != 0) {
+			printf("%-8s unsupported on this CPU\n", name);
+			continue;
+		}
+		if (check_impl(idx, buf, size) != 0) {
+			ret = 1;
+			continue;
+		}
+		crc32_select(idx);
+		t0 = now();
+		for (r = 0; r < rounds; r++)
+			crc += crc32_update(~0U, buf, size);
+		t1 = now();
+		printf("%-8s %8.3f GB/s\n", name,
+		    (double)size * rounds / (t1 - t0) / 1e9);
+	}
+
+	crc32_select(CRC32_IMPL_AUTO);
+	printf("default: %s (0x%08x)\n", crc32_impl_name(-1), crc);
+	free(buf);
+	return (ret);
+}
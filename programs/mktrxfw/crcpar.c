@@ -0,0 +1,172 @@
+/*
+ * crcpar.c
+ *
+ * Parallel CRC32 of file regions.  Every region is cut into fixed-size
+ * chunks which a small pool of threads hashes independently with pread();
+ * the chunk CRCs are then spliced back together with crc32_combine().
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "extern.h"
+
+#define	CHUNK_SIZE	(4 * 1024 * 1024)
+#define	READ_SIZE	(256 * 1024)
+#define	MAX_THREADS	64
+
+struct crc32_chunk {
+	struct crc32_job	*job;
+	off_t			off;
+	off_t			len;
+	uint32_t		crc;
+	int			error;
+};
+
+struct crc32_pool {
+	pthread_mutex_t		lock;
+	struct crc32_chunk	*chunks;
+	int			nchunks;
+	int			next;
+};
+
+static int
+hash_chunk(struct crc32_chunk *c, uint8_t *buf)
+{
+	struct crc32_ctx ctx;
+	off_t off, left;
+	ssize_t n;
+
+	crc32_init(&ctx);
+	off = c->off;
+	left = c->len;
+	while (left > 0) {
+		n = pread(c->job->fd, buf,
+		    left < READ_SIZE ? (size_t)left : READ_SIZE, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return (n < 0 ? errno : EIO);
+		crc32_ctx_update(&ctx, buf, n);
+		off += n;
+		left -= n;
+	}
+	c->crc = crc32_final(&ctx);
+	return (0);
+}
+
+static void *
+crc32_worker(void *arg)
+{
+	struct crc32_pool *pool = arg;
+	uint8_t *buf;
+	int i;
+
+	if ((buf = malloc(READ_SIZE)) == NULL)
+		return ((void *)(intptr_t)ENOMEM);
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		i = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+		if (i >= pool->nchunks)
+			break;
+		pool->chunks[i].error = hash_chunk(&pool->chunks[i], buf);
+	}
+	free(buf);
+	return (NULL);
+}
+
+static int
+crc32_nthreads(int nthreads, int nchunks)
+{
+	long ncpu;
+
+	if (nthreads <= 0) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = ncpu > 0 ? (int)ncpu : 1;
+	}
+	if (nthreads > MAX_THREADS)
+		nthreads = MAX_THREADS;
+	if (nthreads > nchunks)
+		nthreads = nchunks;
+	return (nthreads);
+}
+
+/*
+ * Hash njobs file regions using up to nthreads threads (0 picks the
+ * number of online CPUs).  On return each job holds the finished CRC of
+ * its region.  Returns 0, or -1 with errno and job->error set.
+ */
+int
+crc32_parallel(struct crc32_job *jobs, int njobs, int nthreads)
+{
+	struct crc32_pool pool;
+	pthread_t tids[MAX_THREADS];
+	struct crc32_chunk *c;
+	off_t off;
+	int i, n, started, error;
+
+	crc32_setup();
+
+	n = 0;
+	for (i = 0; i < njobs; i++)
+		n += jobs[i].len / CHUNK_SIZE + 1;
+	if ((pool.chunks = calloc(n, sizeof(*pool.chunks))) == NULL)
+		return (-1);
+
+	n = 0;
+	for (i = 0; i < njobs; i++) {
+		jobs[i].error = 0;
+		off = 0;
+		do {
+			c = &pool.chunks[n++];
+			c->job = &jobs[i];
+			c->off = jobs[i].off + off;
+			c->len = jobs[i].len - off;
+			if (c->len > CHUNK_SIZE)
+				c->len = CHUNK_SIZE;
+			off += c->len;
+		} while (off < jobs[i].len);
+	}
+	pool.nchunks = n;
+	pool.next = 0;
+	pthread_mutex_init(&pool.lock, NULL);
+
+	nthreads = crc32_nthreads(nthreads, n);
+	started = 0;
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&tids[i], NULL, crc32_worker, &pool) != 0)
+			break;
+		started++;
+	}
+	/* The calling thread works too; it is enough on its own. */
+	error = (int)(intptr_t)crc32_worker(&pool);
+	for (i = 1; i <= started; i++)
+		pthread_join(tids[i], NULL);
+	pthread_mutex_destroy(&pool.lock);
+
+	for (i = 0; i < n; i++) {
+		c = &pool.chunks[i];
+		if (c->error && !c->job->error)
+			c->job->error = c->error;
+		if (c->off == c->job->off)
+			c->job->crc = c->crc;
+		else
+			c->job->crc = crc32_combine(c->job->crc, c->crc,
+			    c->len);
+	}
+	free(pool.chunks);
+
+	for (i = 0; i < njobs; i++)
+		if (jobs[i].error)
+			error = jobs[i].error;
+	if (error) {
+		errno = error;
+		return (-1);
+	}
+	return (0);
+}
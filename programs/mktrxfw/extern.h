@@ -32,6 +32,44 @@
 
 #include <sys/cdefs.h>
 
-extern uint32_t crc32_total;
+#define	CRC32_IMPL_AUTO	(-1)
+
+/* Reentrant CRC state; crc is the running (uncomplemented) register. */
+struct crc32_ctx {
+	uint32_t	crc;
+	off_t		len;
+};
+
+/* A region of a file to be hashed by crc32_parallel(). */
+struct crc32_job {
+	int		fd;
+	off_t		off;
+	off_t		len;
+	uint32_t	crc;		/* out: finished CRC of the region */
+	int		error;		/* out: errno of a failed read */
+};
+
+/* Backends used by fcopy(), in the order they are tried. */
+#define	FCOPY_CLONE	0
+#define	FCOPY_RANGE	1
+#define	FCOPY_SENDFILE	2
+#define	FCOPY_BUFFERED	3
 
 int	crc32(int, uint32_t *, off_t *);
+void	crc32_setup(void);
+void	crc32_init(struct crc32_ctx *);
+void	crc32_ctx_update(struct crc32_ctx *, const void *, size_t);
+void	crc32_ctx_append(struct crc32_ctx *, uint32_t, off_t);
+uint32_t crc32_final(const struct crc32_ctx *);
+uint32_t crc32_combine(uint32_t, uint32_t, off_t);
+int	crc32_parallel(struct crc32_job *, int, int);
+uint32_t crc32_update(uint32_t, const void *, size_t);
+int	crc32_select(int);
+const char *crc32_impl_name(int);
+
+int	fcopy(int, off_t, int, off_t, off_t, struct crc32_ctx *);
+off_t	fcopy_stream(int, int, off_t, struct crc32_ctx *);
+const char *fcopy_method_name(int);
+
+struct trx_kernel_desc;
+int	kdesc_from_elf(const char *, struct trx_kernel_desc *);
@@ -0,0 +1,260 @@
+/*
+ * fcopy.c
+ *
+ * Copy a region of one file into another, letting the kernel do the work
+ * where it can: reflink (FICLONERANGE), copy_file_range(2), sendfile(2),
+ * and only then the classic read/write loop.
+ */
+
+#if defined(__linux__)
+#define	_GNU_SOURCE		/* copy_file_range(2) */
+#endif
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#endif
+
+#include "extern.h"
+
+#if defined(__linux__) || \
+    (defined(__FreeBSD__) && __FreeBSD_version >= 1300037)
+#define	HAVE_COPY_FILE_RANGE	1
+#endif
+
+#define	FCOPY_BUFSIZE	(1024 * 1024)
+
+static const char *fcopy_names[] = {
+	[FCOPY_CLONE]		= "reflink",
+	[FCOPY_RANGE]		= "copy_file_range",
+	[FCOPY_SENDFILE]	= "sendfile",
+	[FCOPY_BUFFERED]	= "read/write",
+};
+
+const char *
+fcopy_method_name(int method)
+{
+	if (method < 0 || method > FCOPY_BUFFERED)
+		return ("none");
+	return (fcopy_names[method]);
+}
+
+/*
+ * Each backend copies as much of the region as it can and returns the
+ * number of bytes done; the next backend picks up the rest.
+ */
+static off_t
+copy_clone(int fs, off_t soff, int fd, off_t doff, off_t len)
+{
+#if defined(__linux__) && defined(FICLONERANGE)
+	struct file_clone_range fcr;
+	struct stat st;
+
+	/* Extents can only be shared at filesystem block granularity. */
+	if (fstat(fd, &st) != 0 || st.st_blksize <= 0 ||
+	    soff % st.st_blksize != 0 || doff % st.st_blksize != 0)
+		return (0);
+	/* A partial tail block is only allowed at the source EOF. */
+	if (fstat(fs, &st) != 0 ||
+	    (len % st.st_blksize != 0 && soff + len != st.st_size))
+		return (0);
+
+	fcr.src_fd = fs;
+	fcr.src_offset = soff;
+	fcr.src_length = len;
+	fcr.dest_offset = doff;
+	if (ioctl(fd, FICLONERANGE, &fcr) != 0)
+		return (0);
+	return (len);
+#else
+	return (0);
+#endif
+}
+
+static off_t
+copy_range(int fs, off_t soff, int fd, off_t doff, off_t len)
+{
+#if defined(HAVE_COPY_FILE_RANGE)
+	off_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = copy_file_range(fs, &soff, fd, &doff,
+		    (size_t)MIN(len - done, (off_t)1 << 30), 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		done += n;
+	}
+	return (done);
+#else
+	return (0);
+#endif
+}
+
+static off_t
+copy_sendfile(int fs, off_t soff, int fd, off_t doff, off_t len)
+{
+#if defined(__linux__)
+	off_t done = 0;
+	ssize_t n;
+
+	/* sendfile(2) writes at the file position of the destination. */
+	if (lseek(fd, doff, SEEK_SET) < 0)
+		return (0);
+	while (done < len) {
+		n = sendfile(fd, fs, &soff,
+		    (size_t)MIN(len - done, (off_t)1 << 30));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		done += n;
+	}
+	return (done);
+#else
+	/* FreeBSD's sendfile(2) only writes to sockets. */
+	return (0);
+#endif
+}
+
+static int
+copy_buffered(int fs, off_t soff, int fd, off_t doff, off_t len,
+    struct crc32_ctx *ctx)
+{
+	uint8_t *buf;
+	ssize_t n, w;
+	off_t i;
+
+	if ((buf = malloc(FCOPY_BUFSIZE)) == NULL)
+		return (-1);
+	while (len > 0) {
+		n = pread(fs, buf, (size_t)MIN(len, FCOPY_BUFSIZE), soff);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n == 0)
+				errno = EIO;	/* source shrank */
+			goto fail;
+		}
+		if (ctx != NULL)
+			crc32_ctx_update(ctx, buf, n);
+		for (i = 0; i < n; i += w) {
+			w = pwrite(fd, buf + i, n - i, doff + i);
+			if (w < 0 && errno == EINTR) {
+				w = 0;
+				continue;
+			}
+			if (w < 0)
+				goto fail;
+		}
+		soff += n;
+		doff += n;
+		len -= n;
+	}
+	free(buf);
+	return (0);
+fail:
+	free(buf);
+	return (-1);
+}
+
+/*
+ * Copy len bytes at soff in fs to doff in fd.  If ctx is not NULL the
+ * copied bytes are also fed into it: inline for the buffered copy, or by
+ * hashing the source region when the kernel did the copy.  Returns the
+ * backend that moved the bulk of the data, or -1 with errno set.
+ */
+int
+fcopy(int fs, off_t soff, int fd, off_t doff, off_t len,
+    struct crc32_ctx *ctx)
+{
+	struct crc32_job job;
+	off_t done, n;
+	int method;
+
+	method = FCOPY_BUFFERED;
+	done = copy_clone(fs, soff, fd, doff, len);
+	if (done > 0)
+		method = FCOPY_CLONE;
+	if (done < len) {
+		n = copy_range(fs, soff + done, fd, doff + done, len - done);
+		if (n > 0 && done == 0)
+			method = FCOPY_RANGE;
+		done += n;
+	}
+	if (done < len) {
+		n = copy_sendfile(fs, soff + done, fd, doff + done,
+		    len - done);
+		if (n > 0 && done == 0)
+			method = FCOPY_SENDFILE;
+		done += n;
+	}
+
+	if (ctx != NULL && done > 0) {
+		job.fd = fs;
+		job.off = soff;
+		job.len = done;
+		if (crc32_parallel(&job, 1, 0) < 0)
+			return (-1);
+		crc32_ctx_append(ctx, job.crc, done);
+	}
+
+	if (done < len &&
+	    copy_buffered(fs, soff + done, fd, doff + done, len - done,
+	    ctx) < 0)
+		return (-1);
+	return (method);
+}
+
+/*
+ * Drain a pipe into fd at doff, hashing on the way if ctx is not NULL.
+ * Returns the number of bytes copied, or -1 with errno set.
+ */
+off_t
+fcopy_stream(int fs, int fd, off_t doff, struct crc32_ctx *ctx)
+{
+	uint8_t *buf;
+	ssize_t n, w;
+	off_t done, i;
+
+	if ((buf = malloc(FCOPY_BUFSIZE)) == NULL)
+		return (-1);
+	done = 0;
+	for (;;) {
+		n = read(fs, buf, FCOPY_BUFSIZE);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			goto fail;
+		if (n == 0)
+			break;
+		if (ctx != NULL)
+			crc32_ctx_update(ctx, buf, n);
+		for (i = 0; i < n; i += w) {
+			w = pwrite(fd, buf + i, n - i, doff + done + i);
+			if (w < 0 && errno == EINTR) {
+				w = 0;
+				continue;
+			}
+			if (w < 0)
+				goto fail;
+		}
+		done += n;
+	}
+	free(buf);
+	return (done);
+fail:
+	free(buf);
+	return (-1);
+}
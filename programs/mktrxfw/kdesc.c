@@ -0,0 +1,119 @@
+/*
+ * kdesc.c
+ *
+ * Fill in the TRX kernel descriptor from a 32-bit MIPS kernel ELF: the
+ * address "objcopy -O binary" output starts at (the lowest PT_LOAD LMA
+ * with file contents), the size of that output and the entry point.  The
+ * loader unpacks the kernel segment there and jumps to the entry point,
+ * so the trampoline kernel is not needed.
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "extern.h"
+#include "trxloader.h"
+
+#define	EI_NIDENT	16
+#define	EI_CLASS	4
+#define	EI_DATA		5
+#define	ELFCLASS32	1
+#define	ELFDATA2LSB	1
+#define	EM_MIPS		8
+#define	PT_LOAD		1
+#define	EHDR32_SIZE	52
+#define	PHDR32_SIZE	32
+#define	KSEG0_BASE	0x80000000U
+
+static uint32_t
+elf_get(const uint8_t *p, int size, int le)
+{
+	uint32_t v = 0;
+	int i;
+
+	for (i = 0; i < size; i++)
+		v |= (uint32_t)p[le ? i : size - 1 - i] << (8 * i);
+	return (v);
+}
+
+int
+kdesc_from_elf(const char *path, struct trx_kernel_desc *kd)
+{
+	uint8_t eh[EHDR32_SIZE], ph[PHDR32_SIZE];
+	uint32_t entry, phoff, paddr, filesz, lo = UINT32_MAX, hi = 0;
+	int fd, le, i, phnum, phentsize, ret = -1;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		perror(path);
+		return (-1);
+	}
+	if (pread(fd, eh, sizeof(eh), 0) != sizeof(eh) ||
+	    memcmp(eh, "\177ELF", 4) != 0 || eh[EI_CLASS] != ELFCLASS32) {
+		fprintf(stderr, "%s: not a 32-bit ELF file\n", path);
+		goto out;
+	}
+	le = eh[EI_DATA] == ELFDATA2LSB;
+	if (elf_get(eh + 18, 2, le) != EM_MIPS) {
+		fprintf(stderr, "%s: not a MIPS kernel\n", path);
+		goto out;
+	}
+	entry = elf_get(eh + 24, 4, le);
+	phoff = elf_get(eh + 28, 4, le);
+	phentsize = elf_get(eh + 42, 2, le);
+	phnum = elf_get(eh + 44, 2, le);
+	if (phentsize < PHDR32_SIZE) {
+		fprintf(stderr, "%s: bad program header size\n", path);
+		goto out;
+	}
+
+	for (i = 0; i < phnum; i++) {
+		if (pread(fd, ph, sizeof(ph), phoff + (off_t)i * phentsize) !=
+		    sizeof(ph)) {
+			fprintf(stderr, "%s: short program header table\n",
+			    path);
+			goto out;
+		}
+		paddr = elf_get(ph + 12, 4, le);
+		filesz = elf_get(ph + 16, 4, le);
+		if (elf_get(ph, 4, le) != PT_LOAD || filesz == 0)
+			continue;
+		if (paddr < lo)
+			lo = paddr;
+		if (paddr + filesz > hi)
+			hi = paddr + filesz;
+	}
+	if (hi == 0) {
+		fprintf(stderr, "%s: nothing to load\n", path);
+		goto out;
+	}
+	/* physical LMAs are loaded through KSEG0 */
+	if (lo < KSEG0_BASE) {
+		lo += KSEG0_BASE;
+		hi += KSEG0_BASE;
+	}
+
+	kd->magic = KDESC_MAGIC;
+	kd->load_addr = lo;
+	kd->entry = entry;
+	kd->size = hi - lo;
+	if (kd->entry - kd->load_addr >= kd->size) {
+		fprintf(stderr, "%s: entry 0x%08x is outside the image "
+		    "0x%08x-0x%08x\n", path, entry, lo, hi);
+		goto out;
+	}
+	if (kd->load_addr >= LOADER_RUNADDR ||
+	    kd->size > LOADER_RUNADDR - kd->load_addr) {
+		fprintf(stderr, "%s: image 0x%08x-0x%08x runs into the loader "
+		    "at 0x%08x\n", path, lo, hi, LOADER_RUNADDR);
+		goto out;
+	}
+	ret = 0;
+out:
+	close(fd);
+	return (ret);
+}
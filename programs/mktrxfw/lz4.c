@@ -0,0 +1,207 @@
+/*
+ * lz4.c
+ *
+ * LZ4 frame decoder for trxloader: the alternative to tinfl for kernels
+ * marked TRX_FLAG_LZ4.  Decodes a whole frame into one flat buffer, so
+ * linked blocks (matches reaching into the previous block) need no extra
+ * window.  Block and content checksums are skipped, the TRX CRC already
+ * covers the segment; dictionaries and the legacy frame are not supported.
+ * https://github.com/lz4/lz4/blob/dev/doc/lz4_Frame_format.md
+ */
+
+#include <stddef.h>
+#include "trxloader.h"
+
+#define LZ4_FLG_VERSION_MASK	0xc0
+#define LZ4_FLG_VERSION		0x40
+#define LZ4_FLG_BLOCK_CHECKSUM	0x10
+#define LZ4_FLG_CONTENT_SIZE	0x08
+#define LZ4_FLG_CONTENT_CHECKSUM	0x04
+#define LZ4_FLG_DICT_ID		0x01
+#define LZ4_BLOCK_UNCOMPRESSED	0x80000000U
+#define LZ4_MIN_MATCH		4
+#define LZ4_COPY_MIN		16	// longer copies go to mem.c
+#define LZ4_WILD		16	// room needed to overrun a short copy
+
+static uint32_t lz4_le32(const uint8_t* p){
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Unaligned 8 byte copy; gcc turns it into lwl/lwr and swl/swr on MIPS.
+static inline void lz4_copy8(uint8_t* d, const uint8_t* s){
+	uint32_t a, b;
+
+	__builtin_memcpy(&a, s, 4);
+	__builtin_memcpy(&b, s + 4, 4);
+	__builtin_memcpy(d, &a, 4);
+	__builtin_memcpy(d + 4, &b, 4);
+}
+
+/*
+ * Length fields: 15 in the token nibble means more bytes follow, each
+ * added to it, up to and including the first one that isn't 255.
+ */
+static int lz4_length(const uint8_t** ip, const uint8_t* iend, size_t* len){
+	uint8_t b;
+
+	if(*len != 15)
+		return 0;
+	do {
+		if(*ip >= iend)
+			return -1;
+		b = *(*ip)++;
+		*len += b;
+	} while(b == 255);
+	return 0;
+}
+
+/*
+ * One compressed block, appended at op.  Offsets may reach back to ostart,
+ * the start of the frame's output.  Returns the new end of the output or
+ * NULL if the block is corrupt or doesn't fit.
+ *
+ * Most sequences are a few literals and a short match.  Away from the
+ * ends of the buffers those are copied 8 bytes at a time, running past
+ * the end of the copy into bytes that the next sequence overwrites.
+ */
+static uint8_t* lz4_decompress_block(uint8_t* op, uint8_t* ostart,
+    uint8_t* oend, const uint8_t* ip, const uint8_t* iend){
+	size_t lit, mlen, dist;
+	unsigned int token;
+
+	while(ip < iend){
+		token = *ip++;
+		lit = token >> 4;
+		if(lz4_length(&ip, iend, &lit) < 0 ||
+		    lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+			return NULL;
+		if(lit <= LZ4_WILD && iend - ip >= LZ4_WILD &&
+		    oend - op >= LZ4_WILD){
+			lz4_copy8(op, ip);
+			lz4_copy8(op + 8, ip + 8);
+		}else if(lit >= LZ4_COPY_MIN)
+			tinfl_memcpy(op, ip, lit);
+		else
+			for(size_t i = 0; i < lit; i++)
+				op[i] = ip[i];
+		op += lit;
+		ip += lit;
+
+		// the last sequence of a block is literals only
+		if(ip == iend)
+			break;
+		if(iend - ip < 2)
+			return NULL;
+		dist = ip[0] | (ip[1] << 8);
+		ip += 2;
+		mlen = token & 15;
+		if(dist == 0 || dist > (size_t)(op - ostart) ||
+		    lz4_length(&ip, iend, &mlen) < 0)
+			return NULL;
+		mlen += LZ4_MIN_MATCH;
+		if(mlen > (size_t)(oend - op))
+			return NULL;
+		if(dist >= 8 && mlen <= 3 * 8 &&
+		    (size_t)(oend - op) >= 3 * 8){
+			// every 8 byte load only sees bytes already written
+			lz4_copy8(op, op - dist);
+			lz4_copy8(op + 8, op + 8 - dist);
+			lz4_copy8(op + 16, op + 16 - dist);
+		}else if(mlen >= LZ4_COPY_MIN)
+			tinfl_copy_match(op, dist, mlen);
+		else
+			for(size_t i = 0; i < mlen; i++)
+				op[i] = op[i - dist];
+		op += mlen;
+	}
+	return op;
+}
+
+size_t lz4_decompress_frame(void *pOut_buf, size_t out_buf_len, const void *pSrc_buf, size_t src_buf_len){
+	const uint8_t* ip = pSrc_buf;
+	const uint8_t* iend = ip + src_buf_len;
+	uint8_t* ostart = pOut_buf;
+	uint8_t* oend = ostart + out_buf_len;
+	uint8_t* op = ostart;
+	uint32_t bsize;
+	size_t hlen;
+	uint8_t flg;
+
+	if(src_buf_len < 7 || lz4_le32(ip) != LZ4_FRAME_MAGIC)
+		return LZ4_DECOMPRESS_FAILED;
+	flg = ip[4];
+	if((flg & LZ4_FLG_VERSION_MASK) != LZ4_FLG_VERSION ||
+	    (flg & LZ4_FLG_DICT_ID))
+		return LZ4_DECOMPRESS_FAILED;
+	// magic, FLG, BD, optional content size, header checksum
+	hlen = 7 + ((flg & LZ4_FLG_CONTENT_SIZE) ? 8 : 0);
+	if(src_buf_len < hlen)
+		return LZ4_DECOMPRESS_FAILED;
+	ip += hlen;
+
+	for(;;){
+		if(iend - ip < 4)
+			return LZ4_DECOMPRESS_FAILED;
+		bsize = lz4_le32(ip);
+		ip += 4;
+		if(bsize == 0)
+			break;	// EndMark
+		if((bsize & ~LZ4_BLOCK_UNCOMPRESSED) > (size_t)(iend - ip))
+			return LZ4_DECOMPRESS_FAILED;
+		if(bsize & LZ4_BLOCK_UNCOMPRESSED){
+			bsize &= ~LZ4_BLOCK_UNCOMPRESSED;
+			if(bsize > (size_t)(oend - op))
+				return LZ4_DECOMPRESS_FAILED;
+			tinfl_memcpy(op, ip, bsize);
+			op += bsize;
+		}else if((op = lz4_decompress_block(op, ostart, oend, ip,
+		    ip + bsize)) == NULL)
+			return LZ4_DECOMPRESS_FAILED;
+		ip += bsize;
+		if(flg & LZ4_FLG_BLOCK_CHECKSUM){
+			if(iend - ip < 4)
+				return LZ4_DECOMPRESS_FAILED;
+			ip += 4;
+		}
+	}
+	return op - ostart;
+}
+
+#ifdef TRXLOADER_HOST
+int lz4_frame_content_size(const void *pSrc_buf, size_t src_buf_len, uint64_t *size){
+	const uint8_t* ip = pSrc_buf;
+
+	if(src_buf_len < 15 || lz4_le32(ip) != LZ4_FRAME_MAGIC ||
+	    !(ip[4] & LZ4_FLG_CONTENT_SIZE))
+		return 0;
+	*size = lz4_le32(ip + 6) | ((uint64_t)lz4_le32(ip + 10) << 32);
+	return 1;
+}
+
+size_t lz4_frame_length(const void *pSrc_buf, size_t src_buf_len){
+	const uint8_t* ip = pSrc_buf;
+	size_t pos, bsize;
+	uint8_t flg;
+
+	if(src_buf_len < 7 || lz4_le32(ip) != LZ4_FRAME_MAGIC)
+		return LZ4_DECOMPRESS_FAILED;
+	flg = ip[4];
+	pos = 7 + ((flg & LZ4_FLG_CONTENT_SIZE) ? 8 : 0) +
+	    ((flg & LZ4_FLG_DICT_ID) ? 4 : 0);
+	// walk the block sizes up to the EndMark, without decoding
+	for(;;){
+		if(pos > src_buf_len || src_buf_len - pos < 4)
+			return LZ4_DECOMPRESS_FAILED;
+		bsize = lz4_le32(ip + pos) & ~LZ4_BLOCK_UNCOMPRESSED;
+		pos += 4;
+		if(bsize == 0)
+			break;
+		bsize += (flg & LZ4_FLG_BLOCK_CHECKSUM) ? 4 : 0;
+		if(bsize > src_buf_len - pos)
+			return LZ4_DECOMPRESS_FAILED;
+		pos += bsize;
+	}
+	pos += (flg & LZ4_FLG_CONTENT_CHECKSUM) ? 4 : 0;
+	return pos <= src_buf_len ? pos : LZ4_DECOMPRESS_FAILED;
+}
+#endif
@@ -6,34 +6,186 @@
  */
 
 #include "trxloader.h"
+#ifdef TRXLOADER_HOST
+#include <assert.h>
+#endif
 
 uint8_t d_stop = 0;
 
+#define WORD_MASK		(sizeof(uint32_t) - 1)
+#define WORD_ALIGNED(p)		(((uintptr_t)(p) & WORD_MASK) == 0)
+#define COPY_MIN		8	// shorter copies stay bytewise
+
+/*
+ * Joins the tail of word lo with the head of word hi, lo being the
+ * lower-addressed of two neighbouring aligned words; l is the bit offset
+ * of the wanted bytes in lo and r = 32 - l.
+ */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define MERGE(lo, hi, l, r)	(((lo) << (l)) | ((hi) >> (r)))
+#else
+#define MERGE(lo, hi, l, r)	(((lo) >> (l)) | ((hi) << (r)))
+#endif
+
+/*
+ * Copies whole words forward to the aligned dst and returns how many of
+ * the len bytes are left (less than a word).  An aligned src runs an
+ * 8-word unrolled loop.  Otherwise each source word is loaded once from
+ * its aligned address and merged with its neighbour, so nothing but
+ * aligned lw/sw is issued and no word without source bytes is touched.
+ *
+ * Safe for forward overlap when dst - src >= 4 (aligned src) or
+ * >= 8 (the merge loop holds up to 7 source bytes before storing them).
+ */
+static size_t copy_words(uint32_t* dst, const uint8_t* src, size_t len){
+	const uint32_t* wsrc;
+	uint32_t lo, hi;
+	unsigned int l, r;
+
+	if(WORD_ALIGNED(src)){
+		wsrc = (const uint32_t*)src;
+		while(len >= 8 * sizeof(uint32_t)){
+			dst[0] = wsrc[0];
+			dst[1] = wsrc[1];
+			dst[2] = wsrc[2];
+			dst[3] = wsrc[3];
+			dst[4] = wsrc[4];
+			dst[5] = wsrc[5];
+			dst[6] = wsrc[6];
+			dst[7] = wsrc[7];
+			len -= 8 * sizeof(uint32_t);
+			wsrc += 8;
+			dst += 8;
+		}
+		while(len >= sizeof(uint32_t)){
+			*dst++ = *wsrc++;
+			len -= sizeof(uint32_t);
+		}
+		return len;
+	}
+
+	l = ((uintptr_t)src & WORD_MASK) * 8;
+	r = 32 - l;
+	wsrc = (const uint32_t*)((uintptr_t)src & ~WORD_MASK);
+	lo = *wsrc++;
+	while(len >= 4 * sizeof(uint32_t)){
+		hi = wsrc[0];
+		dst[0] = MERGE(lo, hi, l, r);
+		lo = wsrc[1];
+		dst[1] = MERGE(hi, lo, l, r);
+		hi = wsrc[2];
+		dst[2] = MERGE(lo, hi, l, r);
+		lo = wsrc[3];
+		dst[3] = MERGE(hi, lo, l, r);
+		len -= 4 * sizeof(uint32_t);
+		wsrc += 4;
+		dst += 4;
+	}
+	while(len >= sizeof(uint32_t)){
+		hi = *wsrc++;
+		*dst++ = MERGE(lo, hi, l, r);
+		lo = hi;
+		len -= sizeof(uint32_t);
+	}
+	return len;
+}
+
 void * tinfl_memcpy(void *o_dst, const void *o_src, size_t len){
-	size_t size = len;
-	uint32_t* dst = o_dst;
-	uint32_t* src = (uint32_t*)o_src;
+	uint8_t* dst = o_dst;
+	const uint8_t* src = o_src;
+	size_t left;
 
-	int i = 0;
+	if(len >= COPY_MIN){
+		while(!WORD_ALIGNED(dst)){
+			*dst++ = *src++;
+			len--;
+		}
+		left = copy_words((uint32_t*)dst, src, len);
+		dst += len - left;
+		src += len - left;
+		len = left;
+	}
 
-	if(((uint32_t)dst % 4) == 0 && ((uint32_t)src % 4) == 0)
-		while(size >= 4){
-			*dst = *src;
-			size -= sizeof(uint32_t);
-			src++;
+	while(len > 0){
+		*dst++ = *src++;
+		len--;
+	}
+
+	return o_dst;
+}
+
+/*
+ * LZ77 match copy: appends len bytes to dst, each a copy of the byte dist
+ * bytes before it, so the source may overlap what is being written.
+ * Distances of 1 to 4 repeat a pattern that fits in a word (three words
+ * for 3); it is built once and stored with aligned word writes.  Longer
+ * distances copy the first dist bytes, which doubles the distance to the
+ * unchanged source, until tinfl_memcpy() can take over.
+ *
+ * dist must be at least 1: the pattern is built modulo dist, which on MIPS
+ * traps rather than fails for 0.  The decoders reject a distance of 0
+ * before they get here; the host builds check it.
+ */
+void * tinfl_copy_match(void *o_dst, size_t dist, size_t len){
+	uint8_t* dst = o_dst;
+	const uint8_t* src = dst - dist;
+	union { uint32_t w[3]; uint8_t b[12]; } pat;
+	uint32_t* wdst;
+	size_t i;
+
+#ifdef TRXLOADER_HOST
+	assert(dist >= 1);
+#endif
+
+	if(dist >= COPY_MIN)
+		return tinfl_memcpy(dst, src, len);
+
+	if(len >= COPY_MIN && dist > 4){
+		for(i = 0; i < dist; i++)
+			dst[i] = src[i];
+		tinfl_memcpy(dst + dist, src, len - dist);
+		return o_dst;
+	}
+
+	if(len >= 4 * sizeof(uint32_t)){
+		while(!WORD_ALIGNED(dst)){
+			*dst = dst[-dist];
 			dst++;
-			i++;
+			len--;
 		}
+		for(i = 0; i < sizeof(pat.b); i++)
+			pat.b[i] = dst[(int)(i % dist) - (int)dist];
 
-	if(size > 0){
-		uint8_t* bdst = (uint8_t*)dst;
-		uint8_t* bsrc = (uint8_t*)src;
-		while(size > 0){
-			*bdst = *bsrc;
-			size -= 1;
-			bsrc++;
-			bdst++;
+		wdst = (uint32_t*)dst;
+		if(dist == 3){
+			while(len >= 3 * sizeof(uint32_t)){
+				wdst[0] = pat.w[0];
+				wdst[1] = pat.w[1];
+				wdst[2] = pat.w[2];
+				len -= 3 * sizeof(uint32_t);
+				wdst += 3;
+			}
+		} else {
+			while(len >= 4 * sizeof(uint32_t)){
+				wdst[0] = pat.w[0];
+				wdst[1] = pat.w[0];
+				wdst[2] = pat.w[0];
+				wdst[3] = pat.w[0];
+				len -= 4 * sizeof(uint32_t);
+				wdst += 4;
+			}
+			while(len >= sizeof(uint32_t)){
+				*wdst++ = pat.w[0];
+				len -= sizeof(uint32_t);
+			}
 		}
+		dst = (uint8_t*)wdst;
+	}
+
+	while(len > 0){
+		*dst = dst[-dist];
+		dst++;
+		len--;
 	}
 
 	return o_dst;
@@ -41,26 +193,30 @@ void * tinfl_memcpy(void *o_dst, const void *o_src, size_t len){
 
 void * tinfl_memset(void *b, int c, size_t len){
 	size_t size = len;
-	uint32_t* dst = b;
+	uint8_t* bdst = b;
+	uint32_t* dst;
 	uint8_t short_value = (uint8_t)c;
 	uint32_t value = short_value;
 	uint32_t word = (value << 24) | (value << 16) | (value << 8) | value;
 
-	if(((uint32_t)b % 4) == 0)
+	if(size >= COPY_MIN){
+		while(!WORD_ALIGNED(bdst)){
+			*bdst++ = short_value;
+			size--;
+		}
+		dst = (uint32_t*)bdst;
 		while(size >= sizeof(uint32_t)){
 			*dst = word;
 			size -= sizeof(uint32_t);
 			dst++;
 		}
+		bdst = (uint8_t*)dst;
+	}
 
-	if(size > 0){
-		uint8_t* bdst = (uint8_t*)dst;
-
-		while(size > 0){
-			*bdst = short_value;
-			size -= 1;
-			bdst++;
-		}
+	while(size > 0){
+		*bdst = short_value;
+		size -= 1;
+		bdst++;
 	}
 	return b;
 }
@@ -0,0 +1,192 @@
+/*
+ * membench.c
+ *
+ * Checks mem.c's copy routines against a plain byte loop for every
+ * source/destination alignment, length and short match distance, then
+ * times them against the previous copy loop (word copies only when both
+ * pointers are aligned, bytes otherwise).
+ *
+ * usage: membench [len [total_mb]]
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trxloader.h"
+
+#define	CHECK_LEN	300
+#define	GUARD		16
+
+typedef void *(*copy_fn)(void *, const void *, size_t);
+typedef void *(*match_fn)(void *, size_t, size_t);
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec + tv.tv_usec / 1e6);
+}
+
+/* The loop mem.c had before the shift-and-merge engine. */
+static void *
+old_memcpy(void *o_dst, const void *o_src, size_t len)
+{
+	uint32_t *dst = o_dst;
+	const uint32_t *src = o_src;
+	uint8_t *bdst;
+	const uint8_t *bsrc;
+
+	if (((uintptr_t)dst % 4) == 0 && ((uintptr_t)src % 4) == 0)
+		for (; len >= 4; len -= 4)
+			*dst++ = *src++;
+	bdst = (uint8_t *)dst;
+	bsrc = (const uint8_t *)src;
+	while (len-- > 0)
+		*bdst++ = *bsrc++;
+	return (o_dst);
+}
+
+/* What tinfl does with an overlapping match without mem.c. */
+static void *
+byte_match(void *o_dst, size_t dist, size_t len)
+{
+	uint8_t *dst = o_dst;
+
+	for (; len > 0; len--, dst++)
+		*dst = dst[-dist];
+	return (o_dst);
+}
+
+static int
+check(void)
+{
+	static uint8_t src[CHECK_LEN + 2 * GUARD], got[CHECK_LEN + 2 * GUARD],
+	    want[CHECK_LEN + 2 * GUARD];
+	size_t soff, doff, len, dist, i;
+
+	for (i = 0; i < sizeof(src); i++)
+		src[i] = random();
+
+	for (soff = 0; soff < 8; soff++)
+		for (doff = 0; doff < 8; doff++)
+			for (len = 0; len <= CHECK_LEN - 8; len++) {
+				memset(got, 0xa5, sizeof(got));
+				memset(want, 0xa5, sizeof(want));
+				memcpy(want + GUARD + doff, src + soff, len);
+				tinfl_memcpy(got + GUARD + doff, src + soff,
+				    len);
+				if (memcmp(got, want, sizeof(got)) != 0) {
+					printf("tinfl_memcpy MISMATCH soff=%zu "
+					    "doff=%zu len=%zu\n", soff, doff,
+					    len);
+					return (-1);
+				}
+			}
+
+	for (doff = 0; doff < 8; doff++)
+		for (dist = 1; dist <= GUARD; dist++)
+			for (len = 0; len <= CHECK_LEN - 8; len++) {
+				memcpy(got, src, sizeof(got));
+				memcpy(want, src, sizeof(want));
+				byte_match(want + GUARD + doff, dist, len);
+				tinfl_copy_match(got + GUARD + doff, dist,
+				    len);
+				if (memcmp(got, want, sizeof(got)) != 0) {
+					printf("tinfl_copy_match MISMATCH "
+					    "doff=%zu dist=%zu len=%zu\n",
+					    doff, dist, len);
+					return (-1);
+				}
+			}
+
+	for (doff = 0; doff < 8; doff++)
+		for (len = 0; len <= CHECK_LEN - 8; len++) {
+			memset(got, 0xa5, sizeof(got));
+			memset(want, 0xa5, sizeof(want));
+			memset(want + GUARD + doff, 0x3c, len);
+			tinfl_memset(got + GUARD + doff, 0x3c, len);
+			if (memcmp(got, want, sizeof(got)) != 0) {
+				printf("tinfl_memset MISMATCH doff=%zu "
+				    "len=%zu\n", doff, len);
+				return (-1);
+			}
+		}
+	return (0);
+}
+
+static double
+time_copy(copy_fn fn, uint8_t *dst, const uint8_t *src, size_t len,
+    size_t total)
+{
+	size_t n, iters = total / len + 1;
+	double t0;
+
+	t0 = now();
+	for (n = 0; n < iters; n++)
+		fn(dst, src, len);
+	return (iters * len / (now() - t0) / 1e6);
+}
+
+static double
+time_match(match_fn fn, uint8_t *dst, size_t dist, size_t len, size_t total)
+{
+	size_t n, iters = total / len + 1;
+	double t0;
+
+	t0 = now();
+	for (n = 0; n < iters; n++)
+		fn(dst, dist, len);
+	return (iters * len / (now() - t0) / 1e6);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const struct {
+		size_t	soff, doff;
+	} aligns[] = { { 0, 0 }, { 1, 0 }, { 0, 3 }, { 2, 1 } };
+	static const size_t dists[] = { 1, 2, 3, 4, 5, 7, 8, 33 };
+	size_t len = 258, total = 64, i;
+	uint8_t *src, *dst;
+
+	if (argc > 1)
+		len = strtoul(argv[1], NULL, 0);
+	if (argc > 2)
+		total = strtoul(argv[2], NULL, 0);
+	total <<= 20;
+
+	srandom(1);
+	if (check() != 0)
+		return (1);
+	printf("copy routines match the byte loop\n");
+
+	if ((src = malloc(len + 64)) == NULL ||
+	    (dst = malloc(len + 64)) == NULL) {
+		perror("malloc");
+		return (1);
+	}
+	for (i = 0; i < len + 64; i++)
+		src[i] = dst[i] = random();
+
+	printf("%zu-byte copies, MB/s        old    new\n", len);
+	for (i = 0; i < sizeof(aligns) / sizeof(aligns[0]); i++)
+		printf("  memcpy src+%zu dst+%zu   %7.1f %7.1f\n",
+		    aligns[i].soff, aligns[i].doff,
+		    time_copy(old_memcpy, dst + 32 + aligns[i].doff,
+		    src + 32 + aligns[i].soff, len, total),
+		    time_copy(tinfl_memcpy, dst + 32 + aligns[i].doff,
+		    src + 32 + aligns[i].soff, len, total));
+	for (i = 0; i < sizeof(dists) / sizeof(dists[0]); i++)
+		printf("  match dist %-3zu         %7.1f %7.1f\n", dists[i],
+		    time_match(byte_match, dst + 33, dists[i], len, total),
+		    time_match(tinfl_copy_match, dst + 33, dists[i], len,
+		    total));
+	free(src);
+	free(dst);
+	return (0);
+}
@@ -0,0 +1,70 @@
+/*
+ * mipsbcj.c
+ *
+ * The encoder stage for TRX_FLAG_BCJ: filters a little endian MIPS kernel
+ * image (objcopy -O binary or the trampoline) through mips_bcj_encode()
+ * before it is compressed, so that build_trx can run
+ *	mipsbcj < kernel | gzip -9 | mktrxfw -c -j ...
+ * -d converts a filtered image back, as the loader does after unpacking.
+ *
+ * usage: mipsbcj [-d] [file] > out
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "trxloader.h"
+
+int
+main(int argc, char **argv)
+{
+	uint8_t *buf = NULL;
+	size_t len = 0, size = 0, n;
+	int ch, decode = 0;
+	FILE *f = stdin;
+
+	while ((ch = getopt(argc, argv, "d")) != -1) {
+		switch (ch) {
+		case 'd':
+			decode = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: mipsbcj [-d] [file] > out\n");
+			return (1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 1 || (argc == 1 && (f = fopen(argv[0], "rb")) == NULL)) {
+		perror(argc == 1 ? argv[0] : "mipsbcj");
+		return (1);
+	}
+
+	do {
+		if (len == size) {
+			size = size ? size * 2 : 0x100000;
+			if ((buf = realloc(buf, size)) == NULL) {
+				perror("realloc");
+				return (1);
+			}
+		}
+		len += n = fread(buf + len, 1, size - len, f);
+	} while (n != 0);
+	if (ferror(f)) {
+		perror(argc == 1 ? argv[0] : "stdin");
+		return (1);
+	}
+
+	n = decode ? mips_bcj_decode(buf, len) : mips_bcj_encode(buf, len);
+	if (fwrite(buf, 1, len, stdout) != len || fflush(stdout) != 0) {
+		perror("stdout");
+		return (1);
+	}
+	fprintf(stderr, "mipsbcj: %zu calls %s in %zu bytes\n", n,
+	    decode ? "converted back" : "converted", len);
+	free(buf);
+	return (0);
+}
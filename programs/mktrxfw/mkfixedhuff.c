@@ -0,0 +1,69 @@
+/*
+ * mkfixedhuff.c
+ *
+ * Generates tinfl_fixed.h: the fixed Huffman (BTYPE=01) decode tables of
+ * tinfl.c as constant data.  The tables are not recomputed here; tinfl
+ * itself builds them while inflating an empty fixed block, and they are
+ * dumped straight from the decompressor, so they can't drift from what
+ * the runtime path would have built.
+ */
+
+#define	TINFL_NO_STATIC_FIXED
+#include "tinfl.c"
+
+#include <stdio.h>
+
+static void
+dump_s16(const char *name, const mz_int16 *v, int n)
+{
+	int i;
+
+	printf("    /* %s */ {", name);
+	for (i = 0; i < n; i++)
+		printf("%s%d", i == 0 ? "\n      " : i % 16 ? "," : ",\n      ",
+		    v[i]);
+	printf(" },\n");
+}
+
+int
+main(void)
+{
+	/* BFINAL=1, BTYPE=01, then the 7-bit end-of-block code */
+	static const mz_uint8 empty_fixed[] = { 0x03, 0x00 };
+	static tinfl_decompressor r;
+	mz_uint8 out[1];
+	size_t inlen = sizeof(empty_fixed), outlen = sizeof(out);
+	int t, i;
+
+	tinfl_init(&r);
+	if (tinfl_decompress(&r, empty_fixed, &inlen, out, out, &outlen,
+	    TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF) != TINFL_STATUS_DONE ||
+	    outlen != 0) {
+		fprintf(stderr, "mkfixedhuff: can't inflate a fixed block\n");
+		return (1);
+	}
+
+	printf("/* Generated by mkfixedhuff from tinfl.c, do not edit. */\n\n");
+	printf("static const tinfl_huff_table s_tinfl_fixed_tables[2] = {\n");
+	for (t = 0; t < 2; t++) {
+		printf("  {\n    /* m_code_size */ {");
+		for (i = 0; i < TINFL_MAX_HUFF_SYMBOLS_0; i++)
+			printf("%s%u", i == 0 ? "\n      " : i % 32 ? "," :
+			    ",\n      ",
+			    r.m_tables[t].m_code_size[i]);
+		printf(" },\n");
+		dump_s16("m_look_up", r.m_tables[t].m_look_up,
+		    TINFL_FAST_LOOKUP_SIZE);
+		dump_s16("m_tree", r.m_tables[t].m_tree,
+		    TINFL_MAX_HUFF_SYMBOLS_0 * 2);
+		printf("  },\n");
+	}
+	printf("};\n\n");
+
+	printf("static const mz_uint32 s_tinfl_fixed_lit2[TINFL_FAST_LOOKUP_SIZE] = {");
+	for (i = 0; i < TINFL_FAST_LOOKUP_SIZE; i++)
+		printf("%s0x%x", i == 0 ? "\n  " : i % 8 ? "," : ",\n  ",
+		    r.m_lit2[i]);
+	printf("\n};\n");
+	return (0);
+}
@@ -0,0 +1,143 @@
+/*
+ * mkloadergz.c
+ *
+ * gzip -9 for the loader, with one difference: its boot descriptor (struct
+ * trx_boot_desc) goes into a stored deflate block of its own, so that it
+ * appears in loader.gz byte for byte and mktrxfw -f can patch it without
+ * recompressing the loader.  The blocks after it are compressed with a
+ * fresh window, so no match refers back to the descriptor.
+ *
+ * usage: mkloadergz loader > loader.gz
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "trxloader.h"
+
+static uint8_t *out;
+static size_t outlen, outsize;
+
+static void
+emit(const void *p, size_t len)
+{
+	while (outlen + len > outsize) {
+		outsize = outsize ? outsize * 2 : 0x10000;
+		if ((out = realloc(out, outsize)) == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	memcpy(out + outlen, p, len);
+	outlen += len;
+}
+
+/* Raw deflate of len bytes at p, ending byte aligned with the given flush. */
+static void
+deflate_part(z_stream *zs, const uint8_t *p, size_t len, int flush)
+{
+	uint8_t buf[0x4000];
+	int ret;
+
+	zs->next_in = (uint8_t *)p;
+	zs->avail_in = len;
+	do {
+		zs->next_out = buf;
+		zs->avail_out = sizeof(buf);
+		ret = deflate(zs, flush);
+		if (ret != Z_OK && ret != Z_STREAM_END) {
+			fprintf(stderr, "mkloadergz: deflate failed (%d)\n", ret);
+			exit(1);
+		}
+		emit(buf, sizeof(buf) - zs->avail_out);
+	} while (zs->avail_out == 0 || zs->avail_in != 0);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const uint8_t gzhdr[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 2, 3 };
+	struct trx_boot_desc bd;
+	uint8_t *img, stored[5], trailer[8];
+	size_t len, pos, i, end;
+	uint32_t crc;
+	z_stream zs;
+	FILE *f;
+	long n;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: mkloadergz loader > loader.gz\n");
+		return (1);
+	}
+	if ((f = fopen(argv[1], "rb")) == NULL || fseek(f, 0, SEEK_END) != 0 ||
+	    (n = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) != 0 ||
+	    (img = malloc(n + 1)) == NULL ||
+	    fread(img, 1, n, f) != (size_t)n) {
+		perror(argv[1]);
+		return (1);
+	}
+	fclose(f);
+	len = n;
+
+	/* the descriptor is word aligned in .data, still holding its magic */
+	pos = len;
+	for (i = 0; i + sizeof(bd) <= len; i += 4) {
+		memcpy(&bd, img + i, sizeof(bd));
+		if (bd.magic != BOOTDESC_MAGIC)
+			continue;
+		if (pos != len) {
+			fprintf(stderr, "%s: more than one boot descriptor\n",
+			    argv[1]);
+			return (1);
+		}
+		pos = i;
+	}
+	if (pos == len) {
+		fprintf(stderr, "%s: no boot descriptor\n", argv[1]);
+		return (1);
+	}
+	end = pos + sizeof(bd);
+
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 9,
+	    Z_DEFAULT_STRATEGY) != Z_OK) {
+		fprintf(stderr, "mkloadergz: deflateInit2 failed\n");
+		return (1);
+	}
+	emit(gzhdr, sizeof(gzhdr));
+	deflate_part(&zs, img, pos, Z_FULL_FLUSH);
+
+	/* BFINAL only if nothing follows, BTYPE=00, LEN, NLEN */
+	stored[0] = end == len;
+	stored[1] = sizeof(bd);
+	stored[2] = 0;
+	stored[3] = 0xff ^ sizeof(bd);
+	stored[4] = 0xff;
+	emit(stored, sizeof(stored));
+	emit(img + pos, sizeof(bd));
+
+	if (end < len)
+		deflate_part(&zs, img + end, len - end, Z_FINISH);
+	deflateEnd(&zs);
+
+	crc = crc32(0, img, len);
+	for (i = 0; i < 4; i++) {
+		trailer[i] = crc >> (8 * i);
+		trailer[4 + i] = (uint32_t)len >> (8 * i);
+	}
+	emit(trailer, sizeof(trailer));
+
+	if (fwrite(out, 1, outlen, stdout) != outlen || fflush(stdout) != 0) {
+		perror("stdout");
+		return (1);
+	}
+	fprintf(stderr, "%s: %zu -> %zu bytes, boot descriptor at %zu\n",
+	    argv[1], len, outlen, pos);
+	free(img);
+	free(out);
+	return (0);
+}
@@ -11,54 +11,149 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include "extern.h"
+#include "trxloader.h"
 #include <stdlib.h>
 
 
 ///https://wiki.openwrt.org/doc/techref/header
-#define MAGIC				0x30524448 // "HDR0"
 #define TRX_VERSION			1
 #define TRX_HEADER_SIZE 	28
-#define NUM_OFFSETS			3
-#define READ_HEADER(a) 		if((size = read(fd, &(a), sizeof(a))) < 0){ \
-		perror("can't read file"); \
-		return -1; \
-	}
-
-#define WRITE_HEADER(a) 		if(write(fd, &(a), sizeof(a)) < 0){ \
-		perror("can't write file"); \
-		return -1; \
-	}
+#define TRX_CRC_START		12 // CRC covers the image from flags onwards
+#define BATCH_MAX_THREADS	64
+#define TRX_SEG_STREAM		(-1) // segment size unknown until EOF
+#define TRX_SECTOR_SIZE		0x200
+#define TRX_MAX_ALIGN		0x1000000
 
-struct trx_header {
-	u_int32_t magic;
-	u_int32_t file_length;
-	u_int32_t crc32;
-	u_int16_t flags;
-	u_int16_t version;
-	u_int32_t offsets[NUM_OFFSETS];
+struct trx_seg {
+	char* name;
+	off_t off;		// where the segment starts in that file
+	off_t size;
+	uint32_t crc;		// CRC-32 of the input, valid if has_crc
+	int has_crc;
+	int method;		// fcopy() backend that wrote it
+	const void* tail;	// written behind it, word aligned (kernel descriptor)
+	int tail_len;
 };
 
+#define TRX_TAIL_ALIGN		4
+#define TRX_SEG_END(seg, off)	((seg).tail_len ? \
+	(((off) + (seg).size + TRX_TAIL_ALIGN - 1) & ~(off_t)(TRX_TAIL_ALIGN - 1)) + \
+	(seg).tail_len : (off) + (seg).size)
+
 void usage();
 int print_trx(const char* filename);
-int create_trx_header(char** filenames, char* output);
-int write_trx_header(char* output, struct trx_header* header, int is_full);
-int write_zero_padding(char* output, int nzeros);
-int fappend(char* src, char* dst);
+int verify_trx(const char* filename);
+int create_trx_header(char** filenames, char* output, int align, const char* elf,
+    int64_t flash_off, uint16_t flags);
+int batch_trx(const char* joblist, int align);
+int update_trx(char* image, const char* segment, char* filename, int align);
+int extract_trx(const char* image, const char* prefix, int gunzip);
+int patch_boot_desc(const char* image, uint32_t flash_off, struct trx_header* out_header);
+void print_trx_header(const struct trx_header* header);
+void print_trx_segs(const struct trx_seg* segs);
+void print_trx_kdesc(const struct trx_kernel_desc* kd);
+void print_boot_desc(const struct trx_boot_desc* bd);
+void print_trx_layout(const struct trx_seg* segs, const struct trx_header* header, int align);
+void init_trx_header(struct trx_header* header);
+int layout_trx(const struct trx_seg* segs, struct trx_header* header, int align);
+int write_trx(struct trx_seg* segs, struct trx_header* header, int align, char* output);
+
+/*
+ * "-a size" in front of the -c/-b/-u arguments: the rootfs alignment, for
+ * instance the flash erase block size.  Returns the number of arguments
+ * taken, or -1 if the size is not a power of two from 512 to 16 MB.
+ */
+static int parse_align(int argc, char** argv, int* align){
+	char* end;
+	unsigned long a;
+
+	*align = TRX_SECTOR_SIZE;
+	if(argc < 2 || strcmp("-a", argv[0]) != 0)
+		return 0;
+	a = strtoul(argv[1], &end, 0);
+	if(*end == 'k' || *end == 'K'){
+		a *= 1024;
+		end++;
+	}
+	if(*end != '\0' || a < TRX_SECTOR_SIZE || a > TRX_MAX_ALIGN ||
+	    (a & (a - 1)) != 0){
+		fprintf(stderr, "bad alignment %s, expected a power of two from "
+		    "512 to 16M\n", argv[1]);
+		return -1;
+	}
+	*align = a;
+	return 2;
+}
 
 int main(int argc, char** argv){
+	const char* elf = NULL;
+	int64_t flash_off = -1;
+	uint16_t flags = 0;
+	char* end;
+	int align, n;
+
 	if(argc > 1){
 		if(strcmp("-v",argv[1]) == 0)
 			if (argc == 3)
 				return print_trx(argv[2]);
-		if(strcmp("-c",argv[1]) == 0)
-			if (argc == 6){
+		if(strcmp("-V",argv[1]) == 0)
+			if (argc == 3)
+				return verify_trx(argv[2]) == 0 ? 0 : 1;
+		if(strcmp("-c",argv[1]) == 0){
+			if((n = parse_align(argc - 2, argv + 2, &align)) < 0)
+				return 1;
+			while(argc >= 3 + n){
+				if(strcmp("-j", argv[2 + n]) == 0){
+					flags |= TRX_FLAG_BCJ;
+					n++;
+				}else if(argc >= 4 + n && strcmp("-e", argv[2 + n]) == 0){
+					elf = argv[3 + n];
+					n += 2;
+				}else if(argc >= 4 + n && strcmp("-f", argv[2 + n]) == 0){
+					flash_off = strtoll(argv[3 + n], &end, 0);
+					if(*end != '\0' || flash_off < 0 ||
+					    flash_off >= FLASHSIZE || flash_off % 4 != 0){
+						fprintf(stderr, "bad flash offset %s\n",
+						    argv[3 + n]);
+						return 1;
+					}
+					n += 2;
+				}else
+					break;
+			}
+			if (argc == 6 + n){
 				char* filenames[3];
-				filenames[0] = argv[2];
-				filenames[1] = argv[3];
-				filenames[2] = argv[4];
-				return create_trx_header(filenames, argv[5]);
+				filenames[0] = argv[2 + n];
+				filenames[1] = argv[3 + n];
+				filenames[2] = argv[4 + n];
+				return create_trx_header(filenames, argv[5 + n], align, elf,
+				    flash_off, flags);
 			}
+		}
+		if(strcmp("-b",argv[1]) == 0){
+			if((n = parse_align(argc - 2, argv + 2, &align)) < 0)
+				return 1;
+			if (argc == 3 + n)
+				return batch_trx(argv[2 + n], align) == 0 ? 0 : 1;
+		}
+		if(strcmp("-u",argv[1]) == 0){
+			if((n = parse_align(argc - 2, argv + 2, &align)) < 0)
+				return 1;
+			if (argc == 5 + n)
+				return update_trx(argv[2 + n], argv[3 + n], argv[4 + n],
+				    align) == 0 ? 0 : 1;
+		}
+		if(strcmp("-x",argv[1]) == 0){
+			if (argc == 4)
+				return extract_trx(argv[2], argv[3], 0) == 0 ? 0 : 1;
+			if (argc == 5 && strcmp("-z",argv[2]) == 0)
+				return extract_trx(argv[3], argv[4], 1) == 0 ? 0 : 1;
+		}
 	}
 	usage(argv[0]);
 	return 0;
@@ -66,236 +161,1497 @@ int main(int argc, char** argv){
 
 void usage(char* progname){
 	printf("usage: %s [-v] filename\n",progname);
-	printf("       %s [-c] lzmaloader lzmakernel fsimage output\n",progname);
+	printf("       %s [-V] filename\n",progname);
+	printf("       %s [-c] [-a align] [-e kernel.elf] [-f flashoff] [-j] lzmaloader lzmakernel fsimage output\n",progname);
+	printf("       %s [-b] [-a align] joblist\n",progname);
+	printf("       %s [-u] [-a align] image loader|kernel|fs segment\n",progname);
+	printf("       %s [-x] [-z] image prefix\n",progname);
+	printf("\tjoblist: one \"lzmaloader lzmakernel fsimage output\" per line\n");
+	printf("\t-a aligns the fsimage, e.g. to the flash erase block (default 512);\n"
+	    "\t    -u only uses it if the image has to be rebuilt\n");
+	printf("\t-e: lzmakernel packs the objcopy -O binary of kernel.elf, which the loader\n"
+	    "\t    unpacks straight to its load address (no trampoline)\n");
+	printf("\t-f: the TRX goes flashoff bytes into flash; the loader (from mkloadergz)\n"
+	    "\t    is told where, so it does not have to scan flash for it\n");
+	printf("\t-j: lzmakernel packs a kernel filtered by mipsbcj, which the loader\n"
+	    "\t    converts back after unpacking it (-u keeps the flag)\n");
+	printf("\t-x writes prefix.loader, prefix.kernel and prefix.fs, -z unpacks the kernel\n");
 	return;
 }
 
 int print_trx(const char* filename){
-	u_int8_t buf[TRX_HEADER_SIZE];
 	int fd = open(filename,O_RDONLY);
 	if(fd < 0){
 		perror("can't open file:");
 		return -1;
 	}
-	int size;
 
 	struct trx_header header;
 
-	READ_HEADER(header.magic);
-	READ_HEADER(header.file_length);
-	READ_HEADER(header.crc32);
-	READ_HEADER(header.flags);
-	READ_HEADER(header.version);
-	for (int i = 0; i < NUM_OFFSETS; i++){
-		READ_HEADER(header.offsets[i]);
+	if(read(fd, &header, TRX_HEADER_SIZE) != TRX_HEADER_SIZE){
+		perror("can't read file");
+		close(fd);
+		return -1;
 	}
 
-	printf("magic = 0x%04x\n",header.magic);
-	printf("length = %d\n", header.file_length);
-	printf("crc32 = %u\n", header.crc32);
-	printf("~crc32 = %u\n", ~header.crc32);
-	printf("flags = 0x%04x\n", header.flags);
-	printf("version = %d\n", header.version);
-	for (int i = 0; i < NUM_OFFSETS; i++){
-		printf("offset[%d] = %d\n", i, header.offsets[i]);
-	}
+	print_trx_header(&header);
 	close(fd);
 	return 0;
 }
 
-int create_trx_header(char** filenames, char* output){
-	int sizes[NUM_OFFSETS];
-	int nzeros;
-	struct stat filestat;
+struct inflate_stat {
+	size_t size;
+	size_t max;	// where the loader's window ends
+	struct crc32_ctx crc;
+};
+
+// Stops the inflate once it runs past st->max, which size is then left beyond.
+static int inflate_count(const void* buf, int len, void* arg){
+	struct inflate_stat* st = arg;
+
+	st->size += len;
+	if(st->size > st->max)
+		return 0;
+	crc32_ctx_update(&st->crc, buf, len);
+	return 1;
+}
+
+/*
+ * The LZ4 counterpart of tinfl_decompress_mem_to_callback(): lz4.c only
+ * decodes into a flat buffer, so the frame is decoded in one go, into the
+ * size its header records or else the loader's window, and handed over.
+ */
+static int lz4_decompress_mem_to_callback(const void* in, size_t len,
+    tinfl_put_buf_func_ptr put, void* arg){
+	uint64_t size = TARGETSIZE;
+	uint8_t* out;
+	size_t n, done;
+	int chunk, ret = 0;
+
+	lz4_frame_content_size(in, len, &size);
+	if(size > SIZE_MAX || (out = malloc(size ? size : 1)) == NULL)
+		return 0;
+	if((n = lz4_decompress_frame(out, size, in, len)) != LZ4_DECOMPRESS_FAILED){
+		for(done = 0, ret = 1; ret && done < n; done += chunk){
+			chunk = n - done < 0x10000 ? n - done : 0x10000;
+			ret = put(out + done, chunk, arg);
+		}
+	}
+	free(out);
+	return ret;
+}
+
+static uint32_t get_le32(const uint8_t* p){
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/*
+ * Unpacks the kernel segment at k as trxloader does, counting into kst up
+ * to a window of max bytes, and sets *slen to the length of the compressed stream: up to the end of
+ * the gzip trailer, whose CRC and size must match what came out, or the
+ * whole segment for LZ4.  Returns 1 if the kernel unpacks cleanly.
+ */
+static int unpack_kernel(const uint8_t* k, size_t len, int lz4, size_t max,
+    struct inflate_stat* kst, size_t* slen){
+	size_t n = len;
+
+	kst->size = 0;
+	kst->max = max;
+	crc32_init(&kst->crc);
+	*slen = len;
+	if(lz4)
+		return lz4_decompress_mem_to_callback(k, len, inflate_count, kst);
+	if(!tinfl_decompress_mem_to_callback(k, &n, inflate_count, kst,
+	    TINFL_FLAG_PARSE_GZIP_HEADER) || len - n < 8)
+		return 0;
+	*slen = n + 8;
+	return get_le32(k + n) == crc32_final(&kst->crc) &&
+	    get_le32(k + n + 4) == (uint32_t)kst->size;
+}
+
+/*
+ * Finds the boot descriptor in loader.gz, where mkloadergz stored it as
+ * plain bytes.  Returns its offset in the loader segment, or -1 if there
+ * is none (a loader gzipped without mkloadergz) or more than one.
+ */
+static ssize_t find_boot_desc(const uint8_t* ldr, size_t len,
+    struct trx_boot_desc* bd){
+	ssize_t pos = -1;
+
+	for(size_t i = 0; i + sizeof(*bd) <= len; i++){
+		if(get_le32(ldr + i) != BOOTDESC_MAGIC)
+			continue;
+		if(pos >= 0)
+			return -1;
+		pos = i;
+	}
+	if(pos >= 0)
+		memcpy(bd, ldr + pos, sizeof(*bd));
+	return pos;
+}
+
+#define VERIFY(cond, ...) do { \
+		if(!(cond)){ \
+			printf("FAILED: " __VA_ARGS__); \
+			printf("\n"); \
+			errors++; \
+		} \
+	} while (0)
+
+/*
+ * Deep check of a TRX image: header sanity, offsets, the header CRC and a
+ * dry run of the loader's kernel inflate against its output window.
+ */
+int verify_trx(const char* filename){
+	const struct trx_kernel_desc* kd;
+	struct trx_boot_desc bd;
 	struct trx_header header;
+	struct inflate_stat kst;
+	struct crc32_ctx ctx;
+	struct stat st;
+	const uint8_t* img;
+	const char* how;
+	size_t klen;
+	uint32_t window = TARGETSIZE;
+	int errors = 0;
+	int fd, ok;
+
+	if((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &st) < 0){
+		perror(filename);
+		return -1;
+	}
+	if(st.st_size < TRX_HEADER_SIZE){
+		printf("FAILED: %s is too short for a TRX header\n", filename);
+		close(fd);
+		return -1;
+	}
+	img = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(img == MAP_FAILED){
+		perror("can't mmap image");
+		return -1;
+	}
+	madvise((void*)img, st.st_size, MADV_SEQUENTIAL);
+	memcpy(&header, img, TRX_HEADER_SIZE);
+	print_trx_header(&header);
+
+	VERIFY(header.magic == MAGIC, "bad magic 0x%08x", header.magic);
+	VERIFY(header.version == TRX_VERSION, "unknown version %d", header.version);
+	VERIFY(header.file_length >= TRX_HEADER_SIZE &&
+	    header.file_length <= st.st_size,
+	    "length %u does not fit the file (%jd bytes)",
+	    header.file_length, (intmax_t)st.st_size);
+	if(errors)
+		goto out;
+
+	VERIFY(header.offsets[0] >= TRX_HEADER_SIZE,
+	    "offset[0] = %u overlaps the header", header.offsets[0]);
+	for(int i = 0; i < NUM_OFFSETS; i++){
+		VERIFY(header.offsets[i] < header.file_length,
+		    "offset[%d] = %u is beyond the image length", i, header.offsets[i]);
+		if(i > 0)
+			VERIFY(header.offsets[i] > header.offsets[i - 1],
+			    "offset[%d] = %u is not above offset[%d] = %u",
+			    i, header.offsets[i], i - 1, header.offsets[i - 1]);
+	}
+
+	crc32_init(&ctx);
+	crc32_ctx_update(&ctx, img + TRX_CRC_START,
+	    header.file_length - TRX_CRC_START);
+	VERIFY(~crc32_final(&ctx) == header.crc32,
+	    "crc32 is %u, image hashes to %u", header.crc32, ~crc32_final(&ctx));
+	if(errors)
+		goto out;
+
+	/* Replay what trxloader does with the kernel segment. */
+	if((kd = trx_kernel_desc((const struct trx_header*)img)) != NULL){
+		print_trx_kdesc(kd);
+		window = kd->size;
+	}
+	how = header.flags & TRX_FLAG_LZ4 ? "LZ4 decoded" : "inflated";
+	ok = unpack_kernel(img + header.offsets[1],
+	    header.offsets[2] - header.offsets[1],
+	    header.flags & TRX_FLAG_LZ4, window, &kst, &klen);
+	if(kst.size > window){
+		VERIFY(0, "kernel inflates past the loader window of %u bytes",
+		    window);
+		goto out;
+	}
+	VERIFY(ok, "kernel segment can't be %s (%zu bytes produced)", how,
+	    kst.size);
+	printf("kernel = %zu bytes %s, crc32 0x%08x\n", kst.size, how,
+	    crc32_final(&kst.crc));
+	if(header.flags & TRX_FLAG_BCJ)
+		printf("kernel calls are BCJ filtered, the loader converts them back\n");
+	if(kd != NULL)
+		VERIFY(kst.size == kd->size,
+		    "kernel inflates to %zu bytes, descriptor says %u", kst.size,
+		    kd->size);
+	else
+		printf("loader window = %u bytes, %u left\n", window,
+		    (unsigned)(window - kst.size));
+
+	/* what the loader will check before it skips the flash scan */
+	if(find_boot_desc(img + header.offsets[0],
+	    header.offsets[1] - header.offsets[0], &bd) < 0)
+		goto out;
+	if(bd.kernel_len == 0){
+		printf("boot descriptor empty, the loader scans flash\n");
+		goto out;
+	}
+	print_boot_desc(&bd);
+	VERIFY(bd.kernel_off == header.offsets[1] && bd.kernel_len == klen &&
+	    bd.kernel_crc == crc32_final(&kst.crc),
+	    "boot descriptor is stale, kernel is at 0x%x+%zu with crc32 0x%08x",
+	    header.offsets[1], klen, crc32_final(&kst.crc));
+
+out:
+	munmap((void*)img, st.st_size);
+	printf("%s: %s\n", filename, errors ? "FAILED" : "OK");
+	return errors ? -1 : 0;
+}
+
+void print_trx_header(const struct trx_header* header){
+	printf("magic = 0x%04x\n",header->magic);
+	printf("length = %d\n", header->file_length);
+	printf("crc32 = %u\n", header->crc32);
+	printf("~crc32 = %u\n", ~header->crc32);
+	printf("flags = 0x%04x\n", header->flags);
+	printf("version = %d\n", header->version);
+	for (int i = 0; i < NUM_OFFSETS; i++){
+		printf("offset[%d] = %d\n", i, header->offsets[i]);
+	}
+}
+
+
+void init_trx_header(struct trx_header* header){
+	memset(header, 0, sizeof(*header));
+	header->magic = MAGIC;
+	header->version = TRX_VERSION;
+}
+
+/*
+ * Fill in the offsets and length for the given segment sizes.  The last
+ * segment is aligned to align bytes, the sector size (512) unless the
+ * rootfs is meant to be mapped straight from flash, in which case it is
+ * the erase block size.  The image itself always starts on an erase block,
+ * so an aligned offset in the image is an aligned offset in flash.
+ * Returns the number of zero bytes padded in front of the last segment.
+ */
+int layout_trx(const struct trx_seg* segs, struct trx_header* header, int align){
+	int nzeros = 0;
 	int offset = TRX_HEADER_SIZE;
-	header.magic = MAGIC;
-	header.flags = 0;
-	header.version = 1;
-	for(int i = 0; i< NUM_OFFSETS; i++){
-		if(stat(filenames[i],&filestat) != 0){
-			perror(filenames[i]);
-			return -1;
-		}
-		//align last offset to sector size (512)
+
+	for(int i = 0; i < NUM_OFFSETS; i++){
+		//align last offset to sector size (512) or erase block
 		if (i == NUM_OFFSETS - 1){
-			int nsectors = offset / 0x200;
-			int nrest = offset % 0x200;
+			int nsectors = offset / align;
+			int nrest = offset % align;
 			if(nrest > 0){
 				nrest = offset;
-				offset = (nsectors + 1) * 0x200;
+				offset = (nsectors + 1) * align;
 				nzeros = offset - nrest;
 			}
 		}
-		header.offsets[i] = offset;
-		offset += filestat.st_size;
+		header->offsets[i] = offset;
+		offset = TRX_SEG_END(segs[i], offset);
+	}
+	header->file_length = offset;
+	return nzeros;
+}
+
+void print_trx_segs(const struct trx_seg* segs){
+	for(int i = 0; i < NUM_OFFSETS; i++){
+		printf("crc32 for %s = 0x%08x (%s)\n", segs[i].name,
+		    segs[i].crc, fcopy_method_name(segs[i].method));
 	}
-	header.file_length = offset;
+}
 
-	//Temporary
-	if(write_trx_header(output, &header, 0) < 0){
+void print_trx_kdesc(const struct trx_kernel_desc* kd){
+	printf("kernel load address = 0x%08x, entry = 0x%08x, size = %u\n",
+	    kd->load_addr, kd->entry, kd->size);
+}
+
+void print_boot_desc(const struct trx_boot_desc* bd){
+	printf("boot descriptor: TRX at flash offset 0x%x, kernel 0x%x+%u, "
+	    "crc32 0x%08x\n", bd->trx_off, bd->kernel_off, bd->kernel_len,
+	    bd->kernel_crc);
+}
+
+/*
+ * Where the rootfs ends up in flash, relative to the start of the TRX
+ * partition; with an erase block alignment this is the offset to give
+ * a geom_map entry for mounting it in place.
+ */
+void print_trx_layout(const struct trx_seg* segs, const struct trx_header* header, int align){
+	int last = NUM_OFFSETS - 1;
+	unsigned pad = header->offsets[last] -
+	    TRX_SEG_END(segs[last - 1], header->offsets[last - 1]);
+
+	printf("fsimage flash offset = 0x%x (block %u of 0x%x bytes, %u bytes padding)\n",
+	    header->offsets[last], header->offsets[last] / align, align, pad);
+}
+
+/*
+ * A kernel that came down a pipe is only seen once it is in the image, and
+ * the exit status of the compressor feeding it gets lost in the pipeline:
+ * one that died halfway leaves a stream cut short.  An LZ4 frame has to
+ * reach its EndMark, a gzip stream has to inflate to what its trailer says.
+ */
+static int check_stream_kernel(const char* output, const struct trx_header* header){
+	struct inflate_stat kst;
+	const uint8_t* img;
+	size_t len = header->offsets[2] - header->offsets[1], slen;
+	int fd, ok = 1;
+
+	if((fd = open(output, O_RDONLY)) < 0){
+		perror(output);
+		return -1;
+	}
+	img = mmap(NULL, header->offsets[2], PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(img == MAP_FAILED){
+		perror("can't mmap image");
+		return -1;
+	}
+	if(header->flags & TRX_FLAG_LZ4)
+		ok = lz4_frame_length(img + header->offsets[1], len) !=
+		    LZ4_DECOMPRESS_FAILED;
+	else if(len >= 2 && img[header->offsets[1]] == 0x1f &&
+	    img[header->offsets[1] + 1] == 0x8b)
+		ok = unpack_kernel(img + header->offsets[1], len, 0, SIZE_MAX, &kst,
+		    &slen);
+	munmap((void*)img, header->offsets[2]);
+	if(!ok){
+		fprintf(stderr, "%s: kernel stream is cut short or corrupt\n", output);
 		return -1;
 	}
+	return 0;
+}
+
+int create_trx_header(char** filenames, char* output, int align, const char* elf,
+    int64_t flash_off, uint16_t flags){
+	struct trx_seg segs[NUM_OFFSETS];
+	struct stat filestat;
+	struct trx_header header;
+	struct trx_kernel_desc kd;
+	int kstream;
 
-	char* padding = malloc(sizeof(char) * (strlen(output)+strlen(".zeros") + 1));
-	strcpy(padding,output);
-	strcat(padding,".zeros");
+	for(int i = 0; i < NUM_OFFSETS; i++){
+		segs[i].name = filenames[i];
+		segs[i].off = 0;
+		segs[i].has_crc = 0;
+		segs[i].tail = NULL;
+		segs[i].tail_len = 0;
+		if(strcmp(filenames[i], "-") == 0){
+			segs[i].size = TRX_SEG_STREAM;
+			continue;
+		}
+		if(stat(filenames[i],&filestat) != 0){
+			perror(filenames[i]);
+			return -1;
+		}
+		/* pipes and FIFOs have no size until they hit EOF */
+		segs[i].size = S_ISREG(filestat.st_mode) ? filestat.st_size :
+		    TRX_SEG_STREAM;
+	}
+	kstream = segs[1].size == TRX_SEG_STREAM;
+	init_trx_header(&header);
+	header.flags = flags;
 
-	if(write_zero_padding(padding,nzeros) < 0){
+	/* the loader finds the descriptor at the end of its own segment */
+	if(elf != NULL){
+		if(kdesc_from_elf(elf, &kd) < 0)
+			return -1;
+		segs[0].tail = &kd;
+		segs[0].tail_len = sizeof(kd);
+	}
+
+	if(write_trx(segs, &header, align, output) < 0){
+		return -1;
+	}
+	if(kstream && check_stream_kernel(output, &header) < 0){
+		unlink(output);
 		return -1;
 	}
 
-	crc32_total = 0;
+	print_trx_segs(segs);
+	if(elf != NULL)
+		print_trx_kdesc(&kd);
+	if(flash_off >= 0 && patch_boot_desc(output, flash_off, &header) < 0)
+		return -1;
+	print_trx_layout(segs, &header, align);
+	print_trx_header(&header);
+	return 0;
+}
 
-	uint32_t crc;
-	off_t size;
-	int fd;
+/*
+ * TRX_FLAG_LZ4 follows what the kernel segment starts with: the loader
+ * hands an LZ4 frame to lz4.c and anything else to tinfl.
+ */
+static uint16_t kernel_flags(int fd, const struct trx_header* header){
+	uint16_t flags = header->flags & ~TRX_FLAG_LZ4;
+	uint8_t m[4];
+
+	if(header->offsets[2] - header->offsets[1] >= sizeof(m) &&
+	    pread(fd, m, sizeof(m), header->offsets[1]) == sizeof(m) &&
+	    (m[0] | m[1] << 8 | m[2] << 16 | (uint32_t)m[3] << 24) == LZ4_FRAME_MAGIC)
+		flags |= TRX_FLAG_LZ4;
+	return flags;
+}
+
+/*
+ * Stream the image out in a single pass: every input is read exactly once
+ * and hashed while it is copied, the sector padding comes from memory and
+ * the header is written last with one pwrite() at offset 0.  Segments are
+ * handed to fcopy(), which lets the kernel clone or copy the data when it
+ * can and only hashes the source in that case.  Segments that arrive with
+ * a known CRC (batch mode) are copied without hashing at all.
+ *
+ * The TRX CRC covers everything after the crc32 field: the rest of the
+ * header, loader, kernel, the sector padding and the rootfs.  When every
+ * size is known up front, layout_trx() has already placed every segment,
+ * so loader, kernel and rootfs are copied and hashed concurrently, a
+ * thread each, at their final offsets; the per-segment CRCs are then
+ * spliced with the padding and tails in image order.
+ *
+ * A segment may also be a pipe (or "-" for stdin) whose size is only
+ * known once it has been drained.  Then the segments are copied one after
+ * another: the pipe is streamed into place, the layout of everything
+ * behind it is redone, and since the header is written and hashed last
+ * the offsets, length and CRC are simply patched in at the end; the
+ * compressor output never needs a temporary file.  The flags are settled
+ * at that point too, from the kernel that was written.
+ *
+ * Nothing is printed here so that batch mode can run several of these at
+ * once; the caller reports the segment CRCs and methods.
+ */
+struct trx_copy {
+	struct trx_seg* seg;
+	const char* output;
+	int fd;			// output, or -1 to open one of its own
+	off_t doff;
+	struct crc32_ctx crc;
+	int ret;
+};
 
-	if((fd  = open(output, O_RDONLY)) < 0){
-		perror("can't open temp TRX file");
+/*
+ * Copies one segment to c->doff, hashing it into c->crc unless its CRC
+ * is known.  Each thread opens the output for itself: sendfile(2) writes
+ * at the file position, which must not be shared.
+ */
+static int copy_seg(struct trx_copy* c){
+	struct trx_seg* seg = c->seg;
+	int fd = c->fd, fs;
+	off_t n;
+
+	if(fd < 0 && (fd = open(c->output, O_WRONLY)) < 0){
+		perror(c->output);
 		return -1;
 	}
-	printf("crc32 for %s\n", output);
-	crc32(fd, &crc, &size);
-	close(fd);
+	if(strcmp(seg->name, "-") == 0)
+		fs = STDIN_FILENO;
+	else if((fs = open(seg->name, O_RDONLY)) < 0){
+		perror(seg->name);
+		if(fd != c->fd)
+			close(fd);
+		return -1;
+	}
+	crc32_init(&c->crc);
+	if(seg->size == TRX_SEG_STREAM){
+		n = fcopy_stream(fs, fd, c->doff, &c->crc);
+		seg->method = n < 0 ? -1 : FCOPY_BUFFERED;
+		if(n >= 0)
+			seg->size = n;
+	}else
+		seg->method = fcopy(fs, seg->off, fd, c->doff, seg->size,
+		    seg->has_crc ? NULL : &c->crc);
+	if(seg->method < 0)
+		perror(seg->name);
+	if(fs != STDIN_FILENO)
+		close(fs);
+	if(fd != c->fd && close(fd) < 0 && seg->method >= 0){
+		perror(c->output);
+		return -1;
+	}
+	return seg->method < 0 ? -1 : 0;
+}
 
+static void* copy_worker(void* arg){
+	struct trx_copy* c = arg;
+
+	c->ret = copy_seg(c);
+	return NULL;
+}
+
+int write_trx(struct trx_seg* segs, struct trx_header* header, int align, char* output){
+	static const uint8_t zeros[0x10000];
+	struct trx_copy copies[NUM_OFFSETS];
+	pthread_t tids[NUM_OFFSETS];
+	int started[NUM_OFFSETS];
+	struct crc32_ctx ctx, body;
+	int fd, nzeros, pad, stream = 0, ret = -1;
+	off_t n;
+
+	if((fd = open(output, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0){
+		perror("can't create file");
+		return -1;
+	}
+
+	if(fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) < 0){
+		perror("can't set permissions 0644 of TRX file");
+	}
+
+	nzeros = layout_trx(segs, header, align);
+	for(int i = 0; i < NUM_OFFSETS; i++){
+		copies[i].seg = &segs[i];
+		copies[i].output = output;
+		copies[i].fd = -1;
+		copies[i].doff = header->offsets[i];
+		copies[i].ret = 0;
+		started[i] = 0;
+		if(segs[i].size == TRX_SEG_STREAM)
+			stream = 1;
+	}
+	if(!stream){
+		/* the calling thread takes the loader, and any segment no thread took */
+		for(int i = 1; i < NUM_OFFSETS; i++)
+			started[i] = pthread_create(&tids[i], NULL, copy_worker,
+			    &copies[i]) == 0;
+		for(int i = 0; i < NUM_OFFSETS; i++)
+			if(!started[i])
+				copy_worker(&copies[i]);
+		for(int i = 1; i < NUM_OFFSETS; i++)
+			if(started[i])
+				pthread_join(tids[i], NULL);
+	}else{
+		for(int i = 0; i < NUM_OFFSETS; i++){
+			copies[i].fd = fd;
+			copies[i].doff = header->offsets[i];
+			if((copies[i].ret = copy_seg(&copies[i])) < 0)
+				break;
+			nzeros = layout_trx(segs, header, align);
+		}
+	}
+	for(int i = 0; i < NUM_OFFSETS; i++)
+		if(copies[i].ret < 0)
+			goto out;
+	/* there is nothing for the loader to boot */
+	if(segs[1].size == 0){
+		fprintf(stderr, "%s: kernel segment is empty\n", segs[1].name);
+		goto out;
+	}
+
+	crc32_init(&body);
 	for(int i = 0; i < NUM_OFFSETS; i++){
-		if(i == NUM_OFFSETS -1){
-			if((fd  = open(padding, O_RDONLY)) < 0){
-				perror("can't open file");
-				return -1;
+		for(int done = 0, z; i == NUM_OFFSETS - 1 && done < nzeros; done += z){
+			z = nzeros - done < (int)sizeof(zeros) ? nzeros - done :
+			    (int)sizeof(zeros);
+			if(pwrite(fd, zeros, z, header->offsets[i] - nzeros + done) != z){
+				perror("can't write padding");
+				goto out;
 			}
-			crc32(fd, &crc, &size);
-			close(fd);
+			crc32_ctx_update(&body, zeros, z);
 		}
 
-		if((fd  = open(filenames[i], O_RDONLY)) < 0){
-			perror("can't open file");
-			return -1;
+		if(!segs[i].has_crc){
+			segs[i].crc = crc32_final(&copies[i].crc);
+			segs[i].has_crc = 1;
 		}
+		crc32_ctx_append(&body, segs[i].crc, segs[i].size);
+		if(segs[i].tail_len){
+			n = TRX_SEG_END(segs[i], header->offsets[i]) - segs[i].tail_len;
+			pad = n - (header->offsets[i] + segs[i].size);
+			if(pwrite(fd, zeros, pad, n - pad) != pad ||
+			    pwrite(fd, segs[i].tail, segs[i].tail_len, n) != segs[i].tail_len){
+				perror("can't write segment tail");
+				goto out;
+			}
+			crc32_ctx_update(&body, zeros, pad);
+			crc32_ctx_update(&body, segs[i].tail, segs[i].tail_len);
+		}
+	}
+	if(header->file_length != TRX_SEG_END(segs[NUM_OFFSETS - 1],
+	    header->offsets[NUM_OFFSETS - 1])){
+		fprintf(stderr, "%s: image does not fit a TRX header\n", output);
+		goto out;
+	}
+	header->flags = kernel_flags(fd, header);
 
-		printf("crc32 for %s\n", filenames[i]);
-		crc32(fd, &crc, &size);
-		close(fd);
+	crc32_init(&ctx);
+	crc32_ctx_update(&ctx, (uint8_t*)header + TRX_CRC_START,
+	    TRX_HEADER_SIZE - TRX_CRC_START);
+	crc32_ctx_append(&ctx, crc32_final(&body), body.len);
+	/* TRX stores the CRC register without the final complement */
+	header->crc32 = ~crc32_final(&ctx);
+
+	if(pwrite(fd, header, TRX_HEADER_SIZE, 0) != TRX_HEADER_SIZE){
+		perror("can't write TRX header");
+		goto out;
+	}
+	ret = 0;
+
+out:
+	if(close(fd) < 0 && ret == 0){
+		perror("can't write TRX file");
+		ret = -1;
+	}
+	if(ret < 0){
+		unlink(output);
+	}
+	return ret;
+}
+
+/*
+ * Batch mode.  Board images usually share the loader and kernel and only
+ * differ in the rootfs, so every distinct input (by device and inode) is
+ * hashed once up front and the header CRC of each output is spliced
+ * together from the cached segment CRCs.  The outputs themselves are then
+ * written by a small pool of threads.
+ */
+struct trx_input {
+	char* name;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	uint32_t crc;
+};
+
+struct trx_batch_job {
+	char* output;
+	int input[NUM_OFFSETS];
+	struct trx_seg segs[NUM_OFFSETS];
+	struct trx_header header;
+	int ret;
+};
+
+struct trx_batch {
+	pthread_mutex_t lock;
+	struct trx_batch_job* jobs;
+	int njobs;
+	int next;
+	int align;
+};
+
+static int batch_input(struct trx_input** inputs, int* ninputs, const char* name){
+	struct trx_input* in;
+	struct stat st;
+
+	if(stat(name, &st) != 0){
+		perror(name);
+		return -1;
+	}
+	if(S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode)){
+		fprintf(stderr, "%s: batch inputs can't be pipes\n", name);
+		return -1;
+	}
+	for(int i = 0; i < *ninputs; i++){
+		if((*inputs)[i].dev == st.st_dev && (*inputs)[i].ino == st.st_ino)
+			return i;
 	}
+	if((in = realloc(*inputs, (*ninputs + 1) * sizeof(*in))) == NULL){
+		perror("can't allocate input list");
+		return -1;
+	}
+	*inputs = in;
+	in += *ninputs;
+	if((in->name = strdup(name)) == NULL){
+		perror("can't allocate input list");
+		return -1;
+	}
+	in->dev = st.st_dev;
+	in->ino = st.st_ino;
+	in->size = st.st_size;
+	return (*ninputs)++;
+}
 
-	header.crc32 = ~crc32_total;
+static int batch_read(const char* joblist, struct trx_batch_job** jobsp,
+    struct trx_input** inputs, int* ninputs){
+	struct trx_batch_job* jobs = NULL, * job;
+	char line[4096], * field[NUM_OFFSETS + 2], * p;
+	int njobs = 0, lineno = 0, n;
+	FILE* f;
 
-	if(write_trx_header(output, &header, 1) < 0){
+	if((f = fopen(joblist, "r")) == NULL){
+		perror(joblist);
 		return -1;
 	}
+	while(fgets(line, sizeof(line), f) != NULL){
+		lineno++;
+		if((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+		n = 0;
+		for(p = strtok(line, " \t\r\n"); p != NULL && n < NUM_OFFSETS + 2;
+		    p = strtok(NULL, " \t\r\n"))
+			field[n++] = p;
+		if(n == 0)
+			continue;
+		if(n != NUM_OFFSETS + 1){
+			fprintf(stderr, "%s:%d: expected loader kernel fsimage output\n",
+			    joblist, lineno);
+			goto fail;
+		}
+		if((job = realloc(jobs, (njobs + 1) * sizeof(*job))) == NULL){
+			perror("can't allocate job list");
+			goto fail;
+		}
+		jobs = job;
+		job += njobs++;
+		memset(job, 0, sizeof(*job));
+		for(int i = 0; i < NUM_OFFSETS; i++){
+			if((job->input[i] = batch_input(inputs, ninputs, field[i])) < 0)
+				goto fail;
+		}
+		if((job->output = strdup(field[NUM_OFFSETS])) == NULL){
+			perror("can't allocate job list");
+			goto fail;
+		}
+	}
+	if(ferror(f)){
+		perror(joblist);
+		goto fail;
+	}
+	fclose(f);
+	*jobsp = jobs;
+	return njobs;
 
-	for(int i = 0; i < NUM_OFFSETS; i++){
-		if(i == NUM_OFFSETS -1){
-			if(fappend(padding, output) < 0){
-				return -1;
+fail:
+	fclose(f);
+	for(int i = 0; i < njobs; i++)
+		free(jobs[i].output);
+	free(jobs);
+	return -1;
+}
+
+static void* batch_worker(void* arg){
+	struct trx_batch* batch = arg;
+	struct trx_batch_job* job;
+	int i;
+
+	for(;;){
+		pthread_mutex_lock(&batch->lock);
+		i = batch->next++;
+		pthread_mutex_unlock(&batch->lock);
+		if(i >= batch->njobs)
+			break;
+		job = &batch->jobs[i];
+		job->ret = write_trx(job->segs, &job->header, batch->align,
+		    job->output);
+	}
+	return NULL;
+}
+
+int batch_trx(const char* joblist, int align){
+	struct trx_batch_job* jobs = NULL;
+	struct trx_input* inputs = NULL;
+	struct crc32_job* crcs;
+	struct trx_batch batch;
+	pthread_t tids[BATCH_MAX_THREADS];
+	int ninputs = 0, njobs, nthreads, started, ret = 0;
+	long ncpu;
+
+	if((njobs = batch_read(joblist, &jobs, &inputs, &ninputs)) <= 0){
+		if(njobs == 0)
+			fprintf(stderr, "%s: no jobs\n", joblist);
+		ret = -1;
+		goto out;
+	}
+
+	/* Hash every distinct input once, all of them in parallel. */
+	if((crcs = calloc(ninputs, sizeof(*crcs))) == NULL){
+		perror("can't allocate input list");
+		ret = -1;
+		goto out;
+	}
+	for(int i = 0; i < ninputs; i++){
+		crcs[i].fd = -1;
+		crcs[i].len = inputs[i].size;
+	}
+	for(int i = 0; i < ninputs; i++){
+		if((crcs[i].fd = open(inputs[i].name, O_RDONLY)) < 0){
+			perror(inputs[i].name);
+			ret = -1;
+			break;
+		}
+	}
+	if(ret == 0 && crc32_parallel(crcs, ninputs, 0) < 0){
+		for(int i = 0; i < ninputs; i++){
+			if(crcs[i].error){
+				errno = crcs[i].error;
+				perror(inputs[i].name);
 			}
 		}
-		if(fappend(filenames[i], output) < 0){
+		ret = -1;
+	}
+	for(int i = 0; i < ninputs; i++){
+		inputs[i].crc = crcs[i].crc;
+		if(crcs[i].fd >= 0)
+			close(crcs[i].fd);
+	}
+	free(crcs);
+	if(ret < 0)
+		goto out;
+
+	for(int j = 0; j < njobs; j++){
+		for(int i = 0; i < NUM_OFFSETS; i++){
+			struct trx_input* in = &inputs[jobs[j].input[i]];
+
+			jobs[j].segs[i].name = in->name;
+			jobs[j].segs[i].off = 0;
+			jobs[j].segs[i].size = in->size;
+			jobs[j].segs[i].crc = in->crc;
+			jobs[j].segs[i].has_crc = 1;
+			jobs[j].segs[i].tail = NULL;
+			jobs[j].segs[i].tail_len = 0;
+		}
+		init_trx_header(&jobs[j].header);
+	}
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = ncpu > 0 ? (int)ncpu : 1;
+	if(nthreads > BATCH_MAX_THREADS)
+		nthreads = BATCH_MAX_THREADS;
+	if(nthreads > njobs)
+		nthreads = njobs;
+	batch.jobs = jobs;
+	batch.njobs = njobs;
+	batch.next = 0;
+	batch.align = align;
+	pthread_mutex_init(&batch.lock, NULL);
+	started = 0;
+	for(int i = 1; i < nthreads; i++){
+		if(pthread_create(&tids[i], NULL, batch_worker, &batch) != 0)
+			break;
+		started++;
+	}
+	batch_worker(&batch);
+	for(int i = 1; i <= started; i++)
+		pthread_join(tids[i], NULL);
+	pthread_mutex_destroy(&batch.lock);
+
+	printf("%d images from %d distinct inputs\n", njobs, ninputs);
+	for(int j = 0; j < njobs; j++){
+		printf("%s:\n", jobs[j].output);
+		if(jobs[j].ret < 0){
+			printf("FAILED\n");
+			ret = -1;
+			continue;
+		}
+		print_trx_segs(jobs[j].segs);
+		print_trx_layout(jobs[j].segs, &jobs[j].header, align);
+		print_trx_header(&jobs[j].header);
+	}
+
+out:
+	for(int j = 0; j < njobs; j++)
+		free(jobs[j].output);
+	free(jobs);
+	for(int i = 0; i < ninputs; i++)
+		free(inputs[i].name);
+	free(inputs);
+	return ret;
+}
+
+/*
+ * Update mode: replace one segment of an existing image.
+ *
+ * A segment that fits its old slot keeps the offsets; the slot is compared
+ * block by block and only blocks that differ are written, with the rest of
+ * a shrunk slot zero-filled (gzip stops at its trailer).  The header CRC is
+ * patched rather than recomputed: CRC-32 is linear, so the change is the
+ * raw CRC of old ^ new over the slot, carried over the bytes behind it, and
+ * nothing outside the slot is read.  The rootfs is last and can always be
+ * updated in place; when its length changes only the part in front of it
+ * is re-hashed.
+ *
+ * A loader or kernel that outgrows its slot moves what follows, so then the
+ * image is rebuilt next to the old one, copying the untouched segments from
+ * it (reflinked where possible), and renamed over it.  The rootfs is then
+ * aligned as -a says, as for -c, and the segments kept are copied without
+ * the padding behind them.
+ */
+#define UPDATE_BLOCK		(64 * 1024)
+
+static const char* trx_seg_names[NUM_OFFSETS] = { "loader", "kernel", "fs" };
+
+static int pread_full(int fd, uint8_t* buf, size_t len, off_t off){
+	ssize_t n;
+
+	while(len > 0){
+		n = pread(fd, buf, len, off);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0){
+			if(n == 0)
+				errno = EIO;
 			return -1;
 		}
+		buf += n;
+		off += n;
+		len -= n;
 	}
+	return 0;
+}
+
+static int pwrite_full(int fd, const uint8_t* buf, size_t len, off_t off){
+	ssize_t n;
 
-	print_trx(output);
+	while(len > 0){
+		n = pwrite(fd, buf, len, off);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0)
+			return -1;
+		buf += n;
+		off += n;
+		len -= n;
+	}
 	return 0;
 }
 
-int write_zero_padding(char* output, int nzeros){
-	int fd = open(output, O_WRONLY | O_CREAT);
-	if(fd < 0){
-		perror("can't create padding file");
-		return -1;
+/*
+ * Make len bytes at off in fd hold the newlen bytes of fs followed by
+ * zeros.  Only oldlen bytes of the region exist in fd yet.  Returns the
+ * raw CRC of old ^ new and the CRC of the new contents.
+ */
+static int update_region(int fd, off_t off, off_t len, off_t oldlen,
+    int fs, off_t newlen, uint32_t* xcrc, uint32_t* ncrc, off_t* written){
+	uint8_t* ob, * nb;
+	struct crc32_ctx ctx;
+	off_t pos, n, on, nn;
+	int ret = -1;
+
+	ob = malloc(UPDATE_BLOCK);
+	nb = malloc(UPDATE_BLOCK);
+	if(ob == NULL || nb == NULL)
+		goto out;
+	crc32_init(&ctx);
+	*xcrc = 0;
+	*written = 0;
+	for(pos = 0; pos < len; pos += n){
+		n = len - pos < UPDATE_BLOCK ? len - pos : UPDATE_BLOCK;
+		nn = newlen - pos < n ? (newlen > pos ? newlen - pos : 0) : n;
+		on = oldlen - pos < n ? (oldlen > pos ? oldlen - pos : 0) : n;
+		if(pread_full(fs, nb, nn, pos) < 0 ||
+		    pread_full(fd, ob, on, off + pos) < 0)
+			goto out;
+		memset(nb + nn, 0, n - nn);
+		memset(ob + on, 0, n - on);
+		crc32_ctx_update(&ctx, nb, n);
+		if(on == n && memcmp(ob, nb, n) == 0){
+			/* no change: the delta only moves over n zero bytes */
+			*xcrc = crc32_combine(*xcrc, 0, n);
+			continue;
+		}
+		if(pwrite_full(fd, nb, n, off + pos) < 0)
+			goto out;
+		*written += n;
+		for(off_t i = 0; i < n; i++)
+			ob[i] ^= nb[i];
+		*xcrc = crc32_update(*xcrc, ob, n);
 	}
+	*ncrc = crc32_final(&ctx);
+	ret = 0;
+out:
+	free(ob);
+	free(nb);
+	return ret;
+}
 
-	if(ftruncate(fd,0) < 0){
-		perror("can't erase padding file");
+/*
+ * The flash offset the loader of an open image was patched for, or -1 if
+ * its boot descriptor is empty or missing.
+ */
+static int64_t boot_desc_flash_off(int fd, const struct trx_header* header){
+	struct trx_boot_desc bd;
+	size_t len = header->offsets[1] - header->offsets[0];
+	uint8_t* ldr;
+	int64_t off = -1;
+
+	if((ldr = malloc(len)) == NULL)
 		return -1;
+	if(pread_full(fd, ldr, len, header->offsets[0]) == 0 &&
+	    find_boot_desc(ldr, len, &bd) >= 0 && bd.kernel_len != 0)
+		off = bd.trx_off;
+	free(ldr);
+	return off;
+}
+
+/*
+ * mktrxfw -f: fills in the boot descriptor of the loader for an image at
+ * flash_off in flash, and returns its new header in out_header if that
+ * is not NULL.  The kernel is unpacked to find its stream length
+ * and CRC; the descriptor is rewritten inside loader.gz, and the gzip
+ * trailer and the TRX CRC are corrected for the changed bytes.
+ */
+int patch_boot_desc(const char* image, uint32_t flash_off,
+    struct trx_header* out_header){
+	struct trx_header header;
+	struct trx_boot_desc bd;
+	struct inflate_stat lst, kst;
+	const struct trx_kernel_desc* kd;
+	struct stat st;
+	const uint8_t* img = MAP_FAILED;
+	uint8_t* ldr = NULL;
+	size_t len, n, klen;
+	ssize_t pos;
+	int fd, ret = -1;
+
+	if((fd = open(image, O_RDWR)) < 0 || fstat(fd, &st) < 0){
+		perror(image);
+		return -1;
+	}
+	if(pread_full(fd, (uint8_t*)&header, TRX_HEADER_SIZE, 0) < 0 ||
+	    header.magic != MAGIC || header.file_length > st.st_size ||
+	    header.offsets[0] < TRX_HEADER_SIZE ||
+	    header.offsets[1] <= header.offsets[0] ||
+	    header.offsets[2] <= header.offsets[1] ||
+	    header.offsets[2] > header.file_length){
+		fprintf(stderr, "%s: not a TRX image\n", image);
+		goto out;
+	}
+	if((img = mmap(NULL, header.file_length, PROT_READ, MAP_SHARED, fd, 0)) ==
+	    MAP_FAILED){
+		perror("can't mmap image");
+		goto out;
+	}
+	len = header.offsets[1] - header.offsets[0];
+	if((ldr = malloc(len)) == NULL){
+		perror("malloc");
+		goto out;
+	}
+	memcpy(ldr, img + header.offsets[0], len);
+	if((pos = find_boot_desc(ldr, len, &bd)) < 0){
+		fprintf(stderr, "%s: loader has no boot descriptor, gzip it with "
+		    "mkloadergz\n", image);
+		goto out;
+	}
+	kd = trx_kernel_desc((const struct trx_header*)img);
+	if(!unpack_kernel(img + header.offsets[1],
+	    header.offsets[2] - header.offsets[1], header.flags & TRX_FLAG_LZ4,
+	    kd != NULL ? kd->size : TARGETSIZE, &kst, &klen)){
+		fprintf(stderr, "%s: kernel does not unpack\n", image);
+		goto out;
 	}
 
-	if(chmod(output, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) < 0){
-		perror("can't set permissions 0644 of TRX file");
+	bd.trx_off = flash_off;
+	bd.kernel_off = header.offsets[1];
+	bd.kernel_len = klen;
+	bd.kernel_crc = crc32_final(&kst.crc);
+	memcpy(ldr + pos, &bd, sizeof(bd));
+
+	/* the descriptor is plain data in the loader too: redo its trailer */
+	n = len;
+	lst.size = 0;
+	lst.max = TARGETSIZE;
+	crc32_init(&lst.crc);
+	if(!tinfl_decompress_mem_to_callback(ldr, &n, inflate_count, &lst,
+	    TINFL_FLAG_PARSE_GZIP_HEADER) || len - n < 8 ||
+	    (size_t)pos + sizeof(bd) > n){
+		fprintf(stderr, "%s: loader does not inflate\n", image);
+		goto out;
 	}
+	for(int i = 0; i < 4; i++)
+		ldr[n + i] = crc32_final(&lst.crc) >> (8 * i);
 
-	uint8_t zero = 0;
+	/* and the TRX CRC for the difference in the loader segment */
+	for(size_t i = 0; i < len; i++)
+		ldr[i] ^= img[header.offsets[0] + i];
+	header.crc32 = ~(~header.crc32 ^ crc32_combine(crc32_update(0, ldr, len),
+	    0, header.file_length - header.offsets[1]));
+	for(size_t i = 0; i < len; i++)
+		ldr[i] ^= img[header.offsets[0] + i];
 
-	for(int i = 0; i < nzeros; i++){
-		WRITE_HEADER(zero);
+	if(pwrite_full(fd, ldr, len, header.offsets[0]) < 0 ||
+	    pwrite_full(fd, (uint8_t*)&header, TRX_HEADER_SIZE, 0) < 0){
+		perror(image);
+		goto out;
+	}
+	print_boot_desc(&bd);
+	if(out_header != NULL)
+		*out_header = header;
+	ret = 0;
+out:
+	if(img != MAP_FAILED)
+		munmap((void*)img, header.file_length);
+	free(ldr);
+	if(close(fd) < 0 && ret == 0){
+		perror(image);
+		ret = -1;
 	}
+	return ret;
+}
 
-	close(fd);
+/*
+ * The length of what segment i of an open image holds, without the padding
+ * the layout or a shrinking update left behind it: a gzip or LZ4 stream
+ * ends where its trailer or EndMark does, the rootfs at the end of the
+ * image.  Anything else fills its slot, up to the kernel descriptor.
+ */
+static off_t trx_seg_data_len(int fd, const struct trx_header* header, int i,
+    const struct trx_kernel_desc* kd){
+	struct inflate_stat st;
+	uint8_t* buf;
+	size_t len, n;
+
+	if(i == NUM_OFFSETS - 1)
+		return header->file_length - header->offsets[i];
+	len = header->offsets[i + 1] - header->offsets[i];
+	if(i == 0 && kd != NULL)
+		len -= sizeof(*kd);
+	if((buf = malloc(len ? len : 1)) == NULL)
+		return -1;
+	if(pread_full(fd, buf, len, header->offsets[i]) < 0){
+		free(buf);
+		return -1;
+	}
+	if(i == 1 && (header->flags & TRX_FLAG_LZ4)){
+		if((n = lz4_frame_length(buf, len)) != LZ4_DECOMPRESS_FAILED)
+			len = n;
+	}else if(len >= 2 && buf[0] == 0x1f && buf[1] == 0x8b)
+		unpack_kernel(buf, len, 0, i == 1 && kd != NULL ? kd->size :
+		    TARGETSIZE, &st, &len);
+	free(buf);
+	return len;
+}
+
+static int rebuild_trx(char* image, int ifd, mode_t mode,
+    struct trx_header* header, int idx, char* filename, off_t size,
+    const struct trx_kernel_desc* kd, int align){
+	struct trx_seg segs[NUM_OFFSETS];
+	char* tmp;
+	int fd;
+
+	for(int i = 0; i < NUM_OFFSETS; i++){
+		segs[i].name = image;
+		segs[i].off = header->offsets[i];
+		if(i != idx && (segs[i].size = trx_seg_data_len(ifd, header, i,
+		    kd)) < 0){
+			perror(image);
+			return -1;
+		}
+		segs[i].has_crc = 0;
+		segs[i].tail = NULL;
+		segs[i].tail_len = 0;
+	}
+	/* the kernel descriptor stays at the end of the loader segment */
+	if(kd != NULL){
+		segs[0].tail = kd;
+		segs[0].tail_len = sizeof(*kd);
+	}
+	segs[idx].name = filename;
+	segs[idx].off = 0;
+	segs[idx].size = size;
+
+	if((tmp = malloc(strlen(image) + sizeof(".XXXXXX"))) == NULL){
+		perror("can't allocate file name");
+		return -1;
+	}
+	sprintf(tmp, "%s.XXXXXX", image);
+	if((fd = mkstemp(tmp)) < 0){
+		perror(tmp);
+		free(tmp);
+		return -1;
+	}
+	if(write_trx(segs, header, align, tmp) < 0){
+		close(fd);
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	/* mkstemp() made it 0600: the rebuilt image keeps the old mode */
+	if((fchmod(fd, mode & 07777) < 0) | (close(fd) < 0) ||
+	    rename(tmp, image) < 0){
+		perror(image);
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	printf("%s: %s %s, image rebuilt\n", image, trx_seg_names[idx],
+	    idx == 0 && kd != NULL ? "goes in front of the kernel descriptor" :
+	    "grew past its slot");
+	print_trx_segs(segs);
 	return 0;
 }
 
-int write_trx_header(char* output, struct trx_header* header, int is_full)
-{
-	int fd = open(output, O_WRONLY | O_CREAT);
-	if(fd < 0){
-		perror("can't create file");
+int update_trx(char* image, const char* segment, char* filename, int align){
+	struct trx_kernel_desc kd;
+	struct trx_header header;
+	struct crc32_job prefix;
+	struct crc32_ctx ctx;
+	struct stat st, nst;
+	off_t end, slot, len, written;
+	uint8_t hx[TRX_HEADER_SIZE - TRX_CRC_START];
+	uint32_t xcrc, ncrc;
+	uint16_t flags;
+	int64_t flash_off = -1;
+	int idx, fd, fs = -1, ret = -1;
+
+	for(idx = 0; idx < NUM_OFFSETS; idx++){
+		if(strcmp(segment, trx_seg_names[idx]) == 0)
+			break;
+	}
+	if(idx == NUM_OFFSETS){
+		fprintf(stderr, "unknown segment %s, expected loader, kernel or fs\n",
+		    segment);
 		return -1;
 	}
 
-	if(ftruncate(fd,0) < 0){
-		perror("can't erase TRX file");
+	if((fd = open(image, O_RDWR)) < 0 || fstat(fd, &st) < 0){
+		perror(image);
 		return -1;
 	}
+	if(pread_full(fd, (uint8_t*)&header, TRX_HEADER_SIZE, 0) < 0){
+		perror("can't read TRX header");
+		goto out;
+	}
+	if(header.magic != MAGIC || header.file_length > st.st_size ||
+	    header.offsets[0] < TRX_HEADER_SIZE ||
+	    header.offsets[1] < header.offsets[0] ||
+	    header.offsets[2] < header.offsets[1] ||
+	    header.offsets[2] > header.file_length){
+		fprintf(stderr, "%s: not a TRX image\n", image);
+		goto out;
+	}
+	if((fs = open(filename, O_RDONLY)) < 0 || fstat(fs, &nst) < 0){
+		perror(filename);
+		goto out;
+	}
+	if(!S_ISREG(nst.st_mode)){
+		fprintf(stderr, "%s: not a regular file\n", filename);
+		goto out;
+	}
 
-	if(chmod(output, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) < 0){
-		perror("can't set permissions 0644 of TRX file");
+	if(header.offsets[1] - header.offsets[0] < sizeof(kd) ||
+	    pread_full(fd, (uint8_t*)&kd, sizeof(kd),
+	    header.offsets[1] - sizeof(kd)) < 0 || !trx_kernel_desc_valid(&kd))
+		kd.magic = 0;
+	else if(idx == 1)
+		fprintf(stderr, "%s: kernel descriptor kept, rebuild with -c -e "
+		    "if the kernel ELF changed\n", image);
+	/* a boot descriptor is patched again once the segment is in */
+	flash_off = boot_desc_flash_off(fd, &header);
+
+	end = idx < NUM_OFFSETS - 1 ? header.offsets[idx + 1] : header.file_length;
+	slot = end - header.offsets[idx];
+	/* a new loader goes in front of the descriptor, so it is rebuilt */
+	if((idx < NUM_OFFSETS - 1 && nst.st_size > slot) ||
+	    (idx == 0 && kd.magic)){
+		ret = rebuild_trx(image, fd, st.st_mode, &header, idx, filename,
+		    nst.st_size, kd.magic ? &kd : NULL, align);
+		goto out;
 	}
 
-	if(is_full){
-		WRITE_HEADER(header->magic);
-		WRITE_HEADER(header->file_length);
-		WRITE_HEADER(header->crc32);
+	len = idx < NUM_OFFSETS - 1 ? slot : nst.st_size;
+	if(update_region(fd, header.offsets[idx], len, slot, fs, nst.st_size,
+	    &xcrc, &ncrc, &written) < 0){
+		perror(image);
+		goto out;
 	}
-	WRITE_HEADER(header->flags);
-	WRITE_HEADER(header->version);
-	for (int i = 0; i < NUM_OFFSETS; i++){
-		WRITE_HEADER(header->offsets[i]);
+	if(len == slot){
+		/* same bytes covered: shift the delta over what follows */
+		header.crc32 = ~(~header.crc32 ^
+		    crc32_combine(xcrc, 0, header.file_length - end));
+		if((flags = kernel_flags(fd, &header)) != header.flags){
+			/* a kernel of the other format: the flags change too */
+			memset(hx, 0, sizeof(hx));
+			flags ^= header.flags;
+			memcpy(hx, &flags, sizeof(flags));
+			header.crc32 = ~(~header.crc32 ^
+			    crc32_combine(crc32_update(0, hx, sizeof(hx)), 0,
+			    header.file_length - TRX_HEADER_SIZE));
+			header.flags ^= flags;
+		}
+	}else{
+		header.file_length = header.offsets[idx] + len;
+		if(ftruncate(fd, header.file_length) < 0){
+			perror(image);
+			goto out;
+		}
+		prefix.fd = fd;
+		prefix.off = TRX_HEADER_SIZE;
+		prefix.len = header.offsets[idx] - TRX_HEADER_SIZE;
+		if(crc32_parallel(&prefix, 1, 0) < 0){
+			perror(image);
+			goto out;
+		}
+		crc32_init(&ctx);
+		crc32_ctx_update(&ctx, (uint8_t*)&header + TRX_CRC_START,
+		    TRX_HEADER_SIZE - TRX_CRC_START);
+		crc32_ctx_append(&ctx, prefix.crc, prefix.len);
+		crc32_ctx_append(&ctx, ncrc, len);
+		header.crc32 = ~crc32_final(&ctx);
 	}
+	if(pwrite_full(fd, (uint8_t*)&header, TRX_HEADER_SIZE, 0) < 0){
+		perror("can't write TRX header");
+		goto out;
+	}
+	ret = 0;
+	printf("%s: %s updated in place, %jd of %jd bytes rewritten\n", image,
+	    trx_seg_names[idx], (intmax_t)written, (intmax_t)len);
 
-	close(fd);
-	return 0;
+out:
+	if(fd >= 0 && close(fd) < 0 && ret == 0){
+		perror(image);
+		ret = -1;
+	}
+	if(fs >= 0)
+		close(fs);
+	if(ret == 0 && flash_off >= 0)
+		ret = patch_boot_desc(image, flash_off, &header);
+	if(ret == 0)
+		print_trx_header(&header);
+	return ret;
 }
 
-#define BUFSIZE 4096
-int fappend(char* src, char* dst){
-	int fs, fd;
-	uint8_t buf[BUFSIZE];
-	if((fs = open(src, O_RDONLY)) < 0){
-		perror("can't open file");
-		return -1;
+/*
+ * Split an image into prefix.loader, prefix.kernel and prefix.fs.  The
+ * segments are copied by fcopy() straight from the image, so the kernel
+ * clones or copies them without a trip through user space where it can.
+ * With gunzip the kernel segment is instead inflated from a mapping of the
+ * image and written out as it comes, through tinfl's dictionary-sized
+ * window, or decoded whole if the flags say it is LZ4, and a BCJ filtered
+ * kernel is converted back.  Every segment but the last keeps the sector
+ * padding behind it.
+ */
+struct inflate_out {
+	int fd;
+	off_t off;
+	off_t max;	// where the loader's window ends, off is left beyond it
+	int error;
+};
+
+static int inflate_write(const void* buf, int len, void* arg){
+	struct inflate_out* out = arg;
+
+	if(len > out->max - out->off){
+		out->off += len;
+		return 0;
+	}
+	if(pwrite_full(out->fd, buf, len, out->off) < 0){
+		out->error = errno;
+		return 0;
 	}
+	out->off += len;
+	return 1;
+}
+
+/* Convert the calls of an unpacked BCJ filtered kernel back, as the loader does in RAM. */
+static int unfilter_kernel(int fd, off_t len){
+	void* p;
 
-	if((fd = open(dst, O_WRONLY | O_APPEND)) < 0){
-		perror("can't open file");
+	if(len == 0)
+		return 0;
+	if((p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		return -1;
+	mips_bcj_decode(p, len);
+	return munmap(p, len);
+}
+
+int extract_trx(const char* image, const char* prefix, int gunzip){
+	struct trx_header header;
+	struct inflate_out out;
+	const struct trx_kernel_desc* kd;
+	struct stat st;
+	const uint8_t* img;
+	off_t off, len;
+	size_t zlen;
+	char* name;
+	int fd, fo, method, ok, ret = -1;
+
+	if((fd = open(image, O_RDONLY)) < 0 || fstat(fd, &st) < 0){
+		perror(image);
+		return -1;
+	}
+	if(pread_full(fd, (uint8_t*)&header, TRX_HEADER_SIZE, 0) < 0 ||
+	    header.magic != MAGIC || header.file_length > st.st_size ||
+	    header.offsets[0] < TRX_HEADER_SIZE ||
+	    header.offsets[1] < header.offsets[0] ||
+	    header.offsets[2] < header.offsets[1] ||
+	    header.offsets[2] > header.file_length){
+		fprintf(stderr, "%s: not a TRX image\n", image);
+		close(fd);
+		return -1;
+	}
+	if((name = malloc(strlen(prefix) + sizeof(".loader"))) == NULL){
+		perror("can't allocate file name");
+		close(fd);
 		return -1;
 	}
 
-	do{
-		int n = read(fs, buf, BUFSIZE);
-		uint8_t* wbuf = buf;
-		if(n > 0){
-			while(n > 0){
-				int w;
+	for(int i = 0; i < NUM_OFFSETS; i++){
+		off = header.offsets[i];
+		len = (i < NUM_OFFSETS - 1 ? header.offsets[i + 1] :
+		    header.file_length) - off;
+		sprintf(name, "%s.%s", prefix, trx_seg_names[i]);
+		if((fo = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0){
+			perror(name);
+			goto out;
+		}
 
-				if((w = write(fd, wbuf, n)) < 0){
-					perror("can't append to file");
-					return -1;
-				}
-				n -= w;
-				wbuf += w;
+		if(gunzip && i == 1){
+			img = mmap(NULL, header.file_length, PROT_READ, MAP_SHARED,
+			    fd, 0);
+			if(img == MAP_FAILED){
+				perror("can't mmap image");
+				close(fo);
+				goto out;
 			}
-		}else if(n == 0){
-			break;
+			madvise((void*)(img + off), len, MADV_SEQUENTIAL);
+			out.fd = fo;
+			out.off = 0;
+			out.max = (kd = trx_kernel_desc((const struct trx_header*)
+			    img)) != NULL ? kd->size : TARGETSIZE;
+			out.error = 0;
+			zlen = len;
+			if(header.flags & TRX_FLAG_LZ4)
+				ok = lz4_decompress_mem_to_callback(img + off, zlen,
+				    inflate_write, &out);
+			else
+				ok = tinfl_decompress_mem_to_callback(img + off, &zlen,
+				    inflate_write, &out, TINFL_FLAG_PARSE_GZIP_HEADER);
+			if(!ok){
+				if(out.error){
+					errno = out.error;
+					perror(name);
+				}else if(out.off > out.max)
+					fprintf(stderr, "%s: kernel inflates past the loader "
+					    "window of %jd bytes\n", image, (intmax_t)out.max);
+				else
+					fprintf(stderr, "%s: kernel segment does not inflate\n",
+					    image);
+				munmap((void*)img, header.file_length);
+				close(fo);
+				goto out;
+			}
+			munmap((void*)img, header.file_length);
+			if((header.flags & TRX_FLAG_BCJ) && unfilter_kernel(fo, out.off) < 0){
+				perror(name);
+				close(fo);
+				goto out;
+			}
+			printf("%s = %jd bytes inflated from %zu%s\n", name,
+			    (intmax_t)out.off, zlen,
+			    header.flags & TRX_FLAG_BCJ ? ", BCJ filter undone" : "");
 		}else{
-			perror("can't read from file");
-			return -1;
+			if((method = fcopy(fd, off, fo, 0, len, NULL)) < 0){
+				perror(name);
+				close(fo);
+				goto out;
+			}
+			printf("%s = %jd bytes at 0x%jx (%s)\n", name, (intmax_t)len,
+			    (intmax_t)off, fcopy_method_name(method));
+		}
+		if(close(fo) < 0){
+			perror(name);
+			goto out;
 		}
-	}while(1);
+	}
+	ret = 0;
 
-	close(fs);
+out:
+	free(name);
 	close(fd);
-	return 0;
+	return ret;
 }
-
@@ -27,7 +27,8 @@ typedef unsigned long long mz_uint64;
 #define MINIZ_LITTLE_ENDIAN 1
 #endif
 
-#if defined(_WIN64) || defined(__MINGW64__) || defined(_LP64) || defined(__LP64__)
+// TINFL_BITBUF32 keeps the 32-bit bit buffer of the MIPS loader on 64-bit hosts (tinflbench).
+#if (defined(_WIN64) || defined(__MINGW64__) || defined(_LP64) || defined(__LP64__)) && !defined(TINFL_BITBUF32)
 // Set MINIZ_HAS_64BIT_REGISTERS to 1 if the processor has 64-bit general purpose registers (enables 64-bit bitbuffer in inflator)
 #define MINIZ_HAS_64BIT_REGISTERS 1
 #endif
@@ -47,6 +48,7 @@ struct tinfl_decompressor_tag; typedef struct tinfl_decompressor_tag tinfl_decom
 // Return status.
 typedef enum
 {
+  TINFL_STATUS_CRC32_MISMATCH = -4,
   TINFL_STATUS_BAD_PARAM = -3,
   TINFL_STATUS_ADLER32_MISMATCH = -2,
   TINFL_STATUS_FAILED = -1,
@@ -90,10 +92,12 @@ typedef struct
 
 struct tinfl_decompressor_tag
 {
-  mz_uint32 m_state, m_num_bits, m_zhdr0, m_zhdr1, m_z_adler32, m_final, m_type, m_check_adler32, m_dist, m_counter, m_num_extra, m_table_sizes[TINFL_MAX_HUFF_TABLES];
+  mz_uint32 m_state, m_num_bits, m_zhdr0, m_zhdr1, m_z_adler32, m_final, m_type, m_check_adler32, m_check_crc32, m_check_len, m_z_crc32, m_z_isize, m_dist, m_counter, m_num_extra, m_table_sizes[TINFL_MAX_HUFF_TABLES];
   tinfl_bit_buf_t m_bit_buf;
   size_t m_dist_from_out_buf_start;
   tinfl_huff_table m_tables[TINFL_MAX_HUFF_TABLES];
+  mz_uint32 m_lit2[TINFL_FAST_LOOKUP_SIZE]; // two literals per lookup: sym0 | sym1 << 8 | total code length << 16, 0 if not
+  const tinfl_huff_table *m_pTables[2]; const mz_uint32 *m_pLit2; // tables of the current block: m_tables or the static fixed ones
   mz_uint8 m_raw_header[4], m_len_codes[TINFL_MAX_HUFF_SYMBOLS_0 + TINFL_MAX_HUFF_SYMBOLS_1 + 137];
 };
 
@@ -109,6 +113,7 @@ size_t tinfl_decompress_mem_to_mem(void *pOut_buf, size_t out_buf_len, const voi
 {
   tinfl_decompressor decomp; tinfl_status status; tinfl_init(&decomp);
   status = tinfl_decompress(&decomp, (const mz_uint8*)pSrc_buf, &src_buf_len, (mz_uint8*)pOut_buf, (mz_uint8*)pOut_buf, &out_buf_len, (flags & ~TINFL_FLAG_HAS_MORE_INPUT) | TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+  if (status == TINFL_STATUS_CRC32_MISMATCH) return TINFL_DECOMPRESS_MEM_TO_MEM_CRC32_MISMATCH;
   return (status != TINFL_STATUS_DONE) ? TINFL_DECOMPRESS_MEM_TO_MEM_FAILED : out_buf_len;
 }
 
@@ -124,6 +129,63 @@ size_t tinfl_decompress_mem_to_mem(void *pOut_buf, size_t out_buf_len, const voi
   #define MZ_READ_LE32(p) ((mz_uint32)(((const mz_uint8 *)(p))[0]) | ((mz_uint32)(((const mz_uint8 *)(p))[1]) << 8U) | ((mz_uint32)(((const mz_uint8 *)(p))[2]) << 16U) | ((mz_uint32)(((const mz_uint8 *)(p))[3]) << 24U))
 #endif
 
+#ifdef TRXLOADER_HOST
+  #define TINFL_TRACE(addr)
+#else
+  #define TINFL_TRACE(addr) ((void(*)())(addr))()
+#endif
+
+// Fast path limits: each pass of the fast loop consumes at most 8 bytes and loads 8 more ahead,
+// and writes a literal plus a match of up to 258 bytes with 8-byte word copies that may run
+// 7 bytes past its end.
+#define TINFL_FAST_IN_MIN 24
+#define TINFL_FAST_OUT_MIN (1 + 258 + 8)
+
+// With TINFL_FLAG_COMPUTE_CRC32 the CRC is brought up to date whenever this much output is pending,
+// while those bytes are still in the data cache; the fast path stops short to let it happen.
+#define TINFL_CRC_CHUNK 4096
+
+// Overlapping and aligned-only match copies at least this long go to tinfl_copy_match() in mem.c.
+#define TINFL_COPY_MATCH_MIN 16
+
+// Unaligned word access; gcc turns these into lwl/lwr and swl/swr on MIPS.
+#if MINIZ_LITTLE_ENDIAN
+static inline mz_uint32 tinfl_load32(const mz_uint8 *p) { mz_uint32 v; __builtin_memcpy(&v, p, 4); return v; }
+static inline mz_uint64 tinfl_load64(const mz_uint8 *p) { mz_uint64 v; __builtin_memcpy(&v, p, 8); return v; }
+#else
+static inline mz_uint32 tinfl_load32(const mz_uint8 *p) { return MZ_READ_LE32(p); }
+static inline mz_uint64 tinfl_load64(const mz_uint8 *p) { return MZ_READ_LE32(p) | ((mz_uint64)MZ_READ_LE32(p + 4) << 32); }
+#endif
+static inline void tinfl_copy32(mz_uint8 *d, const mz_uint8 *s) { mz_uint32 v; __builtin_memcpy(&v, s, 4); __builtin_memcpy(d, &v, 4); }
+
+// Refill the bit buffer with one unaligned load, consuming whole bytes only: afterwards it holds at
+// least TINFL_BITBUF_SIZE - 8 bits. Bits above num_bits are the stream's next bits, not zeros; they
+// are ORed in again by the next refill and cleared before leaving the fast path.
+#if TINFL_USE_64BIT_BITBUF
+  #define TINFL_FAST_REFILL() do { bit_buf |= tinfl_load64(pIn_buf_cur) << num_bits; pIn_buf_cur += (63 - num_bits) >> 3; num_bits |= 56; } MZ_MACRO_END
+#else
+  #define TINFL_FAST_REFILL() do { bit_buf |= (tinfl_bit_buf_t)tinfl_load32(pIn_buf_cur) << num_bits; pIn_buf_cur += (31 - num_bits) >> 3; num_bits |= 24; } MZ_MACRO_END
+#endif
+
+// Fast path Huffman decode; the caller guarantees 15 bits in the buffer.
+#define TINFL_FAST_DECODE(sym, pHuff) do { \
+  mz_uint code_len; \
+  if ((sym = (pHuff)->m_look_up[bit_buf & (TINFL_FAST_LOOKUP_SIZE - 1)]) >= 0) \
+    code_len = sym >> 9, sym &= 511; \
+  else { \
+    code_len = TINFL_FAST_LOOKUP_BITS; do { sym = (pHuff)->m_tree[~sym + ((bit_buf >> code_len++) & 1)]; } while (sym < 0); \
+  } bit_buf >>= code_len; num_bits -= code_len; } MZ_MACRO_END
+
+// Fixed Huffman (BTYPE=01) tables are generated from this file at build time by mkfixedhuff and
+// linked as read-only data, so fixed blocks don't rebuild them. mkfixedhuff itself builds tinfl
+// with TINFL_NO_STATIC_FIXED.
+#ifndef TINFL_NO_STATIC_FIXED
+  #define TINFL_STATIC_FIXED 1
+  #include "tinfl_fixed.h"
+#else
+  #define TINFL_STATIC_FIXED 0
+#endif
+
 #define TINFL_MEMCPY(d, s, l) tinfl_memcpy(d, s, l)
 #define TINFL_MEMSET(p, c, l) tinfl_memset(p, c, l)
 
@@ -192,6 +254,40 @@ size_t tinfl_decompress_mem_to_mem(void *pOut_buf, size_t out_buf_len, const voi
     code_len = TINFL_FAST_LOOKUP_BITS; do { temp = (pHuff)->m_tree[~temp + ((bit_buf >> code_len++) & 1)]; } while (temp < 0); \
   } sym = temp; bit_buf >>= code_len; num_bits -= code_len; } MZ_MACRO_END
 
+// CRC-32 (gzip) of the output, sliced by 4. The 4KB table lives in the bss and is built on first use,
+// so the loader image only grows by the code.
+static mz_uint32 s_tinfl_crc32[4][256];
+
+static void tinfl_crc32_init(void)
+{
+  mz_uint32 i, k, c;
+  for (i = 0; i < 256; i++)
+  {
+    for (c = i, k = 0; k < 8; k++) c = (c >> 1) ^ (0xEDB88320U & (0U - (c & 1)));
+    s_tinfl_crc32[0][i] = c;
+  }
+  for (i = 0; i < 256; i++)
+    for (k = 1; k < 4; k++) s_tinfl_crc32[k][i] = (s_tinfl_crc32[k - 1][i] >> 8) ^ s_tinfl_crc32[0][s_tinfl_crc32[k - 1][i] & 0xFF];
+}
+
+// Runs the (pre-inverted) CRC register over len bytes at p.
+static mz_uint32 tinfl_crc32(mz_uint32 crc, const mz_uint8 *p, size_t len)
+{
+  for ( ; (len) && ((size_t)p & 3); len--) crc = (crc >> 8) ^ s_tinfl_crc32[0][(crc ^ *p++) & 0xFF];
+#if MINIZ_LITTLE_ENDIAN
+  for ( ; len >= 4; len -= 4, p += 4)
+  {
+    crc ^= *(const mz_uint32 *)p;
+    crc = s_tinfl_crc32[3][crc & 0xFF] ^ s_tinfl_crc32[2][(crc >> 8) & 0xFF] ^ s_tinfl_crc32[1][(crc >> 16) & 0xFF] ^ s_tinfl_crc32[0][crc >> 24];
+  }
+#endif
+  for ( ; len; len--) crc = (crc >> 8) ^ s_tinfl_crc32[0][(crc ^ *p++) & 0xFF];
+  return crc;
+}
+
+#define TINFL_CRC_FLUSH() do { if (decomp_flags & TINFL_FLAG_COMPUTE_CRC32) { \
+  r->m_check_crc32 = tinfl_crc32(r->m_check_crc32, pCrc_cur, pOut_buf_cur - pCrc_cur); r->m_check_len += (mz_uint32)(pOut_buf_cur - pCrc_cur); pCrc_cur = pOut_buf_cur; } } MZ_MACRO_END
+
 tinfl_status tinfl_decompress(tinfl_decompressor *r, const mz_uint8 *pIn_buf_next, size_t *pIn_buf_size, mz_uint8 *pOut_buf_start, mz_uint8 *pOut_buf_next, size_t *pOut_buf_size, const mz_uint32 decomp_flags)
 {
   static const int s_length_base[31] = { 3,4,5,6,7,8,9,10,11,13, 15,17,19,23,27,31,35,43,51,59, 67,83,99,115,131,163,195,227,258,0,0 };
@@ -203,7 +299,7 @@ tinfl_status tinfl_decompress(tinfl_decompressor *r, const mz_uint8 *pIn_buf_nex
 
   tinfl_status status = TINFL_STATUS_FAILED; mz_uint32 num_bits, dist, counter, num_extra; tinfl_bit_buf_t bit_buf;
   const mz_uint8 *pIn_buf_cur = pIn_buf_next, *const pIn_buf_end = pIn_buf_next + *pIn_buf_size;
-  mz_uint8 *pOut_buf_cur = pOut_buf_next, *const pOut_buf_end = pOut_buf_next + *pOut_buf_size;
+  mz_uint8 *pOut_buf_cur = pOut_buf_next, *const pOut_buf_end = pOut_buf_next + *pOut_buf_size, *pCrc_cur = pOut_buf_next;
   size_t out_buf_size_mask = (decomp_flags & TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF) ? (size_t)-1 : ((pOut_buf_next - pOut_buf_start) + *pOut_buf_size) - 1, dist_from_out_buf_start;
 
   // Ensure the output buffer's size is a power of 2, unless the output buffer is large enough to hold the entire output file (in which case it doesn't matter).
@@ -213,6 +309,8 @@ tinfl_status tinfl_decompress(tinfl_decompressor *r, const mz_uint8 *pIn_buf_nex
   TINFL_CR_BEGIN
 
   bit_buf = num_bits = dist = counter = num_extra = r->m_zhdr0 = r->m_zhdr1 = 0; r->m_z_adler32 = r->m_check_adler32 = 1;
+  r->m_check_crc32 = 0xFFFFFFFFU; r->m_check_len = 0;
+  if ((decomp_flags & TINFL_FLAG_COMPUTE_CRC32) && (!s_tinfl_crc32[0][128])) tinfl_crc32_init();
   if (decomp_flags & TINFL_FLAG_PARSE_ZLIB_HEADER)
   {
     TINFL_GET_BYTE(1, r->m_zhdr0); TINFL_GET_BYTE(2, r->m_zhdr1);
@@ -225,6 +323,7 @@ tinfl_status tinfl_decompress(tinfl_decompressor *r, const mz_uint8 *pIn_buf_nex
 
   do
   {
+    TINFL_CRC_FLUSH();
     TINFL_GET_BITS(3, r->m_final, 3); r->m_type = r->m_final >> 1;
     if (r->m_type == 0)
     {
@@ -262,11 +361,17 @@ tinfl_status tinfl_decompress(tinfl_decompressor *r, const mz_uint8 *pIn_buf_nex
     }
     else
     {
+      r->m_pTables[0] = &r->m_tables[0]; r->m_pTables[1] = &r->m_tables[1]; r->m_pLit2 = r->m_lit2;
       if (r->m_type == 1)
       {
+#if TINFL_STATIC_FIXED
+        r->m_pTables[0] = &s_tinfl_fixed_tables[0]; r->m_pTables[1] = &s_tinfl_fixed_tables[1]; r->m_pLit2 = s_tinfl_fixed_lit2;
+        r->m_type = (mz_uint32)-1; // nothing to build
+#else
         mz_uint8 *p = r->m_tables[0].m_code_size; mz_uint i;
         r->m_table_sizes[0] = 288; r->m_table_sizes[1] = 32; TINFL_MEMSET(r->m_tables[1].m_code_size, 5, 32);
         for ( i = 0; i <= 143; ++i) *p++ = 8; for ( ; i <= 255; ++i) *p++ = 9; for ( ; i <= 279; ++i) *p++ = 7; for ( ; i <= 287; ++i) *p++ = 8;
+#endif
       }
       else
       {
@@ -325,16 +430,106 @@ tinfl_status tinfl_decompress(tinfl_decompressor *r, const mz_uint8 *pIn_buf_nex
         }
       }
 
+      // Pair up literals whose codes together fit the fast lookup bits, for the fast path below.
+      if ((decomp_flags & TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF) && (r->m_pLit2 == r->m_lit2))
+      {
+        const mz_int16 *pLook_up = r->m_tables[0].m_look_up; mz_uint i;
+        for (i = 0; i < TINFL_FAST_LOOKUP_SIZE; i++)
+        {
+          int s0 = pLook_up[i], s1; mz_uint l0 = s0 >> 9;
+          r->m_lit2[i] = 0;
+          if ((s0 < 0) || (s0 & 256) || (l0 >= TINFL_FAST_LOOKUP_BITS)) continue;
+          s1 = pLook_up[i >> l0];
+          if ((s1 < 0) || (s1 & 256) || ((mz_uint)(s1 >> 9) > TINFL_FAST_LOOKUP_BITS - l0)) continue;
+          r->m_lit2[i] = (s0 & 255) | ((s1 & 255) << 8) | ((l0 + (s1 >> 9)) << 16);
+        }
+      }
+
       for ( ; ; )
       {
         mz_uint8 *pSrc;
 
+        if ((size_t)(pOut_buf_cur - pCrc_cur) >= TINFL_CRC_CHUNK) TINFL_CRC_FLUSH();
+
+        // Fast path: while there is plenty of input and output, decode whole symbols and matches
+        // without the coroutine's per-byte bookkeeping. Near either end the loop below takes over.
+        if (decomp_flags & TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF)
+        {
+          mz_uint8 *pFast_out_end = pOut_buf_end;
+          if ((decomp_flags & TINFL_FLAG_COMPUTE_CRC32) && ((size_t)(pOut_buf_end - pCrc_cur) > TINFL_CRC_CHUNK + TINFL_FAST_OUT_MIN)) pFast_out_end = pCrc_cur + TINFL_CRC_CHUNK + TINFL_FAST_OUT_MIN;
+          counter = 0;
+          while (((pIn_buf_end - pIn_buf_cur) >= TINFL_FAST_IN_MIN) && ((pFast_out_end - pOut_buf_cur) >= TINFL_FAST_OUT_MIN))
+          {
+            int sym; mz_uint e;
+            TINFL_FAST_REFILL();
+            if ((e = r->m_pLit2[bit_buf & (TINFL_FAST_LOOKUP_SIZE - 1)]) != 0)
+            {
+              pOut_buf_cur[0] = (mz_uint8)e; pOut_buf_cur[1] = (mz_uint8)(e >> 8); pOut_buf_cur += 2;
+              bit_buf >>= e >> 16; num_bits -= e >> 16;
+              continue;
+            }
+            TINFL_FAST_DECODE(sym, r->m_pTables[0]);
+            if (sym < 256)
+            {
+              // A literal; take the next symbol too if the buffer still holds a full code.
+              *pOut_buf_cur++ = (mz_uint8)sym;
+              if (num_bits < 15) continue;
+              TINFL_FAST_DECODE(sym, r->m_pTables[0]);
+              if (sym < 256) { *pOut_buf_cur++ = (mz_uint8)sym; continue; }
+              if (num_bits < 5) TINFL_FAST_REFILL();
+            }
+            if ((counter = sym) == 256) break;
+
+            // Length codes 286/287 and distance codes 30/31 can be in a code but not in a stream:
+            // their base of 0 would wrap the copy loops below.
+            if (counter > 285)
+            {
+              TINFL_CR_RETURN_FOREVER(55, TINFL_STATUS_FAILED);
+            }
+            num_extra = s_length_extra[counter - 257]; counter = s_length_base[counter - 257];
+            if (num_extra) { counter += bit_buf & ((1U << num_extra) - 1); bit_buf >>= num_extra; num_bits -= num_extra; }
+
+            TINFL_FAST_REFILL();
+            TINFL_FAST_DECODE(sym, r->m_pTables[1]);
+            if (sym > 29)
+            {
+              TINFL_CR_RETURN_FOREVER(56, TINFL_STATUS_FAILED);
+            }
+            num_extra = s_dist_extra[sym]; dist = s_dist_base[sym];
+            if (num_extra) { if (num_bits < num_extra) TINFL_FAST_REFILL(); dist += bit_buf & ((1U << num_extra) - 1); bit_buf >>= num_extra; num_bits -= num_extra; }
+
+            if ((dist == 0) || (dist > (size_t)(pOut_buf_cur - pOut_buf_start)))
+            {
+              TINFL_CR_RETURN_FOREVER(54, TINFL_STATUS_FAILED);
+            }
+            pSrc = pOut_buf_cur - dist;
+            if (dist >= 4)
+            {
+              // Word copies; every load only sees bytes that are already written.
+              mz_uint8 *pOut_end = pOut_buf_cur + counter;
+              do { tinfl_copy32(pOut_buf_cur, pSrc); tinfl_copy32(pOut_buf_cur + 4, pSrc + 4); pOut_buf_cur += 8; pSrc += 8; } while (pOut_buf_cur < pOut_end);
+              pOut_buf_cur = pOut_end;
+            }
+            else if (counter >= TINFL_COPY_MATCH_MIN)
+            {
+              tinfl_copy_match(pOut_buf_cur, dist, counter); pOut_buf_cur += counter;
+            }
+            else
+            {
+              do { *pOut_buf_cur++ = *pSrc++; } while (--counter);
+            }
+            counter = 0;
+          }
+          bit_buf &= (((tinfl_bit_buf_t)1) << num_bits) - 1;
+          if (counter == 256) break;
+        }
+
         for ( ; ; )
         {
           if (((pIn_buf_end - pIn_buf_cur) < 4) || ((pOut_buf_end - pOut_buf_cur) < 2))
           {
-        	((void(*)())(0x708))();
-            TINFL_HUFF_DECODE(23, counter, &r->m_tables[0]);
+        	TINFL_TRACE(0x708);
+            TINFL_HUFF_DECODE(23, counter, r->m_pTables[0]);
             if (counter >= 256)
               break;
             while (pOut_buf_cur >= pOut_buf_end) { TINFL_CR_RETURN(24, TINFL_STATUS_HAS_MORE_OUTPUT); }
@@ -349,11 +544,11 @@ tinfl_status tinfl_decompress(tinfl_decompressor *r, const mz_uint8 *pIn_buf_nex
 #else
             if (num_bits < 15) { bit_buf |= (((tinfl_bit_buf_t)MZ_READ_LE16(pIn_buf_cur)) << num_bits); pIn_buf_cur += 2; num_bits += 16; }
 #endif
-            if ((sym2 = r->m_tables[0].m_look_up[bit_buf & (TINFL_FAST_LOOKUP_SIZE - 1)]) >= 0)
+            if ((sym2 = r->m_pTables[0]->m_look_up[bit_buf & (TINFL_FAST_LOOKUP_SIZE - 1)]) >= 0)
               code_len = sym2 >> 9;
             else
             {
-              code_len = TINFL_FAST_LOOKUP_BITS; do { sym2 = r->m_tables[0].m_tree[~sym2 + ((bit_buf >> code_len++) & 1)]; } while (sym2 < 0);
+              code_len = TINFL_FAST_LOOKUP_BITS; do { sym2 = r->m_pTables[0]->m_tree[~sym2 + ((bit_buf >> code_len++) & 1)]; } while (sym2 < 0);
             }
 
             counter = sym2; bit_buf >>= code_len; num_bits -= code_len;
@@ -369,11 +564,11 @@ tinfl_status tinfl_decompress(tinfl_decompressor *r, const mz_uint8 *pIn_buf_nex
             	num_bits += 16;
             }
 #endif
-            if ((sym2 = r->m_tables[0].m_look_up[bit_buf & (TINFL_FAST_LOOKUP_SIZE - 1)]) >= 0)
+            if ((sym2 = r->m_pTables[0]->m_look_up[bit_buf & (TINFL_FAST_LOOKUP_SIZE - 1)]) >= 0)
               code_len = sym2 >> 9;
             else
             {
-              code_len = TINFL_FAST_LOOKUP_BITS; do { sym2 = r->m_tables[0].m_tree[~sym2 + ((bit_buf >> code_len++) & 1)]; } while (sym2 < 0);
+              code_len = TINFL_FAST_LOOKUP_BITS; do { sym2 = r->m_pTables[0]->m_tree[~sym2 + ((bit_buf >> code_len++) & 1)]; } while (sym2 < 0);
             }
 
             bit_buf >>= code_len; num_bits -= code_len;
@@ -390,11 +585,19 @@ tinfl_status tinfl_decompress(tinfl_decompressor *r, const mz_uint8 *pIn_buf_nex
           }
         }
         if ((counter &= 511) == 256) break;
+        if (counter > 285)
+        {
+          TINFL_CR_RETURN_FOREVER(57, TINFL_STATUS_FAILED);
+        }
 
         num_extra = s_length_extra[counter - 257]; counter = s_length_base[counter - 257];
         if (num_extra) { mz_uint extra_bits; TINFL_GET_BITS(25, extra_bits, num_extra); counter += extra_bits; }
 
-        TINFL_HUFF_DECODE(26, dist, &r->m_tables[1]);
+        TINFL_HUFF_DECODE(26, dist, r->m_pTables[1]);
+        if (dist > 29)
+        {
+          TINFL_CR_RETURN_FOREVER(58, TINFL_STATUS_FAILED);
+        }
         num_extra = s_dist_extra[dist]; dist = s_dist_base[dist];
         if (num_extra) { mz_uint extra_bits; TINFL_GET_BITS(27, extra_bits, num_extra); dist += extra_bits; }
 
@@ -437,6 +640,13 @@ tinfl_status tinfl_decompress(tinfl_decompressor *r, const mz_uint8 *pIn_buf_nex
             continue;
           }
         }
+#else
+        else if ((counter >= TINFL_COPY_MATCH_MIN) && (pSrc < pOut_buf_cur))
+        {
+          // No unaligned word access: mem.c merges aligned words or replicates short patterns.
+          tinfl_copy_match(pOut_buf_cur, pOut_buf_cur - pSrc, counter); pOut_buf_cur += counter;
+          continue;
+        }
 #endif
         do
         {
@@ -456,14 +666,31 @@ tinfl_status tinfl_decompress(tinfl_decompressor *r, const mz_uint8 *pIn_buf_nex
     }
   } while (!(r->m_final & 1));
 
+  // Give back the whole bytes the bit buffer read ahead, so that *pIn_buf_size ends right at the gzip trailer.
+  TINFL_SKIP_BITS(32, num_bits & 7);
+  while ((pIn_buf_cur > pIn_buf_next) && (num_bits >= 8)) { --pIn_buf_cur; num_bits -= 8; }
+  bit_buf &= (tinfl_bit_buf_t)((((mz_uint64)1) << num_bits) - 1);
+
   if (decomp_flags & TINFL_FLAG_PARSE_ZLIB_HEADER)
   {
-    TINFL_SKIP_BITS(32, num_bits & 7); for (counter = 0; counter < 4; ++counter) { mz_uint s; if (num_bits) TINFL_GET_BITS(41, s, 8); else TINFL_GET_BYTE(42, s); r->m_z_adler32 = (r->m_z_adler32 << 8) | s; }
+    for (counter = 0; counter < 4; ++counter) { mz_uint s; if (num_bits) TINFL_GET_BITS(41, s, 8); else TINFL_GET_BYTE(42, s); r->m_z_adler32 = (r->m_z_adler32 << 8) | s; }
+  }
+  if ((decomp_flags & (TINFL_FLAG_PARSE_GZIP_HEADER | TINFL_FLAG_COMPUTE_CRC32)) == (TINFL_FLAG_PARSE_GZIP_HEADER | TINFL_FLAG_COMPUTE_CRC32))
+  {
+    // The gzip trailer: CRC-32 and ISIZE, both little endian.
+    TINFL_CRC_FLUSH();
+    for (counter = 0; counter < 8; ++counter)
+    {
+      mz_uint s; if (num_bits) TINFL_GET_BITS(43, s, 8); else TINFL_GET_BYTE(44, s);
+      if (counter < 4) r->m_z_crc32 = (r->m_z_crc32 >> 8) | (s << 24); else r->m_z_isize = (r->m_z_isize >> 8) | (s << 24);
+    }
+    if ((r->m_z_crc32 != ~r->m_check_crc32) || (r->m_z_isize != r->m_check_len)) { TINFL_CR_RETURN_FOREVER(45, TINFL_STATUS_CRC32_MISMATCH); }
   }
   TINFL_CR_RETURN_FOREVER(34, TINFL_STATUS_DONE);
   TINFL_CR_FINISH
 
 common_exit:
+  TINFL_CRC_FLUSH();
   r->m_num_bits = num_bits; r->m_bit_buf = bit_buf; r->m_dist = dist; r->m_counter = counter; r->m_num_extra = num_extra; r->m_dist_from_out_buf_start = dist_from_out_buf_start;
   *pIn_buf_size = pIn_buf_cur - pIn_buf_next; *pOut_buf_size = pOut_buf_cur - pOut_buf_next;
   if ((decomp_flags & (TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_COMPUTE_ADLER32)) && (status >= 0))
@@ -485,6 +712,40 @@ common_exit:
   return status;
 }
 
+#ifdef TRXLOADER_HOST
+#include <stdlib.h>
+
+int tinfl_decompress_mem_to_callback(const void *pIn_buf, size_t *pIn_buf_size, tinfl_put_buf_func_ptr pPut_buf_func, void *pPut_buf_user, int flags)
+{
+  int result = 0;
+  tinfl_decompressor decomp;
+  mz_uint8 *pDict = (mz_uint8*)malloc(TINFL_LZ_DICT_SIZE); size_t in_buf_ofs = 0, dict_ofs = 0;
+  if (!pDict)
+    return TINFL_STATUS_FAILED;
+  tinfl_init(&decomp);
+  for ( ; ; )
+  {
+    size_t in_buf_size = *pIn_buf_size - in_buf_ofs, dst_buf_size = TINFL_LZ_DICT_SIZE - dict_ofs;
+    // The whole stream is in pIn_buf, but with TINFL_FLAG_HAS_MORE_INPUT clear tinfl pads a truncated one with zeros, which
+    // can decode forever: keep it set, so running out of input ends in TINFL_STATUS_NEEDS_MORE_INPUT and fails below.
+    tinfl_status status = tinfl_decompress(&decomp, (const mz_uint8*)pIn_buf + in_buf_ofs, &in_buf_size, pDict, pDict + dict_ofs, &dst_buf_size,
+      (flags & ~TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF) | TINFL_FLAG_HAS_MORE_INPUT);
+    in_buf_ofs += in_buf_size;
+    if ((dst_buf_size) && (!(*pPut_buf_func)(pDict + dict_ofs, (int)dst_buf_size, pPut_buf_user)))
+      break;
+    if (status != TINFL_STATUS_HAS_MORE_OUTPUT)
+    {
+      result = (status == TINFL_STATUS_DONE);
+      break;
+    }
+    dict_ofs = (dict_ofs + dst_buf_size) & (TINFL_LZ_DICT_SIZE - 1);
+  }
+  free(pDict);
+  *pIn_buf_size = in_buf_ofs;
+  return result;
+}
+#endif // #ifdef TRXLOADER_HOST
+
 #endif // #ifndef TINFL_HEADER_FILE_ONLY
 
 /*
@@ -0,0 +1,680 @@
+/*
+ * tinflbench.c
+ *
+ * Host benchmark and differential harness for the loader's inflater.
+ * Each gzip'd kernel given on the command line is inflated by tinfl.c
+ * (with mem.c's copy routines, exactly as trxloader links them), by zlib
+ * and, when built WITH_LIBDEFLATE, by libdeflate.  The outputs must match
+ * each other and the gzip trailer; speed is reported as MB/s of output
+ * and CPU cycles per output byte.
+ *
+ * With -t, zlib compresses a set of generated inputs at every level and
+ * strategy (stored, fixed, dynamic, RLE and Huffman-only blocks) and tinfl
+ * has to reproduce them bit for bit, also with the trailer check the loader
+ * uses (TINFL_FLAG_COMPUTE_CRC32), which must reject a corrupted trailer.
+ * Hand-made fixed blocks with the length codes 286/287 and the distance
+ * codes 30/31, which no encoder emits, have to be rejected too, with
+ * nothing written past the output buffer.
+ * "tinfl+crc" is that check timed, so its cycles per byte over plain tinfl
+ * are the cost of verifying the kernel while it is inflated.
+ *
+ * LZ4 frames (lz4 -9 output) are decoded by lz4.c, the loader's other
+ * kernel decoder, and checked against the frame's XXH32 content checksum,
+ * so a kernel compressed both ways compares the two boot paths on size
+ * and speed.
+ *
+ * Built with TINFLBENCH_NO_ZLIB (the qemu-mips target) only tinfl is run
+ * and checked against the gzip CRC32 and ISIZE, using crc32.c instead of
+ * zlib's crc32() (the two can't be linked together).
+ *
+ * usage: tinflbench [-n rounds] [-t] [file.gz | file.lz4 ...]
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifndef TINFLBENCH_NO_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#ifdef TINFLBENCH_NO_ZLIB
+#include "extern.h"
+#endif
+#include "trxloader.h"
+
+#define	GZIP_FLG_MASK	0x1e	/* FHCRC, FEXTRA, FNAME, FCOMMENT */
+
+typedef size_t (*inflate_fn)(uint8_t *, size_t, const uint8_t *, size_t);
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec + tv.tv_usec / 1e6);
+}
+
+static uint64_t
+cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return (__rdtsc());
+#elif defined(__aarch64__)
+	uint64_t v;
+
+	__asm__ __volatile__("mrs %0, cntvct_el0" : "=r" (v));
+	return (v);
+#else
+	return (0);
+#endif
+}
+
+static size_t
+run_tinfl(uint8_t *out, size_t outlen, const uint8_t *in, size_t inlen)
+{
+	size_t n;
+
+	n = tinfl_decompress_mem_to_mem(out, outlen, in, inlen,
+	    TINFL_FLAG_PARSE_GZIP_HEADER);
+	return (n == TINFL_DECOMPRESS_MEM_TO_MEM_FAILED ? (size_t)-1 : n);
+}
+
+static size_t
+run_tinfl_crc(uint8_t *out, size_t outlen, const uint8_t *in, size_t inlen)
+{
+	size_t n;
+
+	n = tinfl_decompress_mem_to_mem(out, outlen, in, inlen,
+	    TINFL_FLAG_PARSE_GZIP_HEADER | TINFL_FLAG_COMPUTE_CRC32);
+	return (n >= TINFL_DECOMPRESS_MEM_TO_MEM_CRC32_MISMATCH ? (size_t)-1 :
+	    n);
+}
+
+static size_t
+run_lz4(uint8_t *out, size_t outlen, const uint8_t *in, size_t inlen)
+{
+	return (lz4_decompress_frame(out, outlen, in, inlen));
+}
+
+#ifndef TINFLBENCH_NO_ZLIB
+static size_t
+run_zlib(uint8_t *out, size_t outlen, const uint8_t *in, size_t inlen)
+{
+	z_stream zs;
+	int ret;
+
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK)
+		return ((size_t)-1);
+	zs.next_in = (uint8_t *)in;
+	zs.avail_in = inlen;
+	zs.next_out = out;
+	zs.avail_out = outlen;
+	ret = inflate(&zs, Z_FINISH);
+	inflateEnd(&zs);
+	return (ret == Z_STREAM_END ? zs.total_out : (size_t)-1);
+}
+#endif
+
+#ifdef HAVE_LIBDEFLATE
+static size_t
+run_libdeflate(uint8_t *out, size_t outlen, const uint8_t *in, size_t inlen)
+{
+	static struct libdeflate_decompressor *d;
+	size_t n;
+
+	if (d == NULL && (d = libdeflate_alloc_decompressor()) == NULL)
+		return ((size_t)-1);
+	if (libdeflate_gzip_decompress(d, in, inlen, out, outlen, &n) !=
+	    LIBDEFLATE_SUCCESS)
+		return ((size_t)-1);
+	return (n);
+}
+#endif
+
+enum { FMT_GZIP, FMT_LZ4 };
+
+/* The first decoder of each format is the one the loader uses. */
+static const struct {
+	const char	*name;
+	inflate_fn	 fn;
+	int		 fmt;
+} decoders[] = {
+	{ "tinfl",	run_tinfl,	FMT_GZIP },
+	{ "tinfl+crc",	run_tinfl_crc,	FMT_GZIP },
+#ifndef TINFLBENCH_NO_ZLIB
+	{ "zlib",	run_zlib,	FMT_GZIP },
+#endif
+#ifdef HAVE_LIBDEFLATE
+	{ "libdeflate",	run_libdeflate,	FMT_GZIP },
+#endif
+	{ "lz4",	run_lz4,	FMT_LZ4 },
+};
+#define	NDECODERS	(sizeof(decoders) / sizeof(decoders[0]))
+
+static uint8_t *
+read_file(const char *name, size_t *len)
+{
+	struct stat st;
+	uint8_t *buf;
+	ssize_t n;
+	size_t off;
+	int fd;
+
+	if ((fd = open(name, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		perror(name);
+		return (NULL);
+	}
+	if ((buf = malloc(st.st_size + 1)) == NULL) {
+		perror("malloc");
+		close(fd);
+		return (NULL);
+	}
+	for (off = 0; off < (size_t)st.st_size; off += n) {
+		if ((n = read(fd, buf + off, st.st_size - off)) <= 0) {
+			perror(name);
+			free(buf);
+			close(fd);
+			return (NULL);
+		}
+	}
+	close(fd);
+	*len = off;
+	return (buf);
+}
+
+static uint32_t
+gzip_crc32(const uint8_t *buf, size_t len)
+{
+#ifdef TINFLBENCH_NO_ZLIB
+	return (~crc32_update(~0U, buf, len));
+#else
+	return (crc32(0, buf, len));
+#endif
+}
+
+static uint32_t
+get_le32(const uint8_t *p)
+{
+	return (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+}
+
+#define	XXH_P1	2654435761U
+#define	XXH_P2	2246822519U
+#define	XXH_P3	3266489917U
+#define	XXH_P4	668265263U
+#define	XXH_P5	374761393U
+#define	XXH_ROTL(x, r)	(((x) << (r)) | ((x) >> (32 - (r))))
+
+/* XXH32 with seed 0, the LZ4 frame content checksum. */
+static uint32_t
+xxh32(const uint8_t *p, size_t len)
+{
+	const uint8_t *end = p + len;
+	uint32_t v[4] = { XXH_P1 + XXH_P2, XXH_P2, 0, -XXH_P1 };
+	uint32_t h;
+	int i;
+
+	if (len >= 16) {
+		for (; end - p >= 16; p += 16)
+			for (i = 0; i < 4; i++) {
+				v[i] += get_le32(p + 4 * i) * XXH_P2;
+				v[i] = XXH_ROTL(v[i], 13) * XXH_P1;
+			}
+		h = XXH_ROTL(v[0], 1) + XXH_ROTL(v[1], 7) +
+		    XXH_ROTL(v[2], 12) + XXH_ROTL(v[3], 18);
+	} else
+		h = XXH_P5;
+	h += len;
+	for (; end - p >= 4; p += 4) {
+		h += get_le32(p) * XXH_P3;
+		h = XXH_ROTL(h, 17) * XXH_P4;
+	}
+	for (; p < end; p++) {
+		h += *p * XXH_P5;
+		h = XXH_ROTL(h, 11) * XXH_P1;
+	}
+	h ^= h >> 15;
+	h *= XXH_P2;
+	h ^= h >> 13;
+	h *= XXH_P3;
+	h ^= h >> 16;
+	return (h);
+}
+
+/*
+ * Walks the blocks of an LZ4 frame to its EndMark and returns the content
+ * checksum behind it: 1 if there is one, 0 if not, -1 if the frame is cut
+ * short.
+ */
+static int
+lz4_checksum(const uint8_t *in, size_t inlen, uint32_t *sum)
+{
+	size_t off, bsize;
+	uint8_t flg = in[4];
+
+	off = 7 + ((flg & 0x08) ? 8 : 0);
+	for (;;) {
+		if (off + 4 > inlen)
+			return (-1);
+		bsize = get_le32(in + off) & 0x7fffffff;
+		off += 4;
+		if (bsize == 0)
+			break;
+		off += bsize + ((flg & 0x10) ? 4 : 0);
+	}
+	if (!(flg & 0x04))
+		return (0);
+	if (off + 4 > inlen)
+		return (-1);
+	*sum = get_le32(in + off);
+	return (1);
+}
+
+static int
+bench_file(const char *name, int rounds)
+{
+	uint8_t *in, *ref, *out;
+	size_t inlen, outlen, n;
+	uint32_t isize, crc;
+	uint64_t c0, c1, best_c, size;
+	double t0, t1, best_t;
+	unsigned d;
+	int r, fmt, first, ret = 0;
+
+	if ((in = read_file(name, &inlen)) == NULL)
+		return (-1);
+	if (inlen >= 7 && get_le32(in) == LZ4_FRAME_MAGIC) {
+		fmt = FMT_LZ4;
+		if (!lz4_frame_content_size(in, inlen, &size)) {
+			/* no size in the frame header: grow until it fits */
+			n = (size_t)-1;
+			for (size = inlen * 4; ; size *= 2) {
+				if ((out = malloc(size)) == NULL)
+					break;
+				n = run_lz4(out, size, in, inlen);
+				free(out);
+				out = NULL;
+				if (n != (size_t)-1 || size > ((size_t)1 << 30))
+					break;
+			}
+			size = n;
+		}
+		if (size == (uint64_t)(size_t)-1 || size > UINT32_MAX) {
+			printf("%s: LZ4 frame does not decode\n", name);
+			free(in);
+			return (-1);
+		}
+		isize = size;
+	} else if (inlen >= 18 && in[0] == 0x1f && in[1] == 0x8b &&
+	    in[2] == 8) {
+		fmt = FMT_GZIP;
+		/* The loader skips a fixed 10 byte header, just like tinfl. */
+		if (in[3] & GZIP_FLG_MASK) {
+			printf("%s: gzip header has optional fields (flags "
+			    "0x%02x), the loader can't parse it; use gzip -n\n",
+			    name, in[3]);
+			free(in);
+			return (-1);
+		}
+		isize = get_le32(in + inlen - 4);
+	} else {
+		printf("%s: neither gzip nor an LZ4 frame\n", name);
+		free(in);
+		return (-1);
+	}
+	outlen = isize;
+	ref = malloc(outlen + 1);
+	out = malloc(outlen + 1);
+	if (ref == NULL || out == NULL) {
+		perror("malloc");
+		ret = -1;
+		goto done;
+	}
+
+	printf("%s: %zu -> %u bytes (%.1f%%)\n", name, inlen, isize,
+	    isize ? 100.0 * inlen / isize : 0.0);
+	for (d = 0, first = 1; d < NDECODERS; d++) {
+		if (decoders[d].fmt != fmt)
+			continue;
+		memset(out, 0xa5, outlen);
+		n = decoders[d].fn(first ? ref : out, outlen, in, inlen);
+		if (n != isize) {
+			printf("  %-10s FAILED (%zd bytes)\n", decoders[d].name,
+			    (ssize_t)n);
+			ret = -1;
+			continue;
+		}
+		if (first && fmt == FMT_LZ4) {
+			first = 0;
+			if ((r = lz4_checksum(in, inlen, &crc)) < 0 ||
+			    (r > 0 && crc != xxh32(ref, n))) {
+				printf("  %-10s CHECKSUM MISMATCH\n",
+				    decoders[d].name);
+				ret = -1;
+			}
+		} else if (first) {
+			first = 0;
+			crc = gzip_crc32(ref, n);
+			if (crc != get_le32(in + inlen - 8)) {
+				printf("  %-10s CRC MISMATCH 0x%08x != 0x%08x\n",
+				    decoders[d].name, crc,
+				    get_le32(in + inlen - 8));
+				ret = -1;
+			}
+		} else if (memcmp(out, ref, n) != 0) {
+			printf("  %-10s DIFFERS from tinfl\n", decoders[d].name);
+			ret = -1;
+			continue;
+		}
+
+		best_t = 1e9;
+		best_c = UINT64_MAX;
+		for (r = 0; r < rounds; r++) {
+			t0 = now();
+			c0 = cycles();
+			decoders[d].fn(out, outlen, in, inlen);
+			c1 = cycles();
+			t1 = now();
+			if (t1 - t0 < best_t)
+				best_t = t1 - t0;
+			if (c1 - c0 < best_c)
+				best_c = c1 - c0;
+		}
+		if (best_c != 0)
+			printf("  %-10s %8.1f MB/s %7.2f cycles/byte\n",
+			    decoders[d].name, isize / best_t / 1e6,
+			    (double)best_c / isize);
+		else
+			printf("  %-10s %8.1f MB/s\n", decoders[d].name,
+			    isize / best_t / 1e6);
+	}
+
+done:
+	free(in);
+	free(ref);
+	free(out);
+	return (ret);
+}
+
+#ifndef TINFLBENCH_NO_ZLIB
+/*
+ * Generated corpora: incompressible, all zeros, short runs and text-like
+ * data with long matches, so that every block type and both short and
+ * far-away matches are exercised.
+ */
+static void
+gen_corpus(int kind, uint8_t *buf, size_t len)
+{
+	static const char *words[] = { "kernel ", "trx ", "loader ", "flash ",
+	    "mips ", "inflate ", "\n", "0123456789", "FreeBSD ", "bcm47xx " };
+	size_t i, j, w;
+
+	srandom(kind + 1);
+	for (i = 0; i < len; ) {
+		switch (kind) {
+		case 0:
+			buf[i++] = random();
+			break;
+		case 1:
+			buf[i++] = 0;
+			break;
+		case 2:
+			for (j = random() % 12, w = random(); j > 0 && i < len;
+			    j--)
+				buf[i++] = w;
+			break;
+		default:
+			w = random() % (sizeof(words) / sizeof(words[0]));
+			for (j = 0; words[w][j] != '\0' && i < len; j++)
+				buf[i++] = words[w][j];
+			if (i > 40000 && random() % 64 == 0) {
+				/* a far match, near the window limit */
+				for (j = 0; j < 200 && i < len; j++, i++)
+					buf[i] = buf[i - 32000];
+			}
+			break;
+		}
+	}
+}
+
+static int
+gzip_mem(uint8_t *out, size_t *outlen, const uint8_t *in, size_t inlen,
+    int level, int strategy)
+{
+	z_stream zs;
+	int ret;
+
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, level, Z_DEFLATED, 16 + MAX_WBITS, 8,
+	    strategy) != Z_OK)
+		return (-1);
+	zs.next_in = (uint8_t *)in;
+	zs.avail_in = inlen;
+	zs.next_out = out;
+	zs.avail_out = *outlen;
+	ret = deflate(&zs, Z_FINISH);
+	*outlen = zs.total_out;
+	deflateEnd(&zs);
+	return (ret == Z_STREAM_END ? 0 : -1);
+}
+
+struct bitwriter {
+	uint8_t		*buf;
+	size_t		len;
+	uint32_t	bits;
+	int		nbits;
+};
+
+static void
+put_bits(struct bitwriter *w, uint32_t v, int n)
+{
+	w->bits |= v << w->nbits;
+	for (w->nbits += n; w->nbits >= 8; w->nbits -= 8, w->bits >>= 8)
+		w->buf[w->len++] = w->bits;
+}
+
+/* A symbol of the fixed literal/length code, most significant bit first. */
+static void
+put_fixed(struct bitwriter *w, unsigned sym)
+{
+	uint32_t code, r = 0;
+	int n, i;
+
+	if (sym < 144) {
+		code = 0x30 + sym;
+		n = 8;
+	} else if (sym < 256) {
+		code = 0x190 + sym - 144;
+		n = 9;
+	} else if (sym < 280) {
+		code = sym - 256;
+		n = 7;
+	} else {
+		code = 0xc0 + sym - 280;
+		n = 8;
+	}
+	for (i = 0; i < n; i++)
+		r |= ((code >> i) & 1) << (n - 1 - i);
+	put_bits(w, r, n);
+}
+
+/*
+ * Fixed blocks of nlit literals, one match with a length and a distance
+ * code that are out of range, more literals and the end of block.  tinfl
+ * has to fail on every one of them, in its fast path and, with 280
+ * literals in front of a 300 byte buffer, in the loop that takes over
+ * near the end of the output.
+ */
+static int
+badcodes_test(void)
+{
+	static const struct {
+		unsigned	lsym, dsym;
+	} bad[] = { { 286, 0 }, { 287, 0 }, { 257, 30 }, { 257, 31 },
+	    { 285, 30 }, { 285, 31 }, { 286, 30 } };
+	static const size_t outlens[] = { 300, 4096 };
+	static const size_t nlits[] = { 0, 1, 280 };
+	struct bitwriter w;
+	uint8_t gz[1024], *out;
+	size_t b, o, l, i, n;
+	int fails = 0;
+
+	for (b = 0; b < sizeof(bad) / sizeof(bad[0]); b++) {
+		for (l = 0; l < sizeof(nlits) / sizeof(nlits[0]); l++) {
+			memset(&w, 0, sizeof(w));
+			w.buf = gz;
+			for (i = 0; i < 10; i++)
+				gz[w.len++] = "\x1f\x8b\x08\0\0\0\0\0\0\x03"[i];
+			put_bits(&w, 1, 1);
+			put_bits(&w, 1, 2);
+			/* a match needs something to copy from */
+			put_fixed(&w, 'a');
+			for (i = 0; i < nlits[l]; i++)
+				put_fixed(&w, 'a' + i % 26);
+			put_fixed(&w, bad[b].lsym);
+			for (i = 0; i < 5; i++)
+				put_bits(&w, (bad[b].dsym >> (4 - i)) & 1, 1);
+			for (i = 0; i < 200; i++)
+				put_fixed(&w, 'z');
+			put_fixed(&w, 256);
+			put_bits(&w, 0, 7);
+			memset(gz + w.len, 0, 8);
+			w.len += 8;
+			for (o = 0; o < sizeof(outlens) / sizeof(outlens[0]);
+			    o++) {
+				/* exactly outlens[o], so ASan sees an overrun */
+				if ((out = malloc(outlens[o])) == NULL)
+					return (-1);
+				n = run_tinfl(out, outlens[o], gz, w.len);
+				if (n == (size_t)-1)
+					n = run_tinfl_crc(out, outlens[o], gz,
+					    w.len);
+				free(out);
+				if (n == (size_t)-1)
+					continue;
+				printf("BAD CODES ACCEPTED length %u distance %u "
+				    "after %zu literals, output %zu: %zd bytes\n",
+				    bad[b].lsym, bad[b].dsym, nlits[l] + 1,
+				    outlens[o], (ssize_t)n);
+				fails++;
+			}
+		}
+	}
+	return (fails);
+}
+
+static int
+selftest(void)
+{
+	static const size_t sizes[] = { 0, 1, 100, 4096, 65536 + 7, 300000 };
+	static const int strategies[] = { Z_DEFAULT_STRATEGY, Z_FIXED,
+	    Z_HUFFMAN_ONLY, Z_RLE, Z_FILTERED };
+	static const int levels[] = { 0, 1, 6, 9 };
+	uint8_t *src, *gz, *out;
+	size_t s, gzlen, n, maxlen = 300000;
+	int kind, l, st, runs = 0, fails = 0;
+
+	src = malloc(maxlen);
+	gz = malloc(maxlen * 2 + 1024);
+	out = malloc(maxlen + 1);
+	if (src == NULL || gz == NULL || out == NULL) {
+		perror("malloc");
+		return (-1);
+	}
+	for (kind = 0; kind < 4; kind++) {
+		for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+			gen_corpus(kind, src, sizes[s]);
+			for (l = 0; l < (int)(sizeof(levels) / sizeof(levels[0]));
+			    l++) {
+				for (st = 0; st < (int)(sizeof(strategies) /
+				    sizeof(strategies[0])); st++) {
+					gzlen = maxlen * 2 + 1024;
+					if (gzip_mem(gz, &gzlen, src, sizes[s],
+					    levels[l], strategies[st]) != 0) {
+						printf("deflate failed\n");
+						fails++;
+						continue;
+					}
+					runs++;
+					n = run_tinfl(out, maxlen, gz, gzlen);
+					if (n == sizes[s] &&
+					    memcmp(out, src, n) == 0 &&
+					    run_tinfl_crc(out, maxlen, gz, gzlen) ==
+					    n && memcmp(out, src, n) == 0) {
+						/* a stored ISIZE or CRC bit off */
+						gz[gzlen - 1 - (runs & 7)] ^=
+						    1 << (runs % 8);
+						n = run_tinfl_crc(out, maxlen, gz,
+						    gzlen);
+						if (n == (size_t)-1)
+							continue;
+						printf("BAD TRAILER ACCEPTED ");
+					}
+					printf("MISMATCH corpus %d size %zu "
+					    "level %d strategy %d: %zd bytes\n",
+					    kind, sizes[s], levels[l],
+					    strategies[st], (ssize_t)n);
+					fails++;
+				}
+			}
+		}
+	}
+	fails += badcodes_test();
+	printf("selftest: %d streams, %d failures\n", runs, fails);
+	free(src);
+	free(gz);
+	free(out);
+	return (fails ? -1 : 0);
+}
+#endif
+
+int
+main(int argc, char **argv)
+{
+	int ch, rounds = 10, test = 0, ret = 0;
+
+	while ((ch = getopt(argc, argv, "n:t")) != -1) {
+		switch (ch) {
+		case 'n':
+			rounds = atoi(optarg);
+			break;
+		case 't':
+			test = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n rounds] [-t] "
+			    "[file.gz ...]\n", argv[0]);
+			return (1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (rounds < 1)
+		rounds = 1;
+#ifndef TINFLBENCH_NO_ZLIB
+	if (test && selftest() != 0)
+		ret = 1;
+#else
+	if (test)
+		printf("selftest needs zlib, skipped\n");
+#endif
+	for (; argc > 0; argc--, argv++)
+		if (bench_file(argv[0], rounds) != 0)
+			ret = 1;
+	return (ret);
+}
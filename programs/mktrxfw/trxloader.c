@@ -1,82 +1,176 @@
 #include "trxloader.h"
 
-void _startC(register_t a0, register_t a1, register_t a2, register_t a3){
-	__asm__ __volatile__(
-			"lui	$t0, 0x80ff\n"
-			"move 	$sp, $t0\n"
-			"ehb");
+#define STR(x)		#x
+#define XSTR(x)		STR(x)
+
+void _startC(register_t a0, register_t a1, register_t a2, register_t a3);
+void sync_icache(uintptr_t start, size_t len);
+static void boot_stamp(u_int32_t stage);
+
+/*
+ * CFE starts the loader at LOADER_CFEADDR, which is where kernels want to
+ * be loaded too, so the loader is linked at LOADER_RUNADDR instead.  This
+ * stub, the only code that runs at the CFE address, copies the image up,
+ * clears the bss, sets up the stack and enters _startC() at its linked
+ * address.  It only uses branches and absolute addresses, so it works from
+ * either copy; a0-a3 from CFE are passed on to the kernel untouched.
+ */
+__asm__(
+"	.section .text.entry, \"ax\", @progbits\n"
+"	.set	push\n"
+"	.set	noreorder\n"
+"	.globl	_start\n"
+"	.ent	_start\n"
+"_start:\n"
+"	li	$t0, " XSTR(LOADER_CFEADDR) "\n"
+"	la	$t1, _start\n"
+"	la	$t2, _edata\n"
+"1:	lw	$t3, 0($t0)\n"
+"	addiu	$t0, $t0, 4\n"
+"	sw	$t3, 0($t1)\n"
+"	addiu	$t1, $t1, 4\n"
+"	bne	$t1, $t2, 1b\n"
+"	nop\n"
+"	la	$t2, _end\n"
+"2:	beq	$t1, $t2, 3f\n"
+"	nop\n"
+"	sw	$zero, 0($t1)\n"
+"	b	2b\n"
+"	addiu	$t1, $t1, 4\n"
+"3:	li	$sp, " XSTR(LOADER_STACK) "\n"
+"	move	$s0, $a0\n"
+"	move	$s1, $a1\n"
+"	move	$s2, $a2\n"
+"	move	$s3, $a3\n"
+"	la	$a0, _start\n"
+"	la	$a1, _end\n"
+"	bal	sync_icache\n"
+"	subu	$a1, $a1, $a0\n"
+"	move	$a0, $s0\n"
+"	move	$a1, $s1\n"
+"	move	$a2, $s2\n"
+"	move	$a3, $s3\n"
+"	la	$t9, _startC\n"
+"	jr	$t9\n"
+"	nop\n"
+"	.end	_start\n"
+"	.set	pop\n"
+"	.text\n");
 
-	uint32_t* ptr = (unsigned int*)FLASHADDR;
+// Filled in by mktrxfw -f; the magic alone sends trx_find() scanning flash.
+struct trx_boot_desc trx_boot = { BOOTDESC_MAGIC };
+
+void _startC(register_t a0, register_t a1, register_t a2, register_t a3){
 	void (*entry_point)(register_t, register_t, register_t, register_t) = (void*)FAIL;
+	const struct trx_header* h;
+	size_t size;
 
-	for(int i = 0; i < 0x200; i++) {//32MB
-		if(*ptr != MAGIC){
-			ptr += 0x1000; // 0xbc800000 0x1000 / sizeof(uint32_t); //+4 - 0x40000
-			continue;
-		}
-		//found TRX - copy as-is to 0x80001000
-		struct trx_header* h = (struct trx_header*)ptr;
-		uint32_t* kstart = (uint32_t*)(((char*)ptr) + h->offsets[1]);
-		int size = h->offsets[2] - h->offsets[1];
+	boot_stamp(BOOTSTAMP_START);
+	h = trx_find(&trx_boot, FLASHADDR, FLASHSIZE, &size);
+	boot_stamp(BOOTSTAMP_FOUND);
+	if(h != 0){
+		//found TRX - unpack the trampoline to TARGETADDR, or the plain
+		//kernel straight to its load address if the TRX describes one
+		const struct trx_kernel_desc* kd = trx_kernel_desc(h);
+		const uint32_t* kstart = (const uint32_t*)((const char*)h + h->offsets[1]);
 		uint32_t* dst = (uint32_t*)TARGETADDR;
+		size_t dstlen = TARGETSIZE;
 
 		entry_point = (void*)TARGETADDR;
-		size_t res = tinfl_decompress_mem_to_mem((uint32_t*)TARGETADDR, 0x700000, kstart, size, TINFL_FLAG_PARSE_GZIP_HEADER);
+		if(kd != 0){
+			dst = (uint32_t*)(uintptr_t)kd->load_addr;
+			dstlen = kd->size;
+			entry_point = (void*)(uintptr_t)kd->entry;
+		}
+		size_t res;
+		boot_stamp(BOOTSTAMP_HEADERS);
+		if(h->flags & TRX_FLAG_LZ4)
+			res = lz4_decompress_frame(dst, dstlen, kstart, size);
+		else
+			res = tinfl_decompress_mem_to_mem(dst, dstlen, kstart, size, TINFL_FLAG_PARSE_GZIP_HEADER | TINFL_FLAG_COMPUTE_CRC32);
 
-		if(res > 0x900000){
+		/* the kernel inflated, but not to what was packed */
+		if(res == TINFL_DECOMPRESS_MEM_TO_MEM_CRC32_MISMATCH){
+			boot_stamp(BOOTSTAMP_FAIL);
+			entry_point = (void*)FAIL2;
+			entry_point(res,a1,a2,a3);
+		}
+		if(res > dstlen){
+			boot_stamp(BOOTSTAMP_FAIL);
 			entry_point = (void*)FAIL3;
 			entry_point(res,a1,a2,a3);
 		}
 
+		if(h->flags & TRX_FLAG_BCJ)
+			mips_bcj_decode(dst, res);
+		boot_stamp(BOOTSTAMP_UNPACKED);
+
+		sync_icache((uintptr_t)dst, res);
+		boot_stamp(BOOTSTAMP_JUMP);
 		entry_point(a0,a1,a2,a3);
 	}
+	boot_stamp(BOOTSTAMP_FAIL);
 	entry_point(a0,a1,a2,a3);
 }
 
-void * memcpy(void *o_dst, const void *o_src, size_t len){
-	size_t size = len;
-	uint32_t* dst = o_dst;
-	uint32_t* src = (uint32_t*)o_src;
-
-	while(size >= sizeof(uint32_t)){
-		*dst = *src;
-		size -= sizeof(uint32_t);
-		src++;
-		dst++;
-	}
+/*
+ * Append CP0 Count to the timestamp ring, starting a new boot (or a new
+ * ring, if what is there isn't one) at BOOTSTAMP_START.  The ring is
+ * written through KSEG1, so a RAM dump sees it without a cache flush.
+ */
+static void boot_stamp(u_int32_t stage){
+	volatile struct trx_boot_stamps* bs = (volatile struct trx_boot_stamps*)BOOTSTAMP_ADDR;
+	u_int32_t count, i;
 
-	uint8_t* bdst = (uint8_t*)dst;
-	uint8_t* bsrc = (uint8_t*)src;
-	while(size > 0){
-		*bdst = *bsrc;
-		size -= 1;
-		bsrc++;
-		bdst++;
+	__asm__ __volatile__(".set push; .set mips32; mfc0 %0, $9; .set pop" : "=r" (count));
+	if(stage == BOOTSTAMP_START){
+		if(bs->magic != BOOTSTAMP_MAGIC || bs->version != BOOTSTAMP_VERSION ||
+		    bs->slots != BOOTSTAMP_SLOTS){
+			bs->boots = bs->head = 0;
+			bs->version = BOOTSTAMP_VERSION;
+			bs->slots = BOOTSTAMP_SLOTS;
+			bs->magic = BOOTSTAMP_MAGIC;
+		}
+		bs->boots++;
 	}
-
-	return o_dst;
+	i = bs->head % BOOTSTAMP_SLOTS;
+	bs->ring[i].count = count;
+	bs->ring[i].tag = BOOTSTAMP_TAG(bs->boots, stage);
+	bs->head++;
 }
 
-void * memset(void *b, int c, size_t len){
-	size_t size = len;
-	uint32_t* dst = b;
-	uint8_t short_value = (uint8_t)c;
-	uint32_t value = short_value;
-	uint32_t word = (value << 24) | (value << 16) | (value << 8) | value;
-
-	while(size >= sizeof(uint32_t)){
-		*dst = word;
-		size -= sizeof(uint32_t);
-		dst++;
-	}
-
-	uint8_t* bdst = (uint8_t*)dst;
+/*
+ * Make freshly written code visible to instruction fetch: write back the
+ * data cache and drop the instruction cache lines of the range.  Line
+ * sizes come from CP0 Config1, where 0 means there is no such cache.
+ */
+void sync_icache(uintptr_t start, size_t len){
+	uintptr_t p, end = start + len;
+	uint32_t config1, line;
 
-	while(size > 0){
-		*bdst = short_value;
-		size -= 1;
-		bdst++;
+	__asm__ __volatile__(".set push; .set mips32; mfc0 %0, $16, 1; .set pop" : "=r" (config1));
+	if((line = (config1 >> 10) & 7) != 0){
+		line = 2 << line;
+		for(p = start & ~(line - 1); p < end; p += line) // Hit_Writeback_Inv_D
+			__asm__ __volatile__(".set push; .set mips32; cache 0x15, 0(%0); .set pop" : : "r" (p));
+		__asm__ __volatile__(".set push; .set mips32; sync; .set pop");
+	}
+	if((line = (config1 >> 19) & 7) != 0){
+		line = 2 << line;
+		for(p = start & ~(line - 1); p < end; p += line) // Hit_Invalidate_I
+			__asm__ __volatile__(".set push; .set mips32; cache 0x10, 0(%0); .set pop" : : "r" (p));
 	}
+}
 
-	return b;
+/*
+ * The compiler emits memcpy()/memset() calls for struct copies and large
+ * initialisers; route them through mem.c, which copies unaligned buffers
+ * with aligned word accesses instead of faulting on them.
+ */
+void * memcpy(void *o_dst, const void *o_src, size_t len){
+	return tinfl_memcpy(o_dst, o_src, len);
+}
+
+void * memset(void *b, int c, size_t len){
+	return tinfl_memset(b, c, len);
 }
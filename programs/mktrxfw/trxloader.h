@@ -9,14 +9,33 @@
 #define TRXLOADER_H_
 
 #include <sys/types.h>
+#ifdef TRXLOADER_HOST
+#include <stdint.h>
+#endif
 
 #define FLASHADDR 			0xbc000000
+#define FLASHSIZE			0x02000000 // flash window at FLASHADDR
 #define TARGETADDR			0x80900000 // Trampoline
+#define LOADER_CFEADDR			0x80001000 // CFE starts the loader here
+#define LOADER_RUNADDR			0x80fc0000 // and it moves itself here, keep in sync with loader.lds
+#define LOADER_STACK			0x80ff0000
+#define TARGETSIZE			(LOADER_RUNADDR - TARGETADDR) // Inflate window at TARGETADDR, up to the loader (6.75 MB)
 #define FAIL				0x00000004 // CFE exception
 #define FAIL2				0x00000008 // CFE exception
 #define FAIL3				0x00000010 // CFE exception
 #define MAGIC				0x30524448 // "HDR0"
 #define NUM_OFFSETS			3
+#define TRX_FLAG_LZ4			0x0100 // kernel is an LZ4 frame instead of gzip
+#define TRX_FLAG_BCJ			0x0200 // kernel calls went through mips_bcj_encode()
+#define LZ4_FRAME_MAGIC			0x184d2204
+#define KDESC_MAGIC			0x4353444b // "KDSC"
+#define BOOTDESC_MAGIC			0x43534442 // "BDSC"
+#define TRX_SCAN_STEP			0x4000 // flash is probed for the TRX every 16 KB
+#define TRX_SCAN_COUNT			0x200
+#define BOOTSTAMP_ADDR			(LOADER_STACK | 0x20000000) // above the stack, through KSEG1
+#define BOOTSTAMP_MAGIC			0x504d5453 // "STMP"
+#define BOOTSTAMP_VERSION		1
+#define BOOTSTAMP_SLOTS			32
 
 struct trx_header {
 	u_int32_t magic;
@@ -27,10 +46,137 @@ struct trx_header {
 	u_int32_t offsets[NUM_OFFSETS];
 };
 
+/*
+ * Kernel descriptor: the last bytes of the loader segment when the kernel
+ * segment holds a plain kernel image (objcopy -O binary) instead of a
+ * trampoline.  The loader unpacks it to load_addr, where size bytes must
+ * come out, and jumps to entry; mktrxfw -e fills it in from the ELF.
+ */
+struct trx_kernel_desc {
+	u_int32_t magic;
+	u_int32_t load_addr;
+	u_int32_t entry;
+	u_int32_t size;
+};
+
+// Whether the loader can use kd: a kernel that ends below the loader and contains its entry.
+static inline int trx_kernel_desc_valid(const struct trx_kernel_desc* kd){
+	return kd->magic == KDESC_MAGIC && kd->load_addr >= 0x80000000 &&
+	    kd->load_addr < LOADER_RUNADDR && kd->size != 0 &&
+	    kd->size <= LOADER_RUNADDR - kd->load_addr &&
+	    kd->entry - kd->load_addr < kd->size;
+}
+
+// The descriptor of a mapped TRX image, or NULL if it has none the loader can use.
+static inline const struct trx_kernel_desc* trx_kernel_desc(const struct trx_header* h){
+	const struct trx_kernel_desc* kd =
+	    (const struct trx_kernel_desc*)((const char*)h + h->offsets[1]) - 1;
+
+	if(h->offsets[1] < h->offsets[0] + sizeof(*kd) || !trx_kernel_desc_valid(kd))
+		return 0;
+	return kd;
+}
+
+/*
+ * Boot descriptor: where the TRX sits in flash and which kernel it holds,
+ * patched into the loader (inside loader.gz, which mkloadergz writes with
+ * this struct in a stored block) by mktrxfw -f.  It saves the loader the
+ * probing of flash through KSEG1; trx_find() falls back to the scan when it
+ * is left unpatched or no longer matches what is in flash.  kernel_len is
+ * the length of the compressed stream, kernel_crc the CRC-32 of the kernel
+ * it unpacks to (the gzip trailer CRC for gzip kernels).
+ */
+struct trx_boot_desc {
+	u_int32_t magic;
+	u_int32_t trx_off;
+	u_int32_t kernel_off;
+	u_int32_t kernel_len;
+	u_int32_t kernel_crc;
+};
+
+// The TRX header bd points to in a flash of flash_size bytes at flash, or NULL if it doesn't check out.
+static inline const struct trx_header* trx_boot_desc_check(const struct trx_boot_desc* bd,
+    uintptr_t flash, size_t flash_size){
+	const struct trx_header* h = (const struct trx_header*)(flash + bd->trx_off);
+	const u_int8_t* t;
+
+	if(bd->magic != BOOTDESC_MAGIC || bd->trx_off % 4 != 0 ||
+	    bd->trx_off > flash_size - sizeof(*h) || h->magic != MAGIC ||
+	    h->offsets[1] != bd->kernel_off || h->offsets[2] <= h->offsets[1] ||
+	    bd->kernel_len < 8 || bd->kernel_len > h->offsets[2] - h->offsets[1] ||
+	    bd->kernel_off + bd->kernel_len > flash_size - bd->trx_off)
+		return 0;
+	if(!(h->flags & TRX_FLAG_LZ4)){
+		// gzip trailer: CRC-32 and size of the kernel, little endian
+		t = (const u_int8_t*)h + bd->kernel_off + bd->kernel_len - 8;
+		if((t[0] | (t[1] << 8) | (t[2] << 16) | ((u_int32_t)t[3] << 24)) != bd->kernel_crc)
+			return 0;
+	}
+	return h;
+}
+
+/*
+ * The TRX to boot: the one the boot descriptor names, else the first one
+ * found probing flash every TRX_SCAN_STEP bytes.  *klen is set to the
+ * length of the kernel segment to unpack.
+ */
+static inline const struct trx_header* trx_find(const struct trx_boot_desc* bd,
+    uintptr_t flash, size_t flash_size, size_t* klen){
+	const struct trx_header* h;
+
+	if((h = trx_boot_desc_check(bd, flash, flash_size)) != 0){
+		*klen = bd->kernel_len;
+		return h;
+	}
+	for(size_t off = 0; off < (size_t)TRX_SCAN_STEP * TRX_SCAN_COUNT &&
+	    off + sizeof(*h) <= flash_size; off += TRX_SCAN_STEP){
+		h = (const struct trx_header*)(flash + off);
+		if(h->magic == MAGIC){
+			*klen = h->offsets[2] - h->offsets[1];
+			return h;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Boot stage timestamps: the loader appends the CP0 Count of each stage it
+ * reaches to a ring at BOOTSTAMP_ADDR, outside its image, and keeps what
+ * earlier boots left there as long as the magic and version match.  Each
+ * record is tagged with the boot it belongs to (boots, counted from 1) and
+ * the stage; head counts the records ever written, so the ring holds the
+ * last BOOTSTAMP_SLOTS of them.  bootstamp decodes a RAM dump of it.
+ */
+enum {
+	BOOTSTAMP_START = 1,	// _startC entered: loader moved, bss cleared
+	BOOTSTAMP_FOUND,	// trx_find() done, by descriptor or flash scan
+	BOOTSTAMP_HEADERS,	// TRX, kernel descriptor and stream header read
+	BOOTSTAMP_UNPACKED,	// kernel inflated (and checked) or LZ4 decoded, calls converted back
+	BOOTSTAMP_JUMP,		// caches synced, jumping to the kernel
+	BOOTSTAMP_FAIL,		// about to take a FAIL vector
+};
+
+#define BOOTSTAMP_TAG(boot, stage)	((u_int32_t)(boot) << 8 | (stage))
+#define BOOTSTAMP_TAG_BOOT(tag)		((tag) >> 8)
+#define BOOTSTAMP_TAG_STAGE(tag)	((tag) & 0xff)
+
+struct trx_boot_stamps {
+	u_int32_t magic;
+	u_int16_t version;
+	u_int16_t slots;
+	u_int32_t boots;
+	u_int32_t head;
+	struct {
+		u_int32_t tag;
+		u_int32_t count;
+	} ring[BOOTSTAMP_SLOTS];
+};
+
 void * memcpy(void *o_dst, const void *o_src, size_t len);
 void * memset(void *b, int c, size_t len);
 
 void * tinfl_memcpy(void *o_dst, const void *o_src, size_t len);
+void * tinfl_copy_match(void *o_dst, size_t dist, size_t len); // dist >= 1
 void * tinfl_memset(void *b, int c, size_t len);
 
 extern uint8_t d_stop;
@@ -41,6 +187,7 @@ extern uint8_t d_stop;
 // TINFL_FLAG_HAS_MORE_INPUT: If set, there are more input bytes available beyond the end of the supplied input buffer. If clear, the input buffer contains all remaining input.
 // TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF: If set, the output buffer is large enough to hold the entire decompressed stream. If clear, the output buffer is at least the size of the dictionary (typically 32KB).
 // TINFL_FLAG_COMPUTE_ADLER32: Force adler-32 checksum computation of the decompressed bytes.
+// TINFL_FLAG_COMPUTE_CRC32: Compute the CRC-32 of the decompressed bytes as they are written; with TINFL_FLAG_PARSE_GZIP_HEADER, check it and the length against the gzip trailer.
 enum
 {
   TINFL_FLAG_PARSE_ZLIB_HEADER = 1,
@@ -48,12 +195,39 @@ enum
   TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF = 4,
   TINFL_FLAG_COMPUTE_ADLER32 = 8,
   TINFL_FLAG_PARSE_GZIP_HEADER = 16,
+  TINFL_FLAG_COMPUTE_CRC32 = 32,
 };
 
 // tinfl_decompress_mem_to_mem() decompresses a block in memory to another block in memory.
-// Returns TINFL_DECOMPRESS_MEM_TO_MEM_FAILED on failure, or the number of bytes written on success.
+// Returns TINFL_DECOMPRESS_MEM_TO_MEM_FAILED on failure, TINFL_DECOMPRESS_MEM_TO_MEM_CRC32_MISMATCH if the output does not match the gzip trailer, or the number of bytes written on success.
 #define TINFL_DECOMPRESS_MEM_TO_MEM_FAILED ((size_t)(-1))
+#define TINFL_DECOMPRESS_MEM_TO_MEM_CRC32_MISMATCH ((size_t)(-2))
 size_t tinfl_decompress_mem_to_mem(void *pOut_buf, size_t out_buf_len, const void *pSrc_buf, size_t src_buf_len, int flags);
 
+// lz4_decompress_frame() decodes an LZ4 frame (lz4.c) into a flat buffer.
+// Returns LZ4_DECOMPRESS_FAILED on failure, or the number of bytes written on success.
+#define LZ4_DECOMPRESS_FAILED ((size_t)(-1))
+size_t lz4_decompress_frame(void *pOut_buf, size_t out_buf_len, const void *pSrc_buf, size_t src_buf_len);
+
+// mips_bcj_encode() and mips_bcj_decode() convert the PC-relative calls of a word aligned,
+// little endian MIPS image to image-relative targets and back, in place (bcj.c).
+// Both return the number of calls converted.
+size_t mips_bcj_encode(void *buf, size_t len);
+size_t mips_bcj_decode(void *buf, size_t len);
+
+#ifdef TRXLOADER_HOST
+// lz4_frame_content_size() returns 1 and the decoded size if the frame header records it, else 0.
+int lz4_frame_content_size(const void *pSrc_buf, size_t src_buf_len, uint64_t *size);
+
+// lz4_frame_length() returns the length of the frame at the start of the buffer, EndMark and
+// checksums included, or LZ4_DECOMPRESS_FAILED if it is cut short.  Nothing is decoded.
+size_t lz4_frame_length(const void *pSrc_buf, size_t src_buf_len);
+
+// tinfl_decompress_mem_to_callback() decompresses a block in memory to an internal 32KB buffer, and a user provided callback function will be called to flush the buffer.
+// Returns 1 on success or 0 on failure, which includes a stream cut short and a callback returning 0.
+typedef int (*tinfl_put_buf_func_ptr)(const void* pBuf, int len, void *pUser);
+int tinfl_decompress_mem_to_callback(const void *pIn_buf, size_t *pIn_buf_size, tinfl_put_buf_func_ptr pPut_buf_func, void *pPut_buf_user, int flags);
+#endif
+
 
 #endif /* TRXLOADER_H_ */